@@ -0,0 +1,732 @@
+/**********************************************************************
+
+  atomic.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+VALUE rb_cXThreadAtomicInteger;
+VALUE rb_cXThreadAtomicReference;
+VALUE rb_cXThreadAdder;
+
+/*
+ * AtomicInteger and the Adder cells hold a machine word updated with
+ * the atomic operations of xthread-internal.h, so they stay correct
+ * when C code updates them without the GVL.  Arithmetic wraps around
+ * at the bounds of a signed word.
+ */
+#define ATOMIC2NUM(v) SSIZET2NUM((ssize_t)(v))
+#define NUM2ATOMIC(n) ((VALUE)NUM2SSIZET(n))
+
+/* AtomicInteger */
+
+typedef struct rb_xthread_atomic_integer_struct
+{
+  VALUE value;
+} xthread_atomic_integer_t;
+
+#define GetXThreadAtomicIntegerPtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_atomic_integer_t, &xthread_atomic_integer_data_type, (tobj))
+
+static size_t
+xthread_atomic_integer_memsize(const void *ptr)
+{
+  return ptr ? sizeof(xthread_atomic_integer_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_atomic_integer_data_type = {
+    "xthread_atomic_integer",
+    {0, RUBY_TYPED_DEFAULT_FREE, xthread_atomic_integer_memsize,},
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_atomic_integer_data_type = {
+    "xthread_atomic_integer",
+    0,
+    RUBY_TYPED_DEFAULT_FREE,
+    xthread_atomic_integer_memsize,
+};
+#endif
+
+static VALUE
+xthread_atomic_integer_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_atomic_integer_t *ai;
+
+  obj = TypedData_Make_Struct(klass, xthread_atomic_integer_t,
+			      &xthread_atomic_integer_data_type, ai);
+  ai->value = 0;
+  return obj;
+}
+
+/*
+ *  call-seq:
+ *     AtomicInteger.new(value = 0)
+ */
+static VALUE
+xthread_atomic_integer_initialize(int argc, VALUE *argv, VALUE self)
+{
+  xthread_atomic_integer_t *ai;
+  VALUE v;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  rb_scan_args(argc, argv, "01", &v);
+  xthread_atomic_store(&ai->value, NIL_P(v) ? 0 : NUM2ATOMIC(v));
+  return self;
+}
+
+VALUE
+rb_xthread_atomic_integer_new(ssize_t value)
+{
+  VALUE self;
+  xthread_atomic_integer_t *ai;
+
+  self = xthread_atomic_integer_alloc(rb_cXThreadAtomicInteger);
+  GetXThreadAtomicIntegerPtr(self, ai);
+  ai->value = (VALUE)value;
+  return self;
+}
+
+/* adds delta and returns the new value */
+ssize_t
+rb_xthread_atomic_integer_add(VALUE self, ssize_t delta)
+{
+  xthread_atomic_integer_t *ai;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  return (ssize_t)(xthread_atomic_fetch_add(&ai->value, (VALUE)delta) + (VALUE)delta);
+}
+
+VALUE
+rb_xthread_atomic_integer_get(VALUE self)
+{
+  xthread_atomic_integer_t *ai;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  return ATOMIC2NUM(xthread_atomic_load(&ai->value));
+}
+
+VALUE
+rb_xthread_atomic_integer_set(VALUE self, VALUE v)
+{
+  xthread_atomic_integer_t *ai;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  xthread_atomic_store(&ai->value, NUM2ATOMIC(v));
+  return v;
+}
+
+static VALUE
+xthread_atomic_integer_get_and_set(VALUE self, VALUE v)
+{
+  xthread_atomic_integer_t *ai;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  return ATOMIC2NUM(xthread_atomic_exchange(&ai->value, NUM2ATOMIC(v)));
+}
+
+/*
+ *  call-seq:
+ *     compare_and_set(expect, value) -> true or false
+ *
+ *  Sets +value+ if the current value is +expect+.
+ */
+VALUE
+rb_xthread_atomic_integer_compare_and_set(VALUE self, VALUE expect, VALUE v)
+{
+  xthread_atomic_integer_t *ai;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  return xthread_atomic_cas(&ai->value, NUM2ATOMIC(expect), NUM2ATOMIC(v)) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     increment(delta = 1) -> new value
+ */
+static VALUE
+xthread_atomic_integer_increment(int argc, VALUE *argv, VALUE self)
+{
+  VALUE delta;
+
+  rb_scan_args(argc, argv, "01", &delta);
+  return ATOMIC2NUM(rb_xthread_atomic_integer_add(self, NIL_P(delta) ? 1 : NUM2SSIZET(delta)));
+}
+
+/*
+ *  call-seq:
+ *     decrement(delta = 1) -> new value
+ */
+static VALUE
+xthread_atomic_integer_decrement(int argc, VALUE *argv, VALUE self)
+{
+  VALUE delta;
+
+  rb_scan_args(argc, argv, "01", &delta);
+  return ATOMIC2NUM(rb_xthread_atomic_integer_add(self, NIL_P(delta) ? -1 : -NUM2SSIZET(delta)));
+}
+
+/*
+ *  call-seq:
+ *     get_and_add(delta) -> old value
+ */
+static VALUE
+xthread_atomic_integer_get_and_add(VALUE self, VALUE delta)
+{
+  xthread_atomic_integer_t *ai;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  return ATOMIC2NUM(xthread_atomic_fetch_add(&ai->value, NUM2ATOMIC(delta)));
+}
+
+/* CAS loop around the block; the block may run more than once */
+static VALUE
+xthread_atomic_integer_update(VALUE self, int return_old)
+{
+  xthread_atomic_integer_t *ai;
+  VALUE old, v;
+
+  GetXThreadAtomicIntegerPtr(self, ai);
+  do {
+    old = xthread_atomic_load(&ai->value);
+    v = NUM2ATOMIC(rb_yield(ATOMIC2NUM(old)));
+  } while (!xthread_atomic_cas(&ai->value, old, v));
+  return ATOMIC2NUM(return_old ? old : v);
+}
+
+/*
+ *  call-seq:
+ *     get_and_update {|value| ... } -> old value
+ *
+ *  Sets the block's result, retrying the block if another thread
+ *  changed the value meanwhile.
+ */
+static VALUE
+xthread_atomic_integer_get_and_update(VALUE self)
+{
+  rb_need_block();
+  return xthread_atomic_integer_update(self, 1);
+}
+
+/*
+ *  call-seq:
+ *     update {|value| ... } -> new value
+ *     update_and_get {|value| ... } -> new value
+ */
+static VALUE
+xthread_atomic_integer_update_and_get(VALUE self)
+{
+  rb_need_block();
+  return xthread_atomic_integer_update(self, 0);
+}
+
+static VALUE
+xthread_atomic_integer_inspect(VALUE self)
+{
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_obj_class(self),
+		    rb_xthread_atomic_integer_get(self));
+}
+
+/* AtomicReference */
+
+typedef struct rb_xthread_atomic_reference_struct
+{
+  VALUE value;
+} xthread_atomic_reference_t;
+
+#define GetXThreadAtomicReferencePtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_atomic_reference_t, &xthread_atomic_reference_data_type, (tobj))
+
+static void
+xthread_atomic_reference_mark(void *ptr)
+{
+  xthread_atomic_reference_t *ref = (xthread_atomic_reference_t*)ptr;
+
+  rb_gc_mark_movable(ref->value);
+}
+
+static void
+xthread_atomic_reference_compact(void *ptr)
+{
+  xthread_atomic_reference_t *ref = (xthread_atomic_reference_t*)ptr;
+
+  ref->value = rb_gc_location(ref->value);
+}
+
+static size_t
+xthread_atomic_reference_memsize(const void *ptr)
+{
+  return ptr ? sizeof(xthread_atomic_reference_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_atomic_reference_data_type = {
+    "xthread_atomic_reference",
+    {xthread_atomic_reference_mark, RUBY_TYPED_DEFAULT_FREE, xthread_atomic_reference_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_atomic_reference_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_atomic_reference_data_type = {
+    "xthread_atomic_reference",
+    xthread_atomic_reference_mark,
+    RUBY_TYPED_DEFAULT_FREE,
+    xthread_atomic_reference_memsize,
+};
+#endif
+
+static VALUE
+xthread_atomic_reference_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_atomic_reference_t *ref;
+
+  obj = TypedData_Make_Struct(klass, xthread_atomic_reference_t,
+			      &xthread_atomic_reference_data_type, ref);
+  ref->value = Qnil;
+  return obj;
+}
+
+VALUE
+rb_xthread_atomic_reference_set(VALUE self, VALUE v)
+{
+  xthread_atomic_reference_t *ref;
+  VALUE old;
+
+  GetXThreadAtomicReferencePtr(self, ref);
+  old = xthread_atomic_exchange(&ref->value, v);
+  RB_OBJ_WRITTEN(self, old, v);
+  return v;
+}
+
+/*
+ *  call-seq:
+ *     AtomicReference.new(value = nil)
+ */
+static VALUE
+xthread_atomic_reference_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE v;
+
+  rb_scan_args(argc, argv, "01", &v);
+  rb_xthread_atomic_reference_set(self, v);
+  return self;
+}
+
+VALUE
+rb_xthread_atomic_reference_new(VALUE v)
+{
+  VALUE self;
+
+  self = xthread_atomic_reference_alloc(rb_cXThreadAtomicReference);
+  rb_xthread_atomic_reference_set(self, v);
+  return self;
+}
+
+VALUE
+rb_xthread_atomic_reference_get(VALUE self)
+{
+  xthread_atomic_reference_t *ref;
+
+  GetXThreadAtomicReferencePtr(self, ref);
+  return xthread_atomic_load(&ref->value);
+}
+
+static VALUE
+xthread_atomic_reference_get_and_set(VALUE self, VALUE v)
+{
+  xthread_atomic_reference_t *ref;
+  VALUE old;
+
+  GetXThreadAtomicReferencePtr(self, ref);
+  old = xthread_atomic_exchange(&ref->value, v);
+  RB_OBJ_WRITTEN(self, old, v);
+  return old;
+}
+
+/*
+ *  call-seq:
+ *     compare_and_set(expect, value) -> true or false
+ *
+ *  Sets +value+ if the current value is the very object +expect+
+ *  (equal?, not ==).
+ */
+VALUE
+rb_xthread_atomic_reference_compare_and_set(VALUE self, VALUE expect, VALUE v)
+{
+  xthread_atomic_reference_t *ref;
+
+  GetXThreadAtomicReferencePtr(self, ref);
+  if (!xthread_atomic_cas(&ref->value, expect, v)) {
+    return Qfalse;
+  }
+  RB_OBJ_WRITTEN(self, expect, v);
+  return Qtrue;
+}
+
+static VALUE
+xthread_atomic_reference_update(VALUE self, int return_old)
+{
+  xthread_atomic_reference_t *ref;
+  VALUE old, v;
+
+  GetXThreadAtomicReferencePtr(self, ref);
+  do {
+    old = xthread_atomic_load(&ref->value);
+    v = rb_yield(old);
+  } while (!xthread_atomic_cas(&ref->value, old, v));
+  RB_OBJ_WRITTEN(self, old, v);
+  return return_old ? old : v;
+}
+
+/*
+ *  call-seq:
+ *     get_and_update {|value| ... } -> old value
+ *
+ *  Sets the block's result, retrying the block if another thread
+ *  replaced the value meanwhile.
+ */
+static VALUE
+xthread_atomic_reference_get_and_update(VALUE self)
+{
+  rb_need_block();
+  return xthread_atomic_reference_update(self, 1);
+}
+
+/*
+ *  call-seq:
+ *     update {|value| ... } -> new value
+ *     update_and_get {|value| ... } -> new value
+ */
+static VALUE
+xthread_atomic_reference_update_and_get(VALUE self)
+{
+  rb_need_block();
+  return xthread_atomic_reference_update(self, 0);
+}
+
+static VALUE
+xthread_atomic_reference_inspect(VALUE self)
+{
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_obj_class(self),
+		    rb_inspect(rb_xthread_atomic_reference_get(self)));
+}
+
+/* Adder */
+
+/*
+ * Adder spreads its count over cells, one cache line each, picked by
+ * the adding thread, so that threads adding at once do not contend on
+ * one word.  sum adds the cells up.
+ */
+#define ADDER_CACHE_LINE 64
+#define ADDER_DEFAULT_CELLS 16
+
+typedef struct rb_xthread_adder_cell_struct
+{
+  VALUE value;
+  char pad[ADDER_CACHE_LINE - sizeof(VALUE)];
+} xthread_adder_cell_t;
+
+typedef struct rb_xthread_adder_struct
+{
+  long ncells;
+  xthread_adder_cell_t *cells;
+} xthread_adder_t;
+
+#define GetXThreadAdderPtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_adder_t, &xthread_adder_data_type, (tobj))
+
+static void
+xthread_adder_free(void *ptr)
+{
+  xthread_adder_t *adder = (xthread_adder_t*)ptr;
+
+  if (adder->cells) {
+    ruby_xfree(adder->cells);
+  }
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_adder_memsize(const void *ptr)
+{
+  xthread_adder_t *adder = (xthread_adder_t*)ptr;
+
+  return ptr ? sizeof(xthread_adder_t) + adder->ncells * sizeof(xthread_adder_cell_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_adder_data_type = {
+    "xthread_adder",
+    {0, xthread_adder_free, xthread_adder_memsize,},
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_adder_data_type = {
+    "xthread_adder",
+    0,
+    xthread_adder_free,
+    xthread_adder_memsize,
+};
+#endif
+
+static VALUE
+xthread_adder_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_adder_t *adder;
+
+  obj = TypedData_Make_Struct(klass, xthread_adder_t, &xthread_adder_data_type, adder);
+  adder->ncells = 0;
+  adder->cells = NULL;
+  return obj;
+}
+
+static void
+xthread_adder_setup(xthread_adder_t *adder, long ncells)
+{
+  long n;
+
+  if (ncells <= 0) {
+    rb_raise(rb_eArgError, "number of cells must be positive");
+  }
+  if (adder->cells) {
+    rb_raise(rb_eArgError, "already initialized");
+  }
+  for (n = 1; n < ncells; n <<= 1);
+
+  adder->cells = ALLOC_N(xthread_adder_cell_t, n);
+  MEMZERO(adder->cells, xthread_adder_cell_t, n);
+  adder->ncells = n;
+}
+
+/*
+ *  call-seq:
+ *     Adder.new(cells: 16)
+ *
+ *  Creates a counter at 0.  +cells+, rounded up to a power of two,
+ *  should be about the number of threads adding at once.
+ */
+static VALUE
+xthread_adder_initialize(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[1];
+  xthread_adder_t *adder;
+  VALUE opts;
+  VALUE cells = Qundef;
+
+  GetXThreadAdderPtr(self, adder);
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("cells");
+  }
+  rb_scan_args(argc, argv, "0:", &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &cells);
+  }
+  xthread_adder_setup(adder, cells == Qundef || NIL_P(cells) ? ADDER_DEFAULT_CELLS : NUM2LONG(cells));
+  return self;
+}
+
+VALUE
+rb_xthread_adder_new(long ncells)
+{
+  VALUE self;
+  xthread_adder_t *adder;
+
+  self = xthread_adder_alloc(rb_cXThreadAdder);
+  GetXThreadAdderPtr(self, adder);
+  xthread_adder_setup(adder, ncells > 0 ? ncells : ADDER_DEFAULT_CELLS);
+  return self;
+}
+
+static xthread_adder_cell_t *
+xthread_adder_cell(xthread_adder_t *adder)
+{
+  VALUE h;
+
+  if (adder->cells == NULL) {
+    rb_raise(rb_eArgError, "uninitialized adder");
+  }
+  /* Fibonacci hashing of the thread object's address */
+  h = (rb_thread_current() >> 3) * (VALUE)0x9e3779b97f4a7c15ULL;
+  return &adder->cells[(h >> (sizeof(VALUE) * CHAR_BIT / 2)) & (adder->ncells - 1)];
+}
+
+void
+rb_xthread_adder_add(VALUE self, ssize_t delta)
+{
+  xthread_adder_t *adder;
+
+  GetXThreadAdderPtr(self, adder);
+  xthread_atomic_fetch_add(&xthread_adder_cell(adder)->value, (VALUE)delta);
+}
+
+ssize_t
+rb_xthread_adder_sum(VALUE self)
+{
+  xthread_adder_t *adder;
+  VALUE sum = 0;
+  long i;
+
+  GetXThreadAdderPtr(self, adder);
+  for (i = 0; i < adder->ncells; i++) {
+    sum += xthread_atomic_load(&adder->cells[i].value);
+  }
+  return (ssize_t)sum;
+}
+
+/*
+ *  call-seq:
+ *     add(delta) -> self
+ */
+static VALUE
+xthread_adder_add(VALUE self, VALUE delta)
+{
+  rb_xthread_adder_add(self, NUM2SSIZET(delta));
+  return self;
+}
+
+static VALUE
+xthread_adder_increment(VALUE self)
+{
+  rb_xthread_adder_add(self, 1);
+  return self;
+}
+
+static VALUE
+xthread_adder_decrement(VALUE self)
+{
+  rb_xthread_adder_add(self, -1);
+  return self;
+}
+
+/*
+ *  call-seq:
+ *     sum -> integer
+ *
+ *  The total.  Adds made while it is summing may or may not be in it.
+ */
+static VALUE
+xthread_adder_sum(VALUE self)
+{
+  return ATOMIC2NUM(rb_xthread_adder_sum(self));
+}
+
+/*
+ *  call-seq:
+ *     sum_then_reset -> integer
+ *
+ *  The total, resetting to 0; every add lands either in this total or
+ *  in the next one.
+ */
+static VALUE
+xthread_adder_sum_then_reset(VALUE self)
+{
+  xthread_adder_t *adder;
+  VALUE sum = 0;
+  long i;
+
+  GetXThreadAdderPtr(self, adder);
+  for (i = 0; i < adder->ncells; i++) {
+    sum += xthread_atomic_exchange(&adder->cells[i].value, 0);
+  }
+  return ATOMIC2NUM(sum);
+}
+
+static VALUE
+xthread_adder_reset(VALUE self)
+{
+  xthread_adder_sum_then_reset(self);
+  return self;
+}
+
+static VALUE
+xthread_adder_cells(VALUE self)
+{
+  xthread_adder_t *adder;
+
+  GetXThreadAdderPtr(self, adder);
+  return LONG2NUM(adder->ncells);
+}
+
+static VALUE
+xthread_adder_inspect(VALUE self)
+{
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_obj_class(self),
+		    xthread_adder_sum(self));
+}
+
+void
+Init_XThreadAtomic()
+{
+  rb_cXThreadAtomicInteger = rb_define_class_under(rb_mXThread, "AtomicInteger", rb_cObject);
+  rb_define_alloc_func(rb_cXThreadAtomicInteger, xthread_atomic_integer_alloc);
+  rb_define_method(rb_cXThreadAtomicInteger, "initialize", xthread_atomic_integer_initialize, -1);
+  rb_define_method(rb_cXThreadAtomicInteger, "value", rb_xthread_atomic_integer_get, 0);
+  rb_define_alias(rb_cXThreadAtomicInteger,  "get", "value");
+  rb_define_alias(rb_cXThreadAtomicInteger,  "to_i", "value");
+  rb_define_method(rb_cXThreadAtomicInteger, "value=", rb_xthread_atomic_integer_set, 1);
+  rb_define_alias(rb_cXThreadAtomicInteger,  "set", "value=");
+  rb_define_method(rb_cXThreadAtomicInteger, "get_and_set", xthread_atomic_integer_get_and_set, 1);
+  rb_define_method(rb_cXThreadAtomicInteger, "compare_and_set",
+		   rb_xthread_atomic_integer_compare_and_set, 2);
+  rb_define_method(rb_cXThreadAtomicInteger, "increment", xthread_atomic_integer_increment, -1);
+  rb_define_method(rb_cXThreadAtomicInteger, "decrement", xthread_atomic_integer_decrement, -1);
+  rb_define_method(rb_cXThreadAtomicInteger, "get_and_add", xthread_atomic_integer_get_and_add, 1);
+  rb_define_method(rb_cXThreadAtomicInteger, "get_and_update",
+		   xthread_atomic_integer_get_and_update, 0);
+  rb_define_method(rb_cXThreadAtomicInteger, "update_and_get",
+		   xthread_atomic_integer_update_and_get, 0);
+  rb_define_alias(rb_cXThreadAtomicInteger,  "update", "update_and_get");
+  rb_define_method(rb_cXThreadAtomicInteger, "inspect", xthread_atomic_integer_inspect, 0);
+
+  rb_cXThreadAtomicReference = rb_define_class_under(rb_mXThread, "AtomicReference", rb_cObject);
+  rb_define_alloc_func(rb_cXThreadAtomicReference, xthread_atomic_reference_alloc);
+  rb_define_method(rb_cXThreadAtomicReference, "initialize", xthread_atomic_reference_initialize, -1);
+  rb_define_method(rb_cXThreadAtomicReference, "value", rb_xthread_atomic_reference_get, 0);
+  rb_define_alias(rb_cXThreadAtomicReference,  "get", "value");
+  rb_define_method(rb_cXThreadAtomicReference, "value=", rb_xthread_atomic_reference_set, 1);
+  rb_define_alias(rb_cXThreadAtomicReference,  "set", "value=");
+  rb_define_method(rb_cXThreadAtomicReference, "get_and_set", xthread_atomic_reference_get_and_set, 1);
+  rb_define_method(rb_cXThreadAtomicReference, "compare_and_set",
+		   rb_xthread_atomic_reference_compare_and_set, 2);
+  rb_define_method(rb_cXThreadAtomicReference, "get_and_update",
+		   xthread_atomic_reference_get_and_update, 0);
+  rb_define_method(rb_cXThreadAtomicReference, "update_and_get",
+		   xthread_atomic_reference_update_and_get, 0);
+  rb_define_alias(rb_cXThreadAtomicReference,  "update", "update_and_get");
+  rb_define_method(rb_cXThreadAtomicReference, "inspect", xthread_atomic_reference_inspect, 0);
+
+  rb_cXThreadAdder = rb_define_class_under(rb_mXThread, "Adder", rb_cObject);
+  rb_define_alloc_func(rb_cXThreadAdder, xthread_adder_alloc);
+  rb_define_method(rb_cXThreadAdder, "initialize", xthread_adder_initialize, -1);
+  rb_define_method(rb_cXThreadAdder, "add", xthread_adder_add, 1);
+  rb_define_method(rb_cXThreadAdder, "increment", xthread_adder_increment, 0);
+  rb_define_method(rb_cXThreadAdder, "decrement", xthread_adder_decrement, 0);
+  rb_define_method(rb_cXThreadAdder, "sum", xthread_adder_sum, 0);
+  rb_define_alias(rb_cXThreadAdder,  "value", "sum");
+  rb_define_alias(rb_cXThreadAdder,  "to_i", "sum");
+  rb_define_method(rb_cXThreadAdder, "sum_then_reset", xthread_adder_sum_then_reset, 0);
+  rb_define_method(rb_cXThreadAdder, "reset", xthread_adder_reset, 0);
+  rb_define_method(rb_cXThreadAdder, "cells", xthread_adder_cells, 0);
+  rb_define_method(rb_cXThreadAdder, "inspect", xthread_adder_inspect, 0);
+}
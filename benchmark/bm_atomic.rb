@@ -0,0 +1,39 @@
+#
+#   bm_atomic.rb - shared counters: Monitor, AtomicInteger and Adder
+#
+#   ruby benchmark/bm_atomic.rb [threads] [ops per thread]
+#
+
+require "xthread"
+require "benchmark"
+
+threads = (ARGV[0] || 8).to_i
+ops = (ARGV[1] || 200000).to_i
+
+class MonitorCounter
+  def initialize
+    @mon = XThread::Monitor.new
+    @n = 0
+  end
+
+  def increment
+    @mon.synchronize{@n += 1}
+  end
+
+  def value
+    @mon.synchronize{@n}
+  end
+end
+
+{
+  "Monitor" => ->{MonitorCounter.new},
+  "AtomicInteger" => ->{XThread::AtomicInteger.new},
+  "Adder" => ->{XThread::Adder.new},
+}.each do |name, make|
+  c = make.call
+  t = Benchmark.realtime do
+    threads.times.map{Thread.start{ops.times{c.increment}}}.each(&:join)
+  end
+  raise "lost updates" unless c.value == threads * ops
+  printf("%-14s %10.0f ops/s\n", name, threads * ops / t)
+end
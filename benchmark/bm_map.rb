@@ -0,0 +1,56 @@
+#
+#   bm_map.rb - XThread::Map against a Hash wrapped in XThread::Monitor
+#
+#   ruby benchmark/bm_map.rb [threads] [ops per thread]
+#
+
+require "xthread"
+require "benchmark"
+
+threads = (ARGV[0] || 8).to_i
+ops = (ARGV[1] || 200000).to_i
+keys = 1000
+
+class MonitorMap
+  def initialize
+    @mon = XThread::Monitor.new
+    @h = {}
+  end
+
+  def [](k)
+    @mon.synchronize{@h[k]}
+  end
+
+  def []=(k, v)
+    @mon.synchronize{@h[k] = v}
+  end
+
+  def compute_if_absent(k)
+    @mon.synchronize{@h.fetch(k){@h[k] = yield(k)}}
+  end
+
+  def compute(k)
+    @mon.synchronize{@h[k] = yield(@h[k])}
+  end
+end
+
+workloads = {
+  "read 100%" => ->(m, i){m[i % keys]},
+  "read 90% / write 10%" => ->(m, i){i % 10 == 0 ? m[i % keys] = i : m[i % keys]},
+  "compute_if_absent" => ->(m, i){m.compute_if_absent(i % keys){|k| k}},
+  "compute (counter)" => ->(m, i){m.compute(i % keys){|o| (o || 0) + 1}},
+}
+
+{
+  "Monitor+Hash" => ->{MonitorMap.new},
+  "XThread::Map" => ->{XThread::Map.new},
+}.each do |name, make|
+  workloads.each do |wname, op|
+    m = make.call
+    keys.times{|k| m[k] = k}
+    t = Benchmark.realtime do
+      threads.times.map{Thread.start{ops.times{|i| op.call(m, i)}}}.each(&:join)
+    end
+    printf("%-14s %-22s %10.0f ops/s\n", name, wname, threads * ops / t)
+  end
+end
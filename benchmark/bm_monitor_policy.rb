@@ -0,0 +1,37 @@
+#
+#   bm_monitor_policy.rb - compares the Monitor fairness policies
+#
+#   ruby benchmark/bm_monitor_policy.rb [threads] [seconds]
+#
+#   Reports acquisitions per second and how evenly they were spread
+#   over the threads (min/max share).
+#
+
+require "xthread"
+
+threads = (ARGV[0] || 4).to_i
+seconds = (ARGV[1] || 2).to_f
+
+[:throughput, :fair].each do |policy|
+  monitor = XThread::Monitor.new(policy)
+  counts = Array.new(threads, 0)
+  stop = false
+
+  ths = threads.times.map do |i|
+    Thread.start do
+      until stop
+	monitor.synchronize do
+	  counts[i] += 1
+	  100.times{}
+	end
+      end
+    end
+  end
+  sleep seconds
+  stop = true
+  ths.each(&:join)
+
+  total = counts.inject(:+)
+  printf("%-10s %10.0f acq/s  min/max share %.3f\n",
+	 policy, total / seconds, counts.min.to_f / counts.max)
+end
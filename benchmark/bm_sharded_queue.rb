@@ -0,0 +1,26 @@
+#
+#   bm_sharded_queue.rb - Queue against ShardedQueue with many producers
+#
+#   ruby benchmark/bm_sharded_queue.rb [producers] [items per producer]
+#
+
+require "xthread"
+require "benchmark"
+
+producers = (ARGV[0] || 16).to_i
+items = (ARGV[1] || 50000).to_i
+
+{
+  "Queue" => ->{XThread::Queue.new},
+  "ShardedQueue" => ->{XThread::ShardedQueue.new},
+  "ShardedQueue(ordered)" => ->{XThread::ShardedQueue.new(ordered: true)},
+}.each do |name, make|
+  q = make.call
+  t = Benchmark.realtime do
+    consumer = Thread.start{n = 0; n += 1 while q.pop; n}
+    producers.times.map{Thread.start{items.times{|i| q.push i}}}.each(&:join)
+    q.close
+    consumer.join
+  end
+  printf("%-22s %10.0f items/s\n", name, producers * items / t)
+end
@@ -0,0 +1,30 @@
+#
+#   bm_sorted_list.rb - sorted inserts into ChainList and SortedList
+#
+#   ruby benchmark/bm_sorted_list.rb [items]
+#
+
+require "xthread"
+require "benchmark"
+
+items = (ARGV[0] || 10000).to_i
+deadlines = Array.new(items){Process.clock_gettime(Process::CLOCK_MONOTONIC) + rand * 60}
+
+Benchmark.bm(28) do |x|
+  x.report("ChainList#insert_before"){
+    l = XThread::ChainList.new
+    deadlines.each{|d| l.insert_before(d){|e| e > d}}
+  }
+  x.report("SortedList#push"){
+    l = XThread::SortedList.new
+    deadlines.each{|d| l.push d}
+  }
+  x.report("SortedList#push(key block)"){
+    l = XThread::SortedList.new{|e| e[0]}
+    deadlines.each{|d| l.push [d]}
+  }
+  x.report("SortedList#pop_min"){
+    l = XThread::SortedList.new(*deadlines)
+    l.pop_min until l.empty?
+  }
+end
@@ -10,8 +10,8 @@
 #include "ruby.h"
 
 #include "xthread.h"
+#include "xthread-internal.h"
 
-VALUE rb_mXThread;
 VALUE rb_cXThreadChainList;
 
 static void
@@ -22,7 +22,20 @@ xtcl(_mark)(void *ptr)
 
   entry = cl->head;
   while (entry != NULL) {
-    rb_gc_mark(entry->element);
+    rb_gc_mark_movable(entry->element);
+    entry = entry->next;
+  }
+}
+
+static void
+xtcl(_compact)(void *ptr)
+{
+  xtcl(_t) *cl = (xtcl(_t)*)ptr;
+  xtcl(_entry_t) *entry;
+
+  entry = cl->head;
+  while (entry != NULL) {
+    entry->element = rb_gc_location(entry->element);
     entry = entry->next;
   }
 }
@@ -59,7 +72,14 @@ xtcl(_memsize)(const void *ptr)
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xtcl(_data_type) = {
     "xthread_chain_list",
-    {xtcl(_mark), xtcl(_free), xtcl(_memsize),},
+    {xtcl(_mark), xtcl(_free), xtcl(_memsize),
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xtcl(_compact),
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 #else
 static const rb_data_type_t xtcl(_data_type) = {
@@ -225,7 +245,8 @@ rb_xtcl(_aset)(VALUE self, long idx, VALUE item)
     entry = entry->next;
     i++;
   }
-  return entry->element = item;
+  RB_OBJ_WRITE(self, &entry->element, item);
+  return item;
 }
 
 VALUE
@@ -257,7 +278,7 @@ rb_xtcl(_push)(VALUE self, VALUE item)
   GetXTCLPtr(self, cl);
 
   entry = ALLOC(xtcl(_entry_t));
-  entry->element = item;
+  RB_OBJ_WRITE(self, &entry->element, item);
   entry->next = NULL;
   
   if (cl->length) {
@@ -281,9 +302,12 @@ rb_xtcl(_unshift)(VALUE self, VALUE item)
   GetXTCLPtr(self, cl);
 
   entry = ALLOC(xtcl(_entry_t));
-  entry->element = item;
+  RB_OBJ_WRITE(self, &entry->element, item);
   entry->next = cl->head;
   cl->head = entry;
+  if (!cl->length) {
+    cl->tail = entry;
+  }
   cl->length++;
   return self;
 }
@@ -332,11 +356,36 @@ rb_xtcl(_shift)(VALUE self)
   return item;
 }
 
+#define XTCL_CAT_CHUNK 64
+
+/*
+ * appends up to n elements from entry on to ary, gathering them in
+ * chunks so that each chunk is copied into ary at once.  Returns the
+ * entry following the last one appended.
+ */
+static xtcl(_entry_t) *
+xtcl(_cat)(xtcl(_entry_t) *entry, VALUE ary, long n)
+{
+  VALUE buf[XTCL_CAT_CHUNK];
+  long i = 0;
+
+  while (entry != NULL && n > 0) {
+    buf[i++] = entry->element;
+    entry = entry->next;
+    n--;
+    if (i == XTCL_CAT_CHUNK) {
+      rb_ary_cat(ary, buf, i);
+      i = 0;
+    }
+  }
+  rb_ary_cat(ary, buf, i);
+  return entry;
+}
+
 VALUE
 rb_xtcl(_to_a)(VALUE self)
 {
   xtcl(_t) *cl;
-  xtcl(_entry_t) *entry;
   VALUE ary;
   
   GetXTCLPtr(self, cl);
@@ -346,12 +395,42 @@ rb_xtcl(_to_a)(VALUE self)
   }
 
   ary = rb_ary_new2(cl->length);
+  xtcl(_cat)(cl->head, ary, cl->length);
+  return ary;
+}
+
+/*
+ * yields arrays of n elements.  As with each, the list must not be
+ * modified from the block.
+ */
+VALUE
+rb_xtcl(_each_slice)(VALUE self, long n)
+{
+  xtcl(_t) *cl;
+  xtcl(_entry_t) *entry;
+  
+  GetXTCLPtr(self, cl);
+
   entry = cl->head;
   while (entry != NULL) {
-    rb_ary_push(ary, entry->element);
-    entry = entry->next;
+    VALUE ary = rb_ary_new2(n);
+
+    entry = xtcl(_cat)(entry, ary, n);
+    rb_yield(ary);
   }
-  return ary;
+  return self;
+}
+
+static VALUE
+xtcl(_each_slice)(VALUE self, VALUE v_n)
+{
+  long n = NUM2LONG(v_n);
+
+  if (n <= 0) {
+    rb_raise(rb_eArgError, "invalid slice size");
+  }
+  RETURN_ENUMERATOR(self, 1, &v_n);
+  return rb_xtcl(_each_slice)(self, n);
 }
 
 VALUE
@@ -434,7 +513,7 @@ rb_xtcl(_insert_before)(VALUE self, VALUE item)
   while (entry != NULL) {
     if (RTEST(rb_yield(entry->element))) {
       new_entry = ALLOC(xtcl(_entry_t));
-      new_entry->element = item;
+      RB_OBJ_WRITE(self, &new_entry->element, item);
       new_entry->next = entry;
       if (prev_entry) {
 	prev_entry->next = new_entry;
@@ -472,7 +551,7 @@ rb_xtcl(_insert_before_callback)(VALUE self, VALUE item, VALUE(*callback)(VALUE,
   while (entry != NULL) {
     if (RTEST(callback(entry->element, arg))) {
       new_entry = ALLOC(xtcl(_entry_t));
-      new_entry->element = item;
+      RB_OBJ_WRITE(self, &new_entry->element, item);
       new_entry->next = entry;
       if (prev_entry) {
 	prev_entry->next = new_entry;
@@ -526,6 +605,7 @@ Init_XThreadChainList()
   rb_define_method(rb_cXTCL, "unshift", rb_xtcl(_unshift), 1);
 
   rb_define_method(rb_cXTCL, "each", rb_xtcl(_each), 0);
+  rb_define_method(rb_cXTCL, "each_slice", xtcl(_each_slice), 1);
   rb_define_method(rb_cXTCL, "insert_before", rb_xtcl(_insert_before), 1);
   
   rb_define_method(rb_cXTCL, "to_a", rb_xtcl(_to_a), 0);
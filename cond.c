@@ -10,13 +10,18 @@
 #include "ruby.h"
 
 #include "xthread.h"
+#include "xthread-internal.h"
+#include "probes.h"
 
 VALUE rb_cXThreadConditionVariable;
 
 typedef struct rb_xthread_cond_struct
 {
-  VALUE waiters;
+  xthread_fifo_t waiters;
   /* VALUE waiters_mutex; */
+
+  /* waiters a staged broadcast has still to wake, one at a time */
+  long relay;
 } xthread_cond_t;
 
 #define GetXThreadCondPtr(obj, tobj) \
@@ -27,26 +32,46 @@ xthread_cond_mark(void *ptr)
 {
   xthread_cond_t *cv = (xthread_cond_t*)ptr;
   
-  rb_gc_mark(cv->waiters);
+  xthread_fifo_ring_mark(&cv->waiters);
   /* rb_gc_mark(cv->waiters_mutex); */
 }
 
+static void
+xthread_cond_compact(void *ptr)
+{
+  xthread_cond_t *cv = (xthread_cond_t*)ptr;
+  
+  xthread_fifo_ring_compact(&cv->waiters);
+}
+
 static void
 xthread_cond_free(void *ptr)
 {
-    ruby_xfree(ptr);
+  xthread_cond_t *cv = (xthread_cond_t*)ptr;
+
+  xthread_fifo_ring_free(&cv->waiters);
+  ruby_xfree(ptr);
 }
 
 static size_t
 xthread_cond_memsize(const void *ptr)
 {
-    return ptr ? sizeof(xthread_cond_t) : 0;
+  xthread_cond_t *cv = (xthread_cond_t*)ptr;
+
+  return ptr ? sizeof(xthread_cond_t) + cv->waiters.capa * sizeof(VALUE) : 0;
 }
 
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xthread_cond_data_type = {
     "xthread_cond",
-    {xthread_cond_mark, xthread_cond_free, xthread_cond_memsize,},
+    {xthread_cond_mark, xthread_cond_free, xthread_cond_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_cond_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 #else
 static const rb_data_type_t xthread_cond_data_type = {
@@ -65,8 +90,9 @@ xthread_cond_alloc(VALUE klass)
 
   obj = TypedData_Make_Struct(klass, xthread_cond_t,
 			      &xthread_cond_data_type, cv);
-  cv->waiters = rb_xthread_fifo_new();
+  xthread_fifo_ring_init(&cv->waiters);
   /* cv->waiters_mutex = rb_mutex_new(); */
+  cv->relay = 0;
   return obj;
 }
 
@@ -82,25 +108,197 @@ xthread_cond_initialize(VALUE self)
     return self;
 }
 
+struct xthread_waiters_wait_arg {
+  xthread_fifo_t *waiters;
+  VALUE th;
+};
+
+static VALUE
+xthread_waiters_sleep(VALUE arg)
+{
+  rb_thread_sleep_deadly();
+  return Qnil;
+}
+
+static VALUE
+xthread_waiters_wait_leave(VALUE v_arg)
+{
+  struct xthread_waiters_wait_arg *arg = (struct xthread_waiters_wait_arg *)v_arg;
+
+  /* still listed if woken by an interrupt rather than by a signal */
+  xthread_fifo_ring_delete(arg->waiters, arg->th);
+  return Qnil;
+}
+
+/*
+ * wait list primitives for structures that keep their waiting threads
+ * in an embedded ring.  A waiter sleeps under the GVL and takes itself
+ * off the list when it leaves by an interrupt.
+ */
+void
+xthread_waiters_wait(VALUE self, xthread_fifo_t *waiters)
+{
+  struct xthread_waiters_wait_arg arg;
+
+  arg.waiters = waiters;
+  arg.th = rb_thread_current();
+  xthread_fifo_ring_push(waiters, self, arg.th);
+  rb_ensure(xthread_waiters_sleep, Qnil, xthread_waiters_wait_leave, (VALUE)&arg);
+}
+
+struct xthread_waiters_wait_for_arg {
+  VALUE self;
+  xthread_fifo_t *waiters;
+  VALUE timer;
+};
+
+static VALUE
+xthread_waiters_wait_for_body(VALUE v_arg)
+{
+  struct xthread_waiters_wait_for_arg *arg = (struct xthread_waiters_wait_for_arg *)v_arg;
+
+  xthread_waiters_wait(arg->self, arg->waiters);
+  return Qnil;
+}
+
+static VALUE
+xthread_waiters_wait_for_leave(VALUE v_arg)
+{
+  struct xthread_waiters_wait_for_arg *arg = (struct xthread_waiters_wait_for_arg *)v_arg;
+
+  rb_xthread_timer_cancel(arg->timer);
+  return Qnil;
+}
+
+/*
+ * waits at most +timeout+ seconds, timed by the default TimerWheel.
+ * Returns 0 if the timeout elapsed.  A signal may race with the
+ * timeout, so callers re-check their condition either way.
+ */
+int
+xthread_waiters_wait_for(VALUE self, xthread_fifo_t *waiters, double timeout)
+{
+  struct xthread_waiters_wait_for_arg arg;
+
+  arg.self = self;
+  arg.waiters = waiters;
+  arg.timer = rb_xthread_timer_wheel_wakeup(rb_xthread_timer_wheel_default(),
+					    timeout, rb_thread_current());
+  rb_ensure(xthread_waiters_wait_for_body, (VALUE)&arg,
+	    xthread_waiters_wait_for_leave, (VALUE)&arg);
+  return !RTEST(rb_xthread_timer_expired_p(arg.timer));
+}
+
+void
+xthread_waiters_signal(xthread_fifo_t *waiters)
+{
+  VALUE th;
+
+  while ((th = xthread_fifo_ring_pop(waiters)) != Qnil) {
+    if (rb_thread_wakeup_alive(th) != Qnil) {
+      break;
+    }
+  }
+}
+
+/*
+ * wakes up to +n+ live waiters in FIFO order and returns how many were
+ * woken.
+ */
+long
+xthread_waiters_signal_n(xthread_fifo_t *waiters, long n)
+{
+  VALUE th;
+  long woken = 0;
+
+  while (woken < n && (th = xthread_fifo_ring_pop(waiters)) != Qnil) {
+    if (rb_thread_wakeup_alive(th) != Qnil) {
+      woken++;
+    }
+  }
+  return woken;
+}
+
+void
+xthread_waiters_broadcast(xthread_fifo_t *waiters)
+{
+  VALUE th;
+
+  while ((th = xthread_fifo_ring_pop(waiters)) != Qnil) {
+    rb_thread_wakeup_alive(th);
+  }
+}
+
 VALUE
 rb_xthread_cond_new(void)
 {
   return xthread_cond_alloc(rb_cXThreadConditionVariable);
 }
 
+/*
+ * passes a staged broadcast on.  Called by a woken waiter once it
+ * holds the mutex again, so at most one relayed waiter at a time
+ * competes for it.
+ */
+static void
+xthread_cond_relay(xthread_cond_t *cv)
+{
+  if (cv->relay > 0) {
+    cv->relay -= xthread_waiters_signal_n(&cv->waiters, 1);
+    if (XTHREAD_FIFO_RING_EMPTY_P(&cv->waiters)) {
+      cv->relay = 0;
+    }
+  }
+}
+
+struct xthread_cond_wait_arg {
+  xthread_cond_t *cv;
+  VALUE th;
+  VALUE mutex;
+  VALUE timeout;
+  VALUE self;
+  xthread_hrtime_t start;
+};
+
+static VALUE
+xthread_cond_sleep(VALUE v_arg)
+{
+  struct xthread_cond_wait_arg *arg = (struct xthread_cond_wait_arg *)v_arg;
+
+  return rb_mutex_sleep(arg->mutex, arg->timeout);
+}
+
+static VALUE
+xthread_cond_wait_leave(VALUE v_arg)
+{
+  struct xthread_cond_wait_arg *arg = (struct xthread_cond_wait_arg *)v_arg;
+
+  /* still listed after a timeout or an interrupt */
+  if (!xthread_fifo_ring_delete(&arg->cv->waiters, arg->th)) {
+    xthread_cond_relay(arg->cv);
+  }
+  XTHREAD_PROBE_COND_WAKE(arg->self, XTHREAD_PROBE_HRTIME() - arg->start);
+  return Qnil;
+}
+
 VALUE
 rb_xthread_cond_wait(VALUE self, VALUE mutex, VALUE timeout)
 {
-  xthread_cond_t *cv;
-  VALUE th = rb_thread_current();
+  struct xthread_cond_wait_arg arg;
   
-  GetXThreadCondPtr(self, cv);
+  GetXThreadCondPtr(self, arg.cv);
+  arg.th = rb_thread_current();
+  arg.mutex = mutex;
+  arg.timeout = timeout;
+  arg.self = self;
 
   /* rb_mutex_lock(cv->waiters_mutex); */
-  rb_xthread_fifo_push(cv->waiters, th);
+  xthread_fifo_ring_push(&arg.cv->waiters, self, arg.th);
   /* rb_mutex_unlock(cv->waiters_mutex); */
+  XTHREAD_PROBE_COND_WAIT(self, XTHREAD_FIFO_RING_LENGTH(&arg.cv->waiters));
+  arg.start = XTHREAD_PROBE_HRTIME();
   
-  rb_mutex_sleep(mutex, timeout);
+  rb_ensure(xthread_cond_sleep, (VALUE)&arg, xthread_cond_wait_leave, (VALUE)&arg);
   
   return self;
 }
@@ -115,19 +313,49 @@ xthread_cond_wait(int argc, VALUE *argv, VALUE self)
   return rb_xthread_cond_wait(self, mutex, timeout);
 }
 
+/*
+ * wakes up to +n+ waiters, longest waiting first.
+ */
+VALUE
+rb_xthread_cond_signal_n(VALUE self, long n)
+{
+  xthread_cond_t *cv;
+  GetXThreadCondPtr(self, cv);
+
+  XTHREAD_PROBE_COND_SIGNAL(self, XTHREAD_FIFO_RING_LENGTH(&cv->waiters));
+  xthread_waiters_signal_n(&cv->waiters, n);
+  return self;
+}
+
+/*
+ *  call-seq:
+ *     signal(n = 1)
+ *
+ *  Wakes up to +n+ threads waiting for this condition, in the order
+ *  they started waiting.
+ */
+static VALUE
+xthread_cond_signal(int argc, VALUE *argv, VALUE self)
+{
+  VALUE n;
+
+  rb_scan_args(argc, argv, "01", &n);
+  if (NIL_P(n)) {
+    return rb_xthread_cond_signal(self);
+  }
+  return rb_xthread_cond_signal_n(self, NUM2LONG(n));
+}
+
 VALUE
 rb_xthread_cond_signal(VALUE self)
 {
-  VALUE th;
   xthread_cond_t *cv;
   GetXThreadCondPtr(self, cv);
 
+  XTHREAD_PROBE_COND_SIGNAL(self, XTHREAD_FIFO_RING_LENGTH(&cv->waiters));
   /*  rb_mutex_lock(cv->waiters_mutex); */
-  th = rb_xthread_fifo_pop(cv->waiters);
+  xthread_waiters_signal(&cv->waiters);
   /* rb_mutex_unlock(cv->waiters_mutex); */
-  if (th != Qnil) {
-    rb_thread_wakeup(th);
-  }
 
   return self;
 }
@@ -136,15 +364,35 @@ VALUE
 rb_xthread_cond_broadcast(VALUE self)
 {
   xthread_cond_t *cv;
-  VALUE waiters0;
-  VALUE th;
   
   GetXThreadCondPtr(self, cv);
 
-  while ((th = rb_xthread_fifo_pop(cv->waiters)) != Qnil) {
-    rb_thread_wakeup(th);
-  }
+  XTHREAD_PROBE_COND_BROADCAST(self, XTHREAD_FIFO_RING_LENGTH(&cv->waiters));
+  cv->relay = 0;
+  xthread_waiters_broadcast(&cv->waiters);
+  
+  return self;
+}
+
+/*
+ *  call-seq:
+ *     staged_broadcast
+ *
+ *  Wakes every thread now waiting, but one after another: each woken
+ *  thread wakes the next once it has the mutex back, instead of all of
+ *  them piling onto the mutex at once.  Threads that start waiting
+ *  afterwards may be woken in place of ones that timed out.
+ */
+VALUE
+rb_xthread_cond_staged_broadcast(VALUE self)
+{
+  xthread_cond_t *cv;
   
+  GetXThreadCondPtr(self, cv);
+
+  XTHREAD_PROBE_COND_BROADCAST(self, XTHREAD_FIFO_RING_LENGTH(&cv->waiters));
+  cv->relay = XTHREAD_FIFO_RING_LENGTH(&cv->waiters);
+  xthread_cond_relay(cv);
   return self;
 }
 
@@ -156,6 +404,8 @@ Init_XThreadCond(void)
   rb_define_alloc_func(rb_cXThreadConditionVariable, xthread_cond_alloc);
   rb_define_method(rb_cXThreadConditionVariable, "initialize", xthread_cond_initialize, 0);
   rb_define_method(rb_cXThreadConditionVariable, "wait", xthread_cond_wait, -1);
-  rb_define_method(rb_cXThreadConditionVariable, "signal", rb_xthread_cond_signal, 0);
+  rb_define_method(rb_cXThreadConditionVariable, "signal", xthread_cond_signal, -1);
   rb_define_method(rb_cXThreadConditionVariable, "broadcast", rb_xthread_cond_broadcast, 0);
+  rb_define_method(rb_cXThreadConditionVariable, "staged_broadcast",
+		   rb_xthread_cond_staged_broadcast, 0);
 }
@@ -0,0 +1,511 @@
+/**********************************************************************
+
+  delay-queue.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+VALUE rb_cXThreadDelayQueue;
+
+/*
+ * DelayQueue keeps its items in a binary min-heap ordered by due time
+ * (monotonic clock), ties broken by arrival order.  A consumer waits on
+ * the condition variable until the head is due; a push that becomes the
+ * new head signals it so that the wait is re-armed with the shorter
+ * timeout.
+ */
+typedef struct rb_xthread_delay_queue_entry_struct
+{
+  xthread_hrtime_t due;
+  unsigned LONG_LONG seq;
+  VALUE item;
+} xthread_delay_queue_entry_t;
+
+typedef struct rb_xthread_delay_queue_struct
+{
+  long len;
+  long capa;
+  xthread_delay_queue_entry_t *heap;
+  unsigned LONG_LONG seq;
+
+  VALUE mutex;
+  VALUE cond;
+  long num_waiting;
+} xthread_delay_queue_t;
+
+#define DELAY_QUEUE_DEFAULT_CAPA 16
+
+#define DELAY_QUEUE_ENTRY_LT(a, b) \
+  ((a)->due < (b)->due || ((a)->due == (b)->due && (a)->seq < (b)->seq))
+
+#define GetXThreadDelayQueuePtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_delay_queue_t, &xthread_delay_queue_data_type, (tobj))
+
+static void
+xthread_delay_queue_mark(void *ptr)
+{
+  xthread_delay_queue_t *que = (xthread_delay_queue_t*)ptr;
+  long i;
+
+  for (i = 0; i < que->len; i++) {
+    rb_gc_mark_movable(que->heap[i].item);
+  }
+  rb_gc_mark_movable(que->mutex);
+  rb_gc_mark_movable(que->cond);
+}
+
+static void
+xthread_delay_queue_compact(void *ptr)
+{
+  xthread_delay_queue_t *que = (xthread_delay_queue_t*)ptr;
+  long i;
+
+  for (i = 0; i < que->len; i++) {
+    que->heap[i].item = rb_gc_location(que->heap[i].item);
+  }
+  que->mutex = rb_gc_location(que->mutex);
+  que->cond = rb_gc_location(que->cond);
+}
+
+static void
+xthread_delay_queue_free(void *ptr)
+{
+  xthread_delay_queue_t *que = (xthread_delay_queue_t*)ptr;
+
+  if (que->heap) {
+    ruby_xfree(que->heap);
+  }
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_delay_queue_memsize(const void *ptr)
+{
+  xthread_delay_queue_t *que = (xthread_delay_queue_t*)ptr;
+
+  return ptr ? sizeof(xthread_delay_queue_t) +
+    que->capa * sizeof(xthread_delay_queue_entry_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_delay_queue_data_type = {
+    "xthread_delay_queue",
+    {xthread_delay_queue_mark, xthread_delay_queue_free, xthread_delay_queue_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_delay_queue_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_delay_queue_data_type = {
+    "xthread_delay_queue",
+    xthread_delay_queue_mark,
+    xthread_delay_queue_free,
+    xthread_delay_queue_memsize,
+};
+#endif
+
+static VALUE
+xthread_delay_queue_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_delay_queue_t *que;
+
+  obj = TypedData_Make_Struct(klass, xthread_delay_queue_t,
+			      &xthread_delay_queue_data_type, que);
+  que->len = 0;
+  que->capa = 0;
+  que->heap = NULL;
+  que->seq = 0;
+  que->num_waiting = 0;
+  RB_OBJ_WRITE(obj, &que->mutex, rb_mutex_new());
+  RB_OBJ_WRITE(obj, &que->cond, rb_xthread_cond_new());
+  return obj;
+}
+
+/*
+ *  call-seq:
+ *     DelayQueue.new   -> delay_queue
+ *
+ *  Creates a new DelayQueue
+ */
+static VALUE
+xthread_delay_queue_initialize(VALUE self)
+{
+  return self;
+}
+
+VALUE
+rb_xthread_delay_queue_new(void)
+{
+  return xthread_delay_queue_alloc(rb_cXThreadDelayQueue);
+}
+
+/* heap primitives; the caller holds the mutex */
+
+static long
+xthread_delay_queue_heap_insert(VALUE self, xthread_delay_queue_t *que,
+				xthread_hrtime_t due, VALUE item)
+{
+  xthread_delay_queue_entry_t e;
+  long i;
+
+  if (que->len == que->capa) {
+    long capa = que->capa == 0 ? DELAY_QUEUE_DEFAULT_CAPA : que->capa * 2;
+
+    REALLOC_N(que->heap, xthread_delay_queue_entry_t, capa);
+    que->capa = capa;
+  }
+
+  e.due = due;
+  e.seq = que->seq++;
+  e.item = Qnil;
+
+  /* sift up */
+  i = que->len++;
+  while (i > 0) {
+    long parent = (i - 1) / 2;
+
+    if (!DELAY_QUEUE_ENTRY_LT(&e, &que->heap[parent])) {
+      break;
+    }
+    que->heap[i] = que->heap[parent];
+    i = parent;
+  }
+  que->heap[i] = e;
+  RB_OBJ_WRITE(self, &que->heap[i].item, item);
+  return i;
+}
+
+static VALUE
+xthread_delay_queue_heap_shift(xthread_delay_queue_t *que)
+{
+  VALUE item = que->heap[0].item;
+  xthread_delay_queue_entry_t last;
+  long i;
+
+  last = que->heap[--que->len];
+
+  /* sift down */
+  i = 0;
+  for (;;) {
+    long child = 2 * i + 1;
+
+    if (child >= que->len) {
+      break;
+    }
+    if (child + 1 < que->len &&
+	DELAY_QUEUE_ENTRY_LT(&que->heap[child + 1], &que->heap[child])) {
+      child++;
+    }
+    if (!DELAY_QUEUE_ENTRY_LT(&que->heap[child], &last)) {
+      break;
+    }
+    que->heap[i] = que->heap[child];
+    i = child;
+  }
+  if (que->len > 0) {
+    que->heap[i] = last;
+  }
+  return item;
+}
+
+/* due time of an item given as at: (Time or epoch seconds) or in: seconds */
+static xthread_hrtime_t
+xthread_delay_queue_due(VALUE at, VALUE in)
+{
+  xthread_hrtime_t now = rb_xthread_hrtime();
+  double delay;
+
+  if (at != Qundef && !NIL_P(at)) {
+    if (in != Qundef && !NIL_P(in)) {
+      rb_raise(rb_eArgError, "both at: and in: given");
+    }
+    delay = NUM2DBL(rb_funcall(at, rb_intern("to_f"), 0)) -
+      NUM2DBL(rb_funcall(rb_funcall(rb_cTime, rb_intern("now"), 0),
+			 rb_intern("to_f"), 0));
+  }
+  else if (in != Qundef && !NIL_P(in)) {
+    delay = NUM2DBL(in);
+  }
+  else {
+    return now;
+  }
+  if (delay <= 0) {
+    return now;
+  }
+  return now + (xthread_hrtime_t)(delay * XTHREAD_NSEC_PER_SEC);
+}
+
+struct xthread_delay_queue_arg {
+  VALUE self;
+  xthread_delay_queue_t *que;
+  xthread_hrtime_t due;
+  VALUE item;
+  int non_block;
+};
+
+static VALUE
+xthread_delay_queue_unlock(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+
+  rb_mutex_unlock(arg->que->mutex);
+  return Qnil;
+}
+
+static VALUE
+xthread_delay_queue_push_body(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+  xthread_delay_queue_t *que = arg->que;
+
+  if (xthread_delay_queue_heap_insert(arg->self, que, arg->due, arg->item) == 0) {
+    /* new head: the waiting consumer has to re-arm its timeout */
+    rb_xthread_cond_signal(que->cond);
+  }
+  return Qnil;
+}
+
+VALUE
+rb_xthread_delay_queue_push(VALUE self, VALUE item, VALUE at, VALUE in)
+{
+  struct xthread_delay_queue_arg arg;
+
+  GetXThreadDelayQueuePtr(self, arg.que);
+  arg.self = self;
+  arg.due = xthread_delay_queue_due(at, in);
+  arg.item = item;
+
+  rb_mutex_lock(arg.que->mutex);
+  rb_ensure(xthread_delay_queue_push_body, (VALUE)&arg,
+	    xthread_delay_queue_unlock, (VALUE)&arg);
+  return self;
+}
+
+/*
+ *  call-seq:
+ *     push(obj, at: nil, in: nil)
+ *
+ *  Schedules +obj+ to become available at +at+ (a Time or epoch
+ *  seconds) or +in+ seconds from now; immediately if neither is given.
+ */
+static VALUE
+xthread_delay_queue_push(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[2];
+  VALUE item;
+  VALUE opts;
+  VALUE kw[2];
+
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("at");
+    keywords[1] = rb_intern("in");
+  }
+  kw[0] = kw[1] = Qundef;
+  rb_scan_args(argc, argv, "1:", &item, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 2, kw);
+  }
+  return rb_xthread_delay_queue_push(self, item, kw[0], kw[1]);
+}
+
+static VALUE
+xthread_delay_queue_enq(VALUE self, VALUE item)
+{
+  return rb_xthread_delay_queue_push(self, item, Qundef, Qundef);
+}
+
+static VALUE
+xthread_delay_queue_wait(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+
+  return rb_xthread_cond_wait(arg->que->cond, arg->que->mutex, arg->item);
+}
+
+static VALUE
+xthread_delay_queue_wait_leave(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+
+  arg->que->num_waiting--;
+  return Qnil;
+}
+
+static VALUE
+xthread_delay_queue_pop_body(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+  xthread_delay_queue_t *que = arg->que;
+
+  for (;;) {
+    /* arg->item carries the timeout of the wait until an item is taken */
+    arg->item = Qnil;
+    if (que->len > 0) {
+      xthread_hrtime_t now = rb_xthread_hrtime();
+
+      if (que->heap[0].due <= now) {
+	arg->item = xthread_delay_queue_heap_shift(que);
+	if (que->len > 0 && que->num_waiting > 0) {
+	  /* the next head may be due for another consumer */
+	  rb_xthread_cond_signal(que->cond);
+	}
+	return arg->item;
+      }
+      arg->item = DBL2NUM((double)(que->heap[0].due - now) / XTHREAD_NSEC_PER_SEC);
+    }
+    if (arg->non_block) {
+      rb_raise(rb_eThreadError, "xthread_delay_queue has no due item");
+    }
+    que->num_waiting++;
+    rb_ensure(xthread_delay_queue_wait, (VALUE)arg,
+	      xthread_delay_queue_wait_leave, (VALUE)arg);
+  }
+}
+
+static VALUE
+xthread_delay_queue_locked(VALUE self, VALUE (*body)(VALUE), int non_block)
+{
+  struct xthread_delay_queue_arg arg;
+
+  GetXThreadDelayQueuePtr(self, arg.que);
+  arg.self = self;
+  arg.item = Qnil;
+  arg.non_block = non_block;
+
+  rb_mutex_lock(arg.que->mutex);
+  return rb_ensure(body, (VALUE)&arg, xthread_delay_queue_unlock, (VALUE)&arg);
+}
+
+VALUE
+rb_xthread_delay_queue_pop(VALUE self)
+{
+  return xthread_delay_queue_locked(self, xthread_delay_queue_pop_body, 0);
+}
+
+VALUE
+rb_xthread_delay_queue_pop_non_block(VALUE self)
+{
+  return xthread_delay_queue_locked(self, xthread_delay_queue_pop_body, 1);
+}
+
+/*
+ *  call-seq:
+ *     pop(non_block=false)
+ *
+ *  Retrieves the item that became due first, waiting until one is due.
+ *  With +non_block+, raises ThreadError if no item is due yet.
+ */
+static VALUE
+xthread_delay_queue_pop(int argc, VALUE *argv, VALUE self)
+{
+  VALUE non_block;
+
+  rb_scan_args(argc, argv, "01", &non_block);
+  if (RTEST(non_block)) {
+    return rb_xthread_delay_queue_pop_non_block(self);
+  }
+  else {
+    return rb_xthread_delay_queue_pop(self);
+  }
+}
+
+static VALUE
+xthread_delay_queue_delay_body(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+  xthread_delay_queue_t *que = arg->que;
+  xthread_hrtime_t now;
+
+  if (que->len == 0) {
+    return Qnil;
+  }
+  now = rb_xthread_hrtime();
+  if (que->heap[0].due <= now) {
+    return DBL2NUM(0.0);
+  }
+  return DBL2NUM((double)(que->heap[0].due - now) / XTHREAD_NSEC_PER_SEC);
+}
+
+/*
+ * seconds until the earliest item is due, or nil if the queue is empty.
+ */
+VALUE
+rb_xthread_delay_queue_delay(VALUE self)
+{
+  return xthread_delay_queue_locked(self, xthread_delay_queue_delay_body, 0);
+}
+
+static VALUE
+xthread_delay_queue_clear_body(VALUE v_arg)
+{
+  struct xthread_delay_queue_arg *arg = (struct xthread_delay_queue_arg *)v_arg;
+
+  arg->que->len = 0;
+  return arg->self;
+}
+
+VALUE
+rb_xthread_delay_queue_clear(VALUE self)
+{
+  return xthread_delay_queue_locked(self, xthread_delay_queue_clear_body, 0);
+}
+
+VALUE
+rb_xthread_delay_queue_empty_p(VALUE self)
+{
+  xthread_delay_queue_t *que;
+
+  GetXThreadDelayQueuePtr(self, que);
+  return que->len == 0 ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_delay_queue_length(VALUE self)
+{
+  xthread_delay_queue_t *que;
+
+  GetXThreadDelayQueuePtr(self, que);
+  return LONG2NUM(que->len);
+}
+
+VALUE
+rb_xthread_delay_queue_num_waiting(VALUE self)
+{
+  xthread_delay_queue_t *que;
+
+  GetXThreadDelayQueuePtr(self, que);
+  return LONG2NUM(que->num_waiting);
+}
+
+void
+Init_XThreadDelayQueue(void)
+{
+  rb_cXThreadDelayQueue = rb_define_class_under(rb_mXThread, "DelayQueue", rb_cObject);
+
+  rb_define_alloc_func(rb_cXThreadDelayQueue, xthread_delay_queue_alloc);
+  rb_define_method(rb_cXThreadDelayQueue, "initialize", xthread_delay_queue_initialize, 0);
+  rb_define_method(rb_cXThreadDelayQueue, "push", xthread_delay_queue_push, -1);
+  rb_define_method(rb_cXThreadDelayQueue, "<<", xthread_delay_queue_enq, 1);
+  rb_define_method(rb_cXThreadDelayQueue, "enq", xthread_delay_queue_push, -1);
+  rb_define_method(rb_cXThreadDelayQueue, "pop", xthread_delay_queue_pop, -1);
+  rb_define_alias(rb_cXThreadDelayQueue,  "shift", "pop");
+  rb_define_alias(rb_cXThreadDelayQueue,  "deq", "pop");
+  rb_define_method(rb_cXThreadDelayQueue, "delay", rb_xthread_delay_queue_delay, 0);
+  rb_define_method(rb_cXThreadDelayQueue, "empty?", rb_xthread_delay_queue_empty_p, 0);
+  rb_define_method(rb_cXThreadDelayQueue, "clear", rb_xthread_delay_queue_clear, 0);
+  rb_define_method(rb_cXThreadDelayQueue, "length", rb_xthread_delay_queue_length, 0);
+  rb_define_alias(rb_cXThreadDelayQueue,  "size", "length");
+  rb_define_method(rb_cXThreadDelayQueue, "num_waiting", rb_xthread_delay_queue_num_waiting, 0);
+}
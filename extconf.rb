@@ -1,4 +1,18 @@
 require 'mkmf'
 
-create_makefile("xthread")
+have_struct_member("rb_data_type_t", "function", "ruby.h")
+have_struct_member("rb_data_type_t", "flags", "ruby.h")
+have_func("rb_gc_mark_movable", "ruby.h")
+have_func("clock_gettime", "time.h")
+have_header("sys/mman.h")
+have_header("unistd.h")
+have_func("fdatasync", "unistd.h")
+have_func("pthread_atfork", "pthread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_header("ruby/atomic.h")
+# USDT probes (probes.h); --disable-probes leaves them out
+if enable_config("probes", true)
+  have_header("sys/sdt.h")
+end
 
+create_makefile("xthread")
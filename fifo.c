@@ -10,55 +10,291 @@
 #include "ruby.h"
 
 #include "xthread.h"
+#include "xthread-internal.h"
+#include "probes.h"
 
 #define FIFO_DEFAULT_CAPA 16
 
-VALUE rb_mXThread;
 VALUE rb_cXThreadFifo;
 
-typedef struct rb_xthread_fifo_struct
-{
-  long push;
-  long pop;
-  long capa;
-  
-  VALUE *elements;
-} xthread_fifo_t;
-
 #define GetXThreadFifoPtr(obj, tobj) \
     TypedData_Get_Struct((obj), xthread_fifo_t, &xthread_fifo_data_type, (tobj))
 
-static void
-xthread_fifo_mark(void *ptr)
+/*
+ * ring operations on xthread_fifo_t.  These work on a ring embedded in
+ * another structure (Queue, ConditionVariable...) as well as on the ring
+ * of a Fifo object.  The element buffer is allocated on first push.
+ */
+void
+xthread_fifo_ring_init(xthread_fifo_t *fifo)
+{
+  fifo->push = 0;
+  fifo->pop = 0;
+
+  fifo->capa = 0;
+  fifo->elements = NULL;
+  fifo->stamps = NULL;
+}
+
+void
+xthread_fifo_ring_mark(xthread_fifo_t *fifo)
 {
-  xthread_fifo_t *fifo = (xthread_fifo_t*)ptr;
-  
   if (fifo->push < fifo->capa) {
     long i;
     for (i = fifo->pop; i < fifo->push; i++) {
-      rb_gc_mark(fifo->elements[i]);
+      rb_gc_mark_movable(fifo->elements[i]);
     }
   }
   else {
     long i;
     for (i = 0; i < fifo->push - fifo->capa; i++) {
-      rb_gc_mark(fifo->elements[i]);
+      rb_gc_mark_movable(fifo->elements[i]);
     }
 
     for (i = fifo->pop; i < fifo->capa; i++) {
-      rb_gc_mark(fifo->elements[i]);
+      rb_gc_mark_movable(fifo->elements[i]);
     }
   }
 }
 
-static void
-xthread_fifo_free(void *ptr)
+void
+xthread_fifo_ring_compact(xthread_fifo_t *fifo)
 {
-  xthread_fifo_t *fifo = (xthread_fifo_t*)ptr;
+  long i;
+  long len = fifo->push - fifo->pop;
+
+  for (i = 0; i < len; i++) {
+    long p = XTHREAD_FIFO_RING_INDEX(fifo, i);
 
+    fifo->elements[p] = rb_gc_location(fifo->elements[p]);
+  }
+}
+
+void
+xthread_fifo_ring_free(xthread_fifo_t *fifo)
+{
   if (fifo->elements) {
     ruby_xfree(fifo->elements);
+    fifo->elements = NULL;
+  }
+  if (fifo->stamps) {
+    ruby_xfree(fifo->stamps);
+    fifo->stamps = NULL;
+  }
+  fifo->capa = 0;
+}
+
+/*
+ * push timestamps: an array parallel to elements, indexed by the same
+ * physical slot, so only resize and delete have to move them along.
+ */
+void
+xthread_fifo_ring_enable_stamps(xthread_fifo_t *fifo)
+{
+  long i;
+  xthread_hrtime_t now;
+
+  if (fifo->stamps) {
+    return;
+  }
+  if (fifo->capa == 0) {
+    fifo->elements = ALLOC_N(VALUE, FIFO_DEFAULT_CAPA);
+    fifo->capa = FIFO_DEFAULT_CAPA;
+  }
+  fifo->stamps = ALLOC_N(xthread_hrtime_t, fifo->capa);
+  now = rb_xthread_hrtime();
+  for (i = 0; i < fifo->capa; i++) {
+    fifo->stamps[i] = now;
   }
+}
+
+void
+xthread_fifo_ring_disable_stamps(xthread_fifo_t *fifo)
+{
+  if (fifo->stamps) {
+    ruby_xfree(fifo->stamps);
+    fifo->stamps = NULL;
+  }
+}
+
+static void
+xthread_fifo_resize_double_capa(xthread_fifo_t *fifo)
+{
+  long new_capa = fifo->capa * 2;
+
+  if (new_capa == 0) {
+    fifo->elements = ALLOC_N(VALUE, FIFO_DEFAULT_CAPA);
+    fifo->capa = FIFO_DEFAULT_CAPA;
+    return;
+  }
+
+  REALLOC_N(fifo->elements, VALUE, new_capa);
+  if (fifo->stamps) {
+    REALLOC_N(fifo->stamps, xthread_hrtime_t, new_capa);
+  }
+
+  if (fifo->push > fifo->capa) {
+    if (fifo->capa - fifo->pop <= fifo->push - fifo->capa) {
+      MEMCPY(&fifo->elements[fifo->pop + fifo->capa],
+	     &fifo->elements[fifo->pop], VALUE, fifo->capa - fifo->pop);
+      if (fifo->stamps) {
+	MEMCPY(&fifo->stamps[fifo->pop + fifo->capa],
+	       &fifo->stamps[fifo->pop], xthread_hrtime_t, fifo->capa - fifo->pop);
+      }
+      fifo->pop += fifo->capa;
+      fifo->push += fifo->capa;
+    }
+    else {
+      MEMCPY(&fifo->elements[fifo->capa],
+	     fifo->elements, VALUE, fifo->push - fifo->capa);
+      if (fifo->stamps) {
+	MEMCPY(&fifo->stamps[fifo->capa],
+	       fifo->stamps, xthread_hrtime_t, fifo->push - fifo->capa);
+      }
+    }
+  }
+  fifo->capa = new_capa;
+}
+
+/* owner is the object the ring belongs to, for the write barrier */
+void
+xthread_fifo_ring_push(xthread_fifo_t *fifo, VALUE owner, VALUE item)
+{
+  if (fifo->push < fifo->capa) {
+    RB_OBJ_WRITE(owner, &fifo->elements[fifo->push], item);
+    if (fifo->stamps) {
+      fifo->stamps[fifo->push] = rb_xthread_hrtime();
+    }
+    fifo->push++;
+    return;
+  }
+
+  if (fifo->push - fifo->capa < fifo->pop) {
+    RB_OBJ_WRITE(owner, &fifo->elements[fifo->push - fifo->capa], item);
+    if (fifo->stamps) {
+      fifo->stamps[fifo->push - fifo->capa] = rb_xthread_hrtime();
+    }
+    fifo->push++;
+    return;
+  }
+
+  xthread_fifo_resize_double_capa(fifo);
+  xthread_fifo_ring_push(fifo, owner, item);
+}
+
+VALUE
+xthread_fifo_ring_pop(xthread_fifo_t *fifo)
+{
+  VALUE item;
+  
+  if (fifo->push == fifo->pop)
+    return Qnil;
+
+  item = fifo->elements[fifo->pop];
+  fifo->elements[fifo->pop++] = Qnil;
+  if(fifo->pop >= fifo->capa) {
+    fifo->pop -= fifo->capa;
+    fifo->push -= fifo->capa;
+  }
+  return item;
+}
+
+/* puts item in front of the head */
+void
+xthread_fifo_ring_unshift(xthread_fifo_t *fifo, VALUE owner, VALUE item)
+{
+  if (XTHREAD_FIFO_RING_LENGTH(fifo) == fifo->capa) {
+    xthread_fifo_resize_double_capa(fifo);
+  }
+  if (--fifo->pop < 0) {
+    fifo->pop += fifo->capa;
+    fifo->push += fifo->capa;
+  }
+  RB_OBJ_WRITE(owner, &fifo->elements[fifo->pop], item);
+  if (fifo->stamps) {
+    fifo->stamps[fifo->pop] = rb_xthread_hrtime();
+  }
+}
+
+/* takes the tail element, the newest one */
+VALUE
+xthread_fifo_ring_pop_back(xthread_fifo_t *fifo)
+{
+  VALUE item;
+  long p;
+
+  if (fifo->push == fifo->pop)
+    return Qnil;
+
+  p = --fifo->push;
+  if (p >= fifo->capa) {
+    p -= fifo->capa;
+  }
+  item = fifo->elements[p];
+  fifo->elements[p] = Qnil;
+  if (fifo->push == fifo->pop) {
+    xthread_fifo_ring_clear(fifo);
+  }
+  return item;
+}
+
+void
+xthread_fifo_ring_clear(xthread_fifo_t *fifo)
+{
+  fifo->push = 0;
+  fifo->pop = 0;
+}
+
+/*
+ * removes the first occurrence of item.  O(n), for the rare paths such
+ * as a waiter leaving a wait list on interrupt.
+ */
+int
+xthread_fifo_ring_delete(xthread_fifo_t *fifo, VALUE item)
+{
+  long i;
+  long len = fifo->push - fifo->pop;
+
+  for (i = 0; i < len; i++) {
+    long p = XTHREAD_FIFO_RING_INDEX(fifo, i);
+
+    if (fifo->elements[p] == item) {
+      for (; i < len - 1; i++) {
+	long q = XTHREAD_FIFO_RING_INDEX(fifo, i + 1);
+
+	fifo->elements[p] = fifo->elements[q];
+	if (fifo->stamps) {
+	  fifo->stamps[p] = fifo->stamps[q];
+	}
+	p = q;
+      }
+      fifo->elements[p] = Qnil;
+      fifo->push--;
+      if (fifo->push == fifo->pop) {
+	xthread_fifo_ring_clear(fifo);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void
+xthread_fifo_mark(void *ptr)
+{
+  xthread_fifo_ring_mark((xthread_fifo_t*)ptr);
+}
+
+static void
+xthread_fifo_compact(void *ptr)
+{
+  xthread_fifo_ring_compact((xthread_fifo_t*)ptr);
+}
+
+static void
+xthread_fifo_free(void *ptr)
+{
+  xthread_fifo_ring_free((xthread_fifo_t*)ptr);
   ruby_xfree(ptr);
 }
 
@@ -73,7 +309,14 @@ xthread_fifo_memsize(const void *ptr)
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xthread_fifo_data_type = {
     "xthread_fifo",
-    {xthread_fifo_mark, xthread_fifo_free, xthread_fifo_memsize,},
+    {xthread_fifo_mark, xthread_fifo_free, xthread_fifo_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_fifo_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 #else
 static const rb_data_type_t xthread_fifo_data_type = {
@@ -91,99 +334,93 @@ xthread_fifo_alloc(VALUE klass)
   xthread_fifo_t *fifo;
 
   obj = TypedData_Make_Struct(klass, xthread_fifo_t, &xthread_fifo_data_type, fifo);
-  
-  fifo->push = 0;
-  fifo->pop = 0;
-
-  fifo->capa = 0;
-  fifo->elements = NULL;
-
+  xthread_fifo_ring_init(fifo);
   return obj;
 }
 
-static void
-xthread_fifo_resize_double_capa(xthread_fifo_t *fifo)
+static VALUE
+xthread_fifo_initialize(VALUE self)
 {
-  long new_capa = fifo->capa * 2;
-
-  REALLOC_N(fifo->elements, VALUE, new_capa);
+  return self;
+}
 
-  if (fifo->push > fifo->capa) {
-    if (fifo->capa - fifo->pop <= fifo->push - fifo->capa) {
-      MEMCPY(&fifo->elements[fifo->pop + fifo->capa],
-	     &fifo->elements[fifo->pop], VALUE, fifo->capa - fifo->pop);
-      fifo->pop += fifo->capa;
-      fifo->push += fifo->capa;
-    }
-    else {
-      MEMCPY(&fifo->elements[fifo->capa],
-	     fifo->elements, VALUE, fifo->push - fifo->capa);
-    }
-  }
-  fifo->capa = new_capa;
+VALUE
+rb_xthread_fifo_new(void)
+{
+  return xthread_fifo_alloc(rb_cXThreadFifo);
 }
 
-static VALUE
-xthread_fifo_initialize(VALUE self)
+VALUE
+rb_xthread_fifo_push(VALUE self, VALUE item)
 {
   xthread_fifo_t *fifo;
+  
   GetXThreadFifoPtr(self, fifo);
-
-  fifo->capa = FIFO_DEFAULT_CAPA;
-  fifo->elements = ALLOC_N(VALUE, fifo->capa);
+  xthread_fifo_ring_push(fifo, self, item);
+  XTHREAD_PROBE_FIFO_PUSH(self, XTHREAD_FIFO_RING_LENGTH(fifo));
   return self;
 }
 
 VALUE
-rb_xthread_fifo_new(void)
+rb_xthread_fifo_pop(VALUE self)
 {
-  VALUE self;
-  self = xthread_fifo_alloc(rb_cXThreadFifo);
-  xthread_fifo_initialize(self);
+  xthread_fifo_t *fifo;
+  
+  VALUE item;
+  
+  GetXThreadFifoPtr(self, fifo);
+  item = xthread_fifo_ring_pop(fifo);
+  XTHREAD_PROBE_FIFO_POP(self, XTHREAD_FIFO_RING_LENGTH(fifo));
+  return item;
+}
+
+VALUE
+rb_xthread_fifo_unshift(VALUE self, VALUE item)
+{
+  xthread_fifo_t *fifo;
+  
+  GetXThreadFifoPtr(self, fifo);
+  xthread_fifo_ring_unshift(fifo, self, item);
+  XTHREAD_PROBE_FIFO_PUSH(self, XTHREAD_FIFO_RING_LENGTH(fifo));
   return self;
 }
 
 VALUE
-rb_xthread_fifo_push(VALUE self, VALUE item)
+rb_xthread_fifo_pop_back(VALUE self)
 {
   xthread_fifo_t *fifo;
-  int signal_p = 0;
+  VALUE item;
   
   GetXThreadFifoPtr(self, fifo);
+  item = xthread_fifo_ring_pop_back(fifo);
+  XTHREAD_PROBE_FIFO_POP(self, XTHREAD_FIFO_RING_LENGTH(fifo));
+  return item;
+}
 
-  if (fifo->push < fifo->capa) {
-    fifo->elements[fifo->push++] = item;
-    return self;
-  }
+/* head element without taking it; nil when empty */
+VALUE
+rb_xthread_fifo_first(VALUE self)
+{
+  xthread_fifo_t *fifo;
+  GetXThreadFifoPtr(self, fifo);
 
-  if (fifo->push - fifo->capa < fifo->pop) {
-    fifo->elements[fifo->push - fifo->capa] = item;
-    fifo->push++;
-    return self;
+  if (XTHREAD_FIFO_RING_EMPTY_P(fifo)) {
+    return Qnil;
   }
-
-  xthread_fifo_resize_double_capa(fifo);
-  return rb_xthread_fifo_push(self, item);
+  return fifo->elements[XTHREAD_FIFO_RING_INDEX(fifo, 0)];
 }
 
+/* tail element without taking it; nil when empty */
 VALUE
-rb_xthread_fifo_pop(VALUE self)
+rb_xthread_fifo_last(VALUE self)
 {
   xthread_fifo_t *fifo;
-  VALUE item;
-  
   GetXThreadFifoPtr(self, fifo);
 
-  if (fifo->push == fifo->pop)
+  if (XTHREAD_FIFO_RING_EMPTY_P(fifo)) {
     return Qnil;
-
-  item = fifo->elements[fifo->pop];
-  fifo->elements[fifo->pop++] = Qnil;
-  if(fifo->pop >= fifo->capa) {
-    fifo->pop -= fifo->capa;
-    fifo->push -= fifo->capa;
   }
-  return item;
+  return fifo->elements[XTHREAD_FIFO_RING_INDEX(fifo, XTHREAD_FIFO_RING_LENGTH(fifo) - 1)];
 }
 
 VALUE
@@ -203,8 +440,7 @@ rb_xthread_fifo_clear(VALUE self)
   xthread_fifo_t *fifo;
   GetXThreadFifoPtr(self, fifo);
 
-  fifo->push = 0;
-  fifo->pop = 0;
+  xthread_fifo_ring_clear(fifo);
   return self;
 }
 
@@ -217,32 +453,168 @@ rb_xthread_fifo_length(VALUE self)
   return LONG2NUM(fifo->push - fifo->pop);
 }
 
+/*
+ * appends n elements starting at the offset-th element to ary.  The ring
+ * holds them in at most two contiguous segments, each copied at once.
+ */
+void
+xthread_fifo_ring_cat(xthread_fifo_t *fifo, VALUE ary, long offset, long n)
+{
+  long p;
+  long seg;
+
+  if (n <= 0) {
+    return;
+  }
+  p = XTHREAD_FIFO_RING_INDEX(fifo, offset);
+  seg = fifo->capa - p;
+  if (seg >= n) {
+    rb_ary_cat(ary, &fifo->elements[p], n);
+  }
+  else {
+    rb_ary_cat(ary, &fifo->elements[p], seg);
+    rb_ary_cat(ary, fifo->elements, n - seg);
+  }
+}
+
 VALUE
 rb_xthread_fifo_to_a(VALUE self)
 {
   VALUE ary;
+  long len;
   xthread_fifo_t *fifo;
   GetXThreadFifoPtr(self, fifo);
 
-  ary = rb_ary_new2(fifo->push - fifo->pop);
+  len = XTHREAD_FIFO_RING_LENGTH(fifo);
+  ary = rb_ary_new2(len);
+  xthread_fifo_ring_cat(fifo, ary, 0, len);
+  return ary;
+}
 
-  if (fifo->push < fifo->capa) {
-    long i;
-    for (i = fifo->pop; i < fifo->push; i++) {
-      rb_ary_push(ary, fifo->elements[i]);
-    }
+VALUE
+rb_xthread_fifo_shift_n(VALUE self, long n)
+{
+  VALUE ary;
+  long i;
+  xthread_fifo_t *fifo;
+  GetXThreadFifoPtr(self, fifo);
+
+  if (n < 0) {
+    rb_raise(rb_eArgError, "negative array size");
   }
-  else {
-    long i;
-    for (i = 0; i < fifo->push - fifo->capa; i++) {
-      rb_ary_push(ary, fifo->elements[i]);
+  if (n > XTHREAD_FIFO_RING_LENGTH(fifo)) {
+    n = XTHREAD_FIFO_RING_LENGTH(fifo);
+  }
+  ary = rb_ary_new2(n);
+  xthread_fifo_ring_cat(fifo, ary, 0, n);
+
+  for (i = 0; i < n; i++) {
+    fifo->elements[XTHREAD_FIFO_RING_INDEX(fifo, i)] = Qnil;
+  }
+  fifo->pop += n;
+  if (fifo->pop >= fifo->capa) {
+    fifo->pop -= fifo->capa;
+    fifo->push -= fifo->capa;
+  }
+  return ary;
+}
+
+static VALUE
+xthread_fifo_pop(int argc, VALUE *argv, VALUE self)
+{
+  VALUE n;
+
+  rb_scan_args(argc, argv, "01", &n);
+  if (NIL_P(n)) {
+    return rb_xthread_fifo_pop(self);
+  }
+  return rb_xthread_fifo_shift_n(self, NUM2LONG(n));
+}
+
+/*
+ *  call-seq:
+ *     first     -> obj or nil
+ *     first(n)  -> array
+ *
+ *  The head element, or an array of the first +n+ elements, without
+ *  taking them.
+ */
+static VALUE
+xthread_fifo_first(int argc, VALUE *argv, VALUE self)
+{
+  VALUE n;
+  VALUE ary;
+  long len;
+  xthread_fifo_t *fifo;
+
+  rb_scan_args(argc, argv, "01", &n);
+  if (NIL_P(n)) {
+    return rb_xthread_fifo_first(self);
+  }
+  GetXThreadFifoPtr(self, fifo);
+  len = NUM2LONG(n);
+  if (len < 0) {
+    rb_raise(rb_eArgError, "negative array size");
+  }
+  if (len > XTHREAD_FIFO_RING_LENGTH(fifo)) {
+    len = XTHREAD_FIFO_RING_LENGTH(fifo);
+  }
+  ary = rb_ary_new2(len);
+  xthread_fifo_ring_cat(fifo, ary, 0, len);
+  return ary;
+}
+
+/*
+ * iterates the ring in place.  The ring is looked up again for every
+ * element, so the block may push or pop.
+ */
+VALUE
+rb_xthread_fifo_each(VALUE self)
+{
+  xthread_fifo_t *fifo;
+  long i;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  for (i = 0; ; i++) {
+    GetXThreadFifoPtr(self, fifo);
+    if (i >= XTHREAD_FIFO_RING_LENGTH(fifo)) {
+      break;
     }
+    rb_yield(fifo->elements[XTHREAD_FIFO_RING_INDEX(fifo, i)]);
+  }
+  return self;
+}
 
-    for (i = fifo->pop; i < fifo->capa; i++) {
-      rb_ary_push(ary, fifo->elements[i]);
+static VALUE
+xthread_fifo_each_slice(VALUE self, VALUE v_n)
+{
+  xthread_fifo_t *fifo;
+  long n = NUM2LONG(v_n);
+  long i;
+
+  if (n <= 0) {
+    rb_raise(rb_eArgError, "invalid slice size");
+  }
+  RETURN_ENUMERATOR(self, 1, &v_n);
+
+  for (i = 0; ; i += n) {
+    VALUE ary;
+    long len;
+    
+    GetXThreadFifoPtr(self, fifo);
+    len = XTHREAD_FIFO_RING_LENGTH(fifo) - i;
+    if (len <= 0) {
+      break;
+    }
+    if (len > n) {
+      len = n;
     }
+    ary = rb_ary_new2(len);
+    xthread_fifo_ring_cat(fifo, ary, i, len);
+    rb_yield(ary);
   }
-  return ary;
+  return self;
 }
 
 VALUE
@@ -263,19 +635,27 @@ void
 Init_XThreadFifo()
 {
   rb_cXThreadFifo  = rb_define_class_under(rb_mXThread, "Fifo", rb_cObject);
+  rb_include_module(rb_cXThreadFifo, rb_mEnumerable);
 
   rb_define_alloc_func(rb_cXThreadFifo, xthread_fifo_alloc);
   rb_define_method(rb_cXThreadFifo, "initialize", xthread_fifo_initialize, 0);
-  rb_define_method(rb_cXThreadFifo, "pop", rb_xthread_fifo_pop, 0);
+  rb_define_method(rb_cXThreadFifo, "pop", xthread_fifo_pop, -1);
   rb_define_alias(rb_cXThreadFifo,  "shift", "pop");
   rb_define_alias(rb_cXThreadFifo,  "deq", "pop");
   rb_define_method(rb_cXThreadFifo, "push", rb_xthread_fifo_push, 1);
   rb_define_alias(rb_cXThreadFifo,  "<<", "push");
   rb_define_alias(rb_cXThreadFifo,  "enq", "push");
+  rb_define_method(rb_cXThreadFifo, "unshift", rb_xthread_fifo_unshift, 1);
+  rb_define_method(rb_cXThreadFifo, "pop_back", rb_xthread_fifo_pop_back, 0);
+  rb_define_method(rb_cXThreadFifo, "first", xthread_fifo_first, -1);
+  rb_define_alias(rb_cXThreadFifo,  "peek", "first");
+  rb_define_method(rb_cXThreadFifo, "last", rb_xthread_fifo_last, 0);
   rb_define_method(rb_cXThreadFifo, "empty?", rb_xthread_fifo_empty_p, 0);
   rb_define_method(rb_cXThreadFifo, "clear", rb_xthread_fifo_clear, 0);
   rb_define_method(rb_cXThreadFifo, "length", rb_xthread_fifo_length, 0);
   rb_define_alias(rb_cXThreadFifo,  "size", "length");
+  rb_define_method(rb_cXThreadFifo, "each", rb_xthread_fifo_each, 0);
+  rb_define_method(rb_cXThreadFifo, "each_slice", xthread_fifo_each_slice, 1);
   rb_define_method(rb_cXThreadFifo, "to_a", rb_xthread_fifo_to_a, 0);
   rb_define_method(rb_cXThreadFifo, "inspect", rb_xthread_fifo_inspect, 0);
   
@@ -0,0 +1,157 @@
+/**********************************************************************
+
+  histogram.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+/*
+ * fixed memory log-linear histogram of nanosecond values.  Values
+ * below 2^SUB_BITS+1 are counted exactly; above that every power of
+ * two is split into 2^SUB_BITS linear buckets, which keeps the
+ * relative error under 1/2^SUB_BITS (about 3%).  Values beyond
+ * 2^MAX_EXP ns (about 18 minutes) are clamped into the last bucket.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (HIST_SUB_COUNT * 2)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS \
+  (HIST_LINEAR + (HIST_MAX_EXP - HIST_SUB_BITS) * HIST_SUB_COUNT)
+
+struct rb_xthread_histogram_struct
+{
+  unsigned LONG_LONG total;
+  unsigned LONG_LONG counts[HIST_BUCKETS];
+};
+
+static inline int
+xthread_histogram_msb(xthread_hrtime_t v)
+{
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  int e = 0;
+
+  while (v >>= 1) {
+    e++;
+  }
+  return e;
+#endif
+}
+
+static inline long
+xthread_histogram_index(xthread_hrtime_t v)
+{
+  int e;
+
+  if (v < HIST_LINEAR) {
+    return (long)v;
+  }
+  e = xthread_histogram_msb(v);
+  if (e >= HIST_MAX_EXP + 1) {
+    return HIST_BUCKETS - 1;
+  }
+  return HIST_LINEAR + (e - HIST_SUB_BITS - 1) * HIST_SUB_COUNT
+    + (long)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* largest value counted in bucket idx */
+static xthread_hrtime_t
+xthread_histogram_upper(long idx)
+{
+  int e;
+  xthread_hrtime_t sub;
+
+  if (idx < HIST_LINEAR) {
+    return (xthread_hrtime_t)idx;
+  }
+  e = (int)((idx - HIST_LINEAR) / HIST_SUB_COUNT) + HIST_SUB_BITS + 1;
+  sub = (idx - HIST_LINEAR) % HIST_SUB_COUNT;
+  return (((xthread_hrtime_t)HIST_SUB_COUNT + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+xthread_histogram_t *
+xthread_histogram_new(void)
+{
+  xthread_histogram_t *hist;
+
+  hist = ALLOC(xthread_histogram_t);
+  xthread_histogram_reset(hist);
+  return hist;
+}
+
+void
+xthread_histogram_free(xthread_histogram_t *hist)
+{
+  ruby_xfree(hist);
+}
+
+size_t
+xthread_histogram_memsize(const xthread_histogram_t *hist)
+{
+  return sizeof(xthread_histogram_t);
+}
+
+void
+xthread_histogram_record(xthread_histogram_t *hist, xthread_hrtime_t v)
+{
+  hist->counts[xthread_histogram_index(v)]++;
+  hist->total++;
+}
+
+void
+xthread_histogram_reset(xthread_histogram_t *hist)
+{
+  MEMZERO(hist, xthread_histogram_t, 1);
+}
+
+unsigned LONG_LONG
+xthread_histogram_count(const xthread_histogram_t *hist)
+{
+  return hist->total;
+}
+
+/*
+ * value at percentile p (0..100).  The upper bound of the bucket
+ * holding the rank is returned, so the answer never understates.
+ */
+xthread_hrtime_t
+xthread_histogram_percentile(const xthread_histogram_t *hist, double p)
+{
+  unsigned LONG_LONG rank, seen = 0;
+  long i;
+
+  if (hist->total == 0) {
+    return 0;
+  }
+  if (p <= 0) {
+    rank = 1;
+  }
+  else if (p >= 100) {
+    rank = hist->total;
+  }
+  else {
+    rank = (unsigned LONG_LONG)(p / 100.0 * (double)hist->total);
+    if ((double)rank < p / 100.0 * (double)hist->total) {
+      rank++;
+    }
+    if (rank == 0) {
+      rank = 1;
+    }
+  }
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      return xthread_histogram_upper(i);
+    }
+  }
+  return xthread_histogram_upper(HIST_BUCKETS - 1);
+}
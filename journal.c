@@ -0,0 +1,599 @@
+/**********************************************************************
+
+  journal.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+#include "ruby/util.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifndef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#define rb_thread_call_without_gvl(func, data, ubf, data2) \
+  rb_thread_blocking_region((rb_blocking_function_t *)(func), (data), (ubf), (data2))
+#endif
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync(fd) fsync(fd)
+#endif
+
+/*
+ * write-ahead journal for JournalQueue.
+ *
+ * The log is a sequence of records <type:1><length:4><payload>.  A push
+ * appends a PUSH record carrying the item, a pop appends an ACK record
+ * which drops the oldest live item, and clear appends a CLEAR record.
+ * Replaying the log from the start rebuilds the queue.
+ *
+ * Records are first collected in buf.  Whoever finds no flush in
+ * progress becomes the leader: it takes the whole buffer, writes (and
+ * for XTHREAD_JOURNAL_SYNC_ALWAYS fsyncs) it without the GVL, and wakes
+ * the threads that queued up behind it (group commit).
+ *
+ * When acknowledged records dominate the log it is compacted in a
+ * background thread: live items are written to a new file, records
+ * appended meanwhile are copied after them, and the new file replaces
+ * the log.
+ */
+
+#define JOURNAL_PUSH 'P'
+#define JOURNAL_ACK 'A'
+#define JOURNAL_CLEAR 'C'
+#define JOURNAL_HEADER (1 + sizeof(uint32_t))
+
+#define JOURNAL_COMPACT_MIN 4096
+
+typedef struct rb_xthread_journal_buffer_struct
+{
+  char *ptr;
+  size_t len;
+  size_t capa;
+} xthread_journal_buffer_t;
+
+struct rb_xthread_journal_struct
+{
+  char *path;
+  int fd;
+  int sync;
+  xthread_hrtime_t interval;
+  xthread_hrtime_t last_sync;
+
+  xthread_journal_buffer_t buf;
+  unsigned LONG_LONG lsn;
+  unsigned LONG_LONG written_lsn;
+  unsigned LONG_LONG synced_lsn;
+  int flushing;
+  xthread_fifo_t waiters;
+
+  long live;
+  long acked;
+  int compacting;
+  xthread_journal_buffer_t compact_tail;
+  VALUE compactor;
+};
+
+static void
+xthread_journal_buffer_cat(xthread_journal_buffer_t *b, const char *ptr, size_t len)
+{
+  if (b->len + len > b->capa) {
+    size_t capa = b->capa ? b->capa : 4096;
+
+    while (capa < b->len + len) {
+      capa *= 2;
+    }
+    REALLOC_N(b->ptr, char, capa);
+    b->capa = capa;
+  }
+  memcpy(b->ptr + b->len, ptr, len);
+  b->len += len;
+}
+
+static void
+xthread_journal_buffer_record(xthread_journal_buffer_t *b, char type,
+			      const char *ptr, uint32_t len)
+{
+  char header[JOURNAL_HEADER];
+
+  header[0] = type;
+  memcpy(header + 1, &len, sizeof(len));
+  xthread_journal_buffer_cat(b, header, JOURNAL_HEADER);
+  xthread_journal_buffer_cat(b, ptr, len);
+}
+
+static void
+xthread_journal_buffer_free(xthread_journal_buffer_t *b)
+{
+  if (b->ptr) {
+    ruby_xfree(b->ptr);
+  }
+  b->ptr = NULL;
+  b->len = b->capa = 0;
+}
+
+struct xthread_journal_io_arg {
+  int fd;
+  const char *ptr;
+  size_t len;
+  int sync;
+  int err;
+};
+
+static void *
+xthread_journal_write_nogvl(void *ptr)
+{
+  struct xthread_journal_io_arg *arg = ptr;
+
+  while (arg->len > 0) {
+    ssize_t n = write(arg->fd, arg->ptr, arg->len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      arg->err = errno;
+      return NULL;
+    }
+    arg->ptr += n;
+    arg->len -= n;
+  }
+  if (arg->sync && fdatasync(arg->fd) < 0) {
+    arg->err = errno;
+  }
+  return NULL;
+}
+
+static int
+xthread_journal_write(int fd, const char *ptr, size_t len, int sync)
+{
+  struct xthread_journal_io_arg arg;
+
+  arg.fd = fd;
+  arg.ptr = ptr;
+  arg.len = len;
+  arg.sync = sync;
+  arg.err = 0;
+  rb_thread_call_without_gvl(xthread_journal_write_nogvl, &arg, RUBY_UBF_IO, 0);
+  return arg.err;
+}
+
+/*
+ * writes out the buffer, repeatedly while other threads keep appending.
+ * The caller must have checked that no flush is in progress.
+ */
+static void
+xthread_journal_flush(xthread_journal_t *j, int sync)
+{
+  xthread_journal_buffer_t out;
+  int err = 0;
+
+  j->flushing = 1;
+  out.ptr = NULL;
+  out.len = out.capa = 0;
+
+  while (j->buf.len > 0 || (sync && j->synced_lsn < j->written_lsn)) {
+    unsigned LONG_LONG upto = j->lsn;
+    xthread_journal_buffer_t tmp = out;
+
+    out = j->buf;
+    j->buf = tmp;
+    j->buf.len = 0;
+
+    err = xthread_journal_write(j->fd, out.ptr, out.len, sync);
+    if (err) {
+      break;
+    }
+    j->written_lsn = upto;
+    if (sync) {
+      j->synced_lsn = upto;
+      j->last_sync = rb_xthread_hrtime();
+    }
+    out.len = 0;
+  }
+  xthread_journal_buffer_free(&out);
+
+  j->flushing = 0;
+  xthread_waiters_broadcast(&j->waiters);
+  if (err) {
+    errno = err;
+    rb_sys_fail(j->path);
+  }
+}
+
+static void
+xthread_journal_commit(VALUE owner, xthread_journal_t *j, unsigned LONG_LONG lsn, int durable)
+{
+  if (j->sync == XTHREAD_JOURNAL_SYNC_INTERVAL &&
+      rb_xthread_hrtime() - j->last_sync >= j->interval) {
+    durable = 1;
+  }
+
+  for (;;) {
+    if (durable ? j->synced_lsn >= lsn : j->written_lsn >= lsn) {
+      return;
+    }
+    if (!j->flushing) {
+      xthread_journal_flush(j, durable);
+    }
+    else if (durable) {
+      xthread_waiters_wait(owner, &j->waiters);
+    }
+    else {
+      /* the running leader picks the record up */
+      return;
+    }
+  }
+}
+
+static unsigned LONG_LONG
+xthread_journal_append(xthread_journal_t *j, char type, const char *ptr, uint32_t len)
+{
+  xthread_journal_buffer_record(&j->buf, type, ptr, len);
+  if (j->compacting) {
+    xthread_journal_buffer_record(&j->compact_tail, type, ptr, len);
+  }
+  return ++j->lsn;
+}
+
+/* replay */
+
+static void
+xthread_journal_replay(xthread_journal_t *j, VALUE owner, xthread_fifo_t *fifo)
+{
+  struct stat st;
+  char *data;
+  size_t size;
+  size_t pos = 0;
+  size_t r = 0;
+
+  if (fstat(j->fd, &st) < 0) {
+    rb_sys_fail(j->path);
+  }
+  size = st.st_size;
+  if (size == 0) {
+    return;
+  }
+
+  data = ALLOC_N(char, size);
+  while (r < size) {
+    ssize_t n = pread(j->fd, data + r, size - r, r);
+
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      ruby_xfree(data);
+      rb_sys_fail(j->path);
+    }
+    r += n;
+  }
+
+  while (pos + JOURNAL_HEADER <= size) {
+    uint32_t len;
+
+    memcpy(&len, data + pos + 1, sizeof(len));
+    if (pos + JOURNAL_HEADER + len > size) {
+      break;
+    }
+    switch (data[pos]) {
+    case JOURNAL_PUSH:
+      xthread_fifo_ring_push(fifo, owner,
+			     rb_str_new(data + pos + JOURNAL_HEADER, len));
+      j->live++;
+      break;
+    case JOURNAL_ACK:
+      if (!XTHREAD_FIFO_RING_EMPTY_P(fifo)) {
+	xthread_fifo_ring_pop(fifo);
+	j->live--;
+      }
+      j->acked++;
+      break;
+    case JOURNAL_CLEAR:
+      j->acked += j->live;
+      j->live = 0;
+      xthread_fifo_ring_clear(fifo);
+      break;
+    default:
+      /* garbage: treat as a torn tail */
+      size = pos;
+      continue;
+    }
+    pos += JOURNAL_HEADER + len;
+  }
+  ruby_xfree(data);
+
+  /* drop a record torn by a crash */
+  if (pos < (size_t)st.st_size && ftruncate(j->fd, pos) < 0) {
+    rb_sys_fail(j->path);
+  }
+}
+
+xthread_journal_t *
+xthread_journal_open(const char *path, int sync, double interval,
+		     VALUE owner, xthread_fifo_t *fifo)
+{
+  xthread_journal_t *j;
+  VALUE tmp;
+
+  j = ALLOC(xthread_journal_t);
+  MEMZERO(j, xthread_journal_t, 1);
+  j->path = ruby_strdup(path);
+  j->sync = sync;
+  j->interval = (xthread_hrtime_t)(interval * XTHREAD_NSEC_PER_SEC);
+  j->last_sync = rb_xthread_hrtime();
+  j->compactor = Qnil;
+  xthread_fifo_ring_init(&j->waiters);
+
+  /* leftover of a compaction interrupted by a crash */
+  tmp = rb_sprintf("%s.compact", path);
+  unlink(RSTRING_PTR(tmp));
+
+  j->fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0600);
+  if (j->fd < 0) {
+    int e = errno;
+    ruby_xfree(j->path);
+    ruby_xfree(j);
+    errno = e;
+    rb_sys_fail(path);
+  }
+  xthread_journal_replay(j, owner, fifo);
+  return j;
+}
+
+void
+xthread_journal_mark(xthread_journal_t *j)
+{
+  xthread_fifo_ring_mark(&j->waiters);
+  rb_gc_mark_movable(j->compactor);
+}
+
+void
+xthread_journal_compact_refs(xthread_journal_t *j)
+{
+  xthread_fifo_ring_compact(&j->waiters);
+  j->compactor = rb_gc_location(j->compactor);
+}
+
+void
+xthread_journal_free(xthread_journal_t *j)
+{
+  /* records still buffered are written, but not synced */
+  if (j->buf.len > 0 && !j->flushing) {
+    const char *p = j->buf.ptr;
+    size_t len = j->buf.len;
+
+    while (len > 0) {
+      ssize_t n = write(j->fd, p, len);
+      if (n <= 0) break;
+      p += n;
+      len -= n;
+    }
+  }
+  close(j->fd);
+  xthread_journal_buffer_free(&j->buf);
+  xthread_journal_buffer_free(&j->compact_tail);
+  xthread_fifo_ring_free(&j->waiters);
+  ruby_xfree(j->path);
+  ruby_xfree(j);
+}
+
+size_t
+xthread_journal_memsize(const xthread_journal_t *j)
+{
+  return sizeof(xthread_journal_t) + j->buf.capa + j->compact_tail.capa +
+    j->waiters.capa * sizeof(VALUE);
+}
+
+void
+xthread_journal_push(VALUE owner, xthread_journal_t *j, VALUE str)
+{
+  unsigned LONG_LONG lsn;
+
+  lsn = xthread_journal_append(j, JOURNAL_PUSH,
+			       RSTRING_PTR(str), (uint32_t)RSTRING_LEN(str));
+  j->live++;
+  xthread_journal_commit(owner, j, lsn, j->sync == XTHREAD_JOURNAL_SYNC_ALWAYS);
+}
+
+static int xthread_journal_compactor_running_p(xthread_journal_t *j);
+static void xthread_journal_start_compaction(VALUE owner, xthread_journal_t *j);
+
+void
+xthread_journal_ack(VALUE owner, xthread_journal_t *j)
+{
+  unsigned LONG_LONG lsn;
+
+  lsn = xthread_journal_append(j, JOURNAL_ACK, NULL, 0);
+  j->live--;
+  j->acked++;
+  xthread_journal_commit(owner, j, lsn, 0);
+
+  if (!j->compacting && j->acked >= JOURNAL_COMPACT_MIN && j->acked > j->live &&
+      !xthread_journal_compactor_running_p(j)) {
+    xthread_journal_start_compaction(owner, j);
+  }
+}
+
+void
+xthread_journal_clear(VALUE owner, xthread_journal_t *j)
+{
+  unsigned LONG_LONG lsn;
+
+  lsn = xthread_journal_append(j, JOURNAL_CLEAR, NULL, 0);
+  j->acked += j->live;
+  j->live = 0;
+  xthread_journal_commit(owner, j, lsn, j->sync == XTHREAD_JOURNAL_SYNC_ALWAYS);
+}
+
+void
+xthread_journal_sync(VALUE owner, xthread_journal_t *j)
+{
+  xthread_journal_commit(owner, j, j->lsn, 1);
+}
+
+/* compaction */
+
+struct xthread_journal_compact_arg {
+  VALUE owner;
+  xthread_journal_t *j;
+  xthread_fifo_t *fifo;
+};
+
+static int
+xthread_journal_open_compact(xthread_journal_t *j, VALUE tmp)
+{
+  int fd = open(RSTRING_PTR(tmp), O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0600);
+
+  if (fd < 0) {
+    rb_sys_fail(RSTRING_PTR(tmp));
+  }
+  return fd;
+}
+
+static VALUE
+xthread_journal_compact_body(VALUE v_arg)
+{
+  struct xthread_journal_compact_arg *arg = (struct xthread_journal_compact_arg *)v_arg;
+  xthread_journal_t *j = arg->j;
+  xthread_journal_buffer_t snap;
+  VALUE tmp = rb_sprintf("%s.compact", j->path);
+  long i;
+  long len;
+  int fd;
+  int err;
+
+  /* snapshot the live items; everything appended from now on is
+     collected in compact_tail as well */
+  snap.ptr = NULL;
+  snap.len = snap.capa = 0;
+  len = XTHREAD_FIFO_RING_LENGTH(arg->fifo);
+  for (i = 0; i < len; i++) {
+    VALUE str = arg->fifo->elements[XTHREAD_FIFO_RING_INDEX(arg->fifo, i)];
+
+    /* only Strings can be logged; anything else got in behind the
+       journal's back */
+    if (!RB_TYPE_P(str, T_STRING)) {
+      xthread_journal_buffer_free(&snap);
+      rb_raise(rb_eTypeError, "journal queue holds %"PRIsVALUE", not a String",
+	       rb_obj_class(str));
+    }
+    xthread_journal_buffer_record(&snap, JOURNAL_PUSH,
+				  RSTRING_PTR(str), (uint32_t)RSTRING_LEN(str));
+  }
+  j->compact_tail.len = 0;
+  j->compacting = 1;
+
+  fd = xthread_journal_open_compact(j, tmp);
+  err = xthread_journal_write(fd, snap.ptr, snap.len, 1);
+  xthread_journal_buffer_free(&snap);
+  if (err) {
+    close(fd);
+    errno = err;
+    rb_sys_fail(RSTRING_PTR(tmp));
+  }
+
+  /* become the leader so that no flush goes to the old file */
+  while (j->flushing) {
+    xthread_waiters_wait(arg->owner, &j->waiters);
+  }
+  j->flushing = 1;
+  while (j->compact_tail.len > 0) {
+    xthread_journal_buffer_t out = j->compact_tail;
+
+    j->compact_tail.ptr = NULL;
+    j->compact_tail.len = j->compact_tail.capa = 0;
+    err = xthread_journal_write(fd, out.ptr, out.len, 1);
+    xthread_journal_buffer_free(&out);
+    if (err) {
+      j->flushing = 0;
+      xthread_waiters_broadcast(&j->waiters);
+      close(fd);
+      errno = err;
+      rb_sys_fail(RSTRING_PTR(tmp));
+    }
+  }
+  if (rename(RSTRING_PTR(tmp), j->path) < 0) {
+    err = errno;
+    j->flushing = 0;
+    xthread_waiters_broadcast(&j->waiters);
+    close(fd);
+    errno = err;
+    rb_sys_fail(j->path);
+  }
+  close(j->fd);
+  j->fd = fd;
+
+  /* everything in buf is in the new file already */
+  j->buf.len = 0;
+  j->written_lsn = j->synced_lsn = j->lsn;
+  j->last_sync = rb_xthread_hrtime();
+  j->acked = 0;
+  j->flushing = 0;
+  xthread_waiters_broadcast(&j->waiters);
+  return Qnil;
+}
+
+static VALUE
+xthread_journal_compact_ensure(VALUE v_arg)
+{
+  struct xthread_journal_compact_arg *arg = (struct xthread_journal_compact_arg *)v_arg;
+
+  arg->j->compacting = 0;
+  xthread_journal_buffer_free(&arg->j->compact_tail);
+  xthread_waiters_broadcast(&arg->j->waiters);
+  return Qnil;
+}
+
+void
+xthread_journal_compact(VALUE owner, xthread_journal_t *j, xthread_fifo_t *fifo)
+{
+  struct xthread_journal_compact_arg arg;
+
+  /* a compaction already under way may miss the latest acks */
+  while (j->compacting) {
+    xthread_waiters_wait(owner, &j->waiters);
+  }
+  arg.owner = owner;
+  arg.j = j;
+  arg.fifo = fifo;
+  rb_ensure(xthread_journal_compact_body, (VALUE)&arg,
+	    xthread_journal_compact_ensure, (VALUE)&arg);
+}
+
+static VALUE
+xthread_journal_compactor(RB_BLOCK_CALL_FUNC_ARGLIST(owner, dmy))
+{
+  return rb_funcall(owner, rb_intern("compact"), 0);
+}
+
+static int
+xthread_journal_compactor_running_p(xthread_journal_t *j)
+{
+  return !NIL_P(j->compactor) && RTEST(rb_funcall(j->compactor, rb_intern("alive?"), 0));
+}
+
+/*
+ * starts a compaction in a new thread.  The queue is handed to the
+ * thread as a Thread.new argument, which keeps it alive until the
+ * thread has run.
+ */
+static void
+xthread_journal_start_compaction(VALUE owner, xthread_journal_t *j)
+{
+  VALUE th;
+
+  th = rb_block_call(rb_cThread, rb_intern("new"), 1, &owner,
+		     xthread_journal_compactor, Qnil);
+  RB_OBJ_WRITE(owner, &j->compactor, th);
+}
@@ -6,6 +6,7 @@
 #
 
 require "xthread.so"
+require "xthread/metrics"
 
 unless defined? Thread
   raise "Thread not available for this ruby interpreter"
@@ -20,40 +21,6 @@ if $DEBUG
   Thread.abort_on_exception = true
 end
 
-module XThread
-  module MonitorMixin
-    def self.extend_object(obj)
-      super(obj)
-      obj.__send__(:mon_initialize)
-    end
-
-    def mon_initialize
-      @_monitor = Monitor.new
-    end
-
-    def mon_try_enter
-      @_monitor.try_enter
-    end
-
-    def mon_enter
-      @_monitor.enter
-    end
-
-    def mon_exit
-      @_monitor.exit
-    end
-
-    def mon_synchronize(&block)
-      @_monitor.synchronize(&block)
-    end
-
-    def new_cond
-      @_monitor.new_cond
-    end
-
-  end
-end
-
 module XThread
   class RBQueue
     def initialize
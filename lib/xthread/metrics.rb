@@ -0,0 +1,60 @@
+#
+#   xthread/metrics.rb - queue counters in Prometheus text format
+#		 Copyright (C) 2011 Keiju Ishitsuka
+#                Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+#
+#
+
+require "xthread.so"
+
+module XThread
+  METRICS = [
+    [:length, "xthread_queue_length", "gauge",
+      "Current number of queued items."],
+    [:high_water, "xthread_queue_high_water", "gauge",
+      "Deepest the queue has been."],
+    [:pushes, "xthread_queue_pushes_total", "counter",
+      "Items pushed."],
+    [:pops, "xthread_queue_pops_total", "counter",
+      "Items popped."],
+    [:consumer_blocks, "xthread_queue_consumer_blocks_total", "counter",
+      "Pops that had to wait for an item."],
+    [:consumer_block_time, "xthread_queue_consumer_block_seconds_total", "counter",
+      "Time consumers spent waiting."],
+    [:producer_blocks, "xthread_queue_producer_blocks_total", "counter",
+      "Pushes that had to wait for room."],
+    [:producer_block_time, "xthread_queue_producer_block_seconds_total", "counter",
+      "Time producers spent waiting."],
+  ]
+
+  #
+  # Renders XThread.queue_stats in the Prometheus text exposition format.
+  # With +path+ the text is also written there, through a temporary file
+  # and a rename so that a collector never reads half of it.
+  #
+  def self.metrics(path = nil)
+    stats = queue_stats.sort_by{|s| s[:serial]}
+    out = ""
+    METRICS.each do |key, name, type, help|
+      out << "# HELP #{name} #{help}\n"
+      out << "# TYPE #{name} #{type}\n"
+      stats.each do |s|
+	labels = %{queue="#{s[:serial]}",class="#{s[:kind]}"}
+	labels << %{,name="#{metrics_escape(s[:name])}"} if s[:name]
+	out << "#{name}{#{labels}} #{s[key]}\n"
+      end
+    end
+
+    if path
+      tmp = "#{path}.#{$$}.tmp"
+      File.open(tmp, "w"){|f| f.write out}
+      File.rename(tmp, path)
+    end
+    out
+  end
+
+  def self.metrics_escape(str)
+    str.gsub(/[\\"\n]/){|c| c == "\n" ? "\\n" : "\\#{c}"}
+  end
+  private_class_method :metrics_escape
+end
@@ -0,0 +1,28 @@
+#
+#   xthread/replace.rb - use XThread in place of the standard primitives
+#		 Copyright (C) 2011 Keiju Ishitsuka
+#                Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+#
+#   require "xthread/replace"
+#
+#   rebinds ::Queue, ::SizedQueue, ::ConditionVariable, ::Monitor and
+#   ::MonitorMixin to the XThread classes.  Objects created before the
+#   require keep their original classes; Thread::Queue and friends are
+#   left alone.
+#
+
+require "xthread"
+
+# load the standard monitor first, so that a later require "monitor"
+# does not reopen XThread::Monitor
+require "monitor"
+
+module XThread
+  REPLACED = {}
+
+  [:Queue, :SizedQueue, :ConditionVariable, :Monitor, :MonitorMixin].each do |name|
+    REPLACED[name] = ::Object.const_get(name)
+    ::Object.__send__(:remove_const, name)
+    ::Object.const_set(name, XThread.const_get(name))
+  end
+end
@@ -0,0 +1,814 @@
+/**********************************************************************
+
+  lru-cache.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+VALUE rb_cXThreadLRUCache;
+
+static ID id_call;
+
+/*
+ * LRUCache keeps its entries in a node array, chained into a doubly
+ * linked list from the most to the least recently used by slot number,
+ * with free slots chained through next.  A Hash maps each key to its
+ * slot, so lookup, move to front, insert and eviction are all O(1).
+ *
+ * The Hash calls #hash and #eql? of the keys, which may switch
+ * threads, so every operation runs under one Mutex.  The size block
+ * is user code and is called before the lock is taken.
+ */
+typedef struct rb_xthread_lru_cache_node_struct
+{
+  VALUE key;
+  VALUE value;
+  long prev;
+  long next;
+  long size;
+  xthread_hrtime_t expires;	/* 0 for never */
+} xthread_lru_cache_node_t;
+
+typedef struct rb_xthread_lru_cache_struct
+{
+  VALUE index;
+  xthread_lru_cache_node_t *nodes;
+  long capa;
+  long used;
+  long free;
+  long head;
+  long tail;
+  long length;
+
+  long max_count;		/* 0 for no limit */
+  long max_bytes;		/* 0 for no limit */
+  long bytes;
+  VALUE sizer;
+  xthread_hrtime_t ttl;		/* 0 for none */
+
+  unsigned LONG_LONG hits;
+  unsigned LONG_LONG misses;
+  unsigned LONG_LONG evictions;
+  unsigned LONG_LONG expirations;
+
+  VALUE mutex;
+} xthread_lru_cache_t;
+
+#define LRU_CACHE_NONE (-1)
+#define LRU_CACHE_DEFAULT_CAPA 16
+
+#define GetXThreadLRUCachePtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_lru_cache_t, &xthread_lru_cache_data_type, (tobj))
+
+static void
+xthread_lru_cache_mark(void *ptr)
+{
+  xthread_lru_cache_t *cache = (xthread_lru_cache_t*)ptr;
+  long i;
+
+  for (i = 0; i < cache->used; i++) {
+    rb_gc_mark_movable(cache->nodes[i].key);
+    rb_gc_mark_movable(cache->nodes[i].value);
+  }
+  rb_gc_mark_movable(cache->index);
+  rb_gc_mark_movable(cache->sizer);
+  rb_gc_mark_movable(cache->mutex);
+}
+
+static void
+xthread_lru_cache_compact(void *ptr)
+{
+  xthread_lru_cache_t *cache = (xthread_lru_cache_t*)ptr;
+  long i;
+
+  for (i = 0; i < cache->used; i++) {
+    cache->nodes[i].key = rb_gc_location(cache->nodes[i].key);
+    cache->nodes[i].value = rb_gc_location(cache->nodes[i].value);
+  }
+  cache->index = rb_gc_location(cache->index);
+  cache->sizer = rb_gc_location(cache->sizer);
+  cache->mutex = rb_gc_location(cache->mutex);
+}
+
+static void
+xthread_lru_cache_free(void *ptr)
+{
+  xthread_lru_cache_t *cache = (xthread_lru_cache_t*)ptr;
+
+  if (cache->nodes) {
+    ruby_xfree(cache->nodes);
+  }
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_lru_cache_memsize(const void *ptr)
+{
+  xthread_lru_cache_t *cache = (xthread_lru_cache_t*)ptr;
+
+  return ptr ? sizeof(xthread_lru_cache_t) +
+    cache->capa * sizeof(xthread_lru_cache_node_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_lru_cache_data_type = {
+    "xthread_lru_cache",
+    {xthread_lru_cache_mark, xthread_lru_cache_free, xthread_lru_cache_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_lru_cache_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_lru_cache_data_type = {
+    "xthread_lru_cache",
+    xthread_lru_cache_mark,
+    xthread_lru_cache_free,
+    xthread_lru_cache_memsize,
+};
+#endif
+
+static VALUE
+xthread_lru_cache_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_lru_cache_t *cache;
+
+  obj = TypedData_Make_Struct(klass, xthread_lru_cache_t,
+			      &xthread_lru_cache_data_type, cache);
+  cache->nodes = NULL;
+  cache->capa = 0;
+  cache->used = 0;
+  cache->free = LRU_CACHE_NONE;
+  cache->head = LRU_CACHE_NONE;
+  cache->tail = LRU_CACHE_NONE;
+  cache->length = 0;
+  cache->max_count = 0;
+  cache->max_bytes = 0;
+  cache->bytes = 0;
+  cache->sizer = Qnil;
+  cache->ttl = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+  cache->expirations = 0;
+  RB_OBJ_WRITE(obj, &cache->index, rb_hash_new());
+  RB_OBJ_WRITE(obj, &cache->mutex, rb_mutex_new());
+  return obj;
+}
+
+static xthread_hrtime_t
+xthread_lru_cache_ttl(VALUE ttl)
+{
+  double sec;
+
+  if (NIL_P(ttl)) {
+    return 0;
+  }
+  sec = NUM2DBL(ttl);
+  if (sec <= 0) {
+    rb_raise(rb_eArgError, "ttl must be positive");
+  }
+  return (xthread_hrtime_t)(sec * XTHREAD_NSEC_PER_SEC);
+}
+
+static void
+xthread_lru_cache_setup(VALUE self, xthread_lru_cache_t *cache, long max_count, long max_bytes,
+			VALUE sizer, xthread_hrtime_t ttl)
+{
+  if (max_count < 0 || max_bytes < 0) {
+    rb_raise(rb_eArgError, "negative capacity");
+  }
+  if (max_count == 0 && max_bytes == 0) {
+    rb_raise(rb_eArgError, "no capacity given");
+  }
+  if (max_bytes > 0 && NIL_P(sizer)) {
+    rb_raise(rb_eArgError, "max_bytes needs a size block");
+  }
+  cache->max_count = max_count;
+  cache->max_bytes = max_bytes;
+  RB_OBJ_WRITE(self, &cache->sizer, sizer);
+  cache->ttl = ttl;
+}
+
+/*
+ *  call-seq:
+ *     LRUCache.new(max = nil, max_bytes: nil, ttl: nil) {|key, value| size }
+ *
+ *  Creates a cache holding at most +max+ entries and/or entries whose
+ *  sizes, as returned by the block, add up to at most +max_bytes+.
+ *  With +ttl+ (seconds) entries expire that long after they were put.
+ */
+static VALUE
+xthread_lru_cache_initialize(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[2];
+  xthread_lru_cache_t *cache;
+  VALUE max, opts;
+  VALUE kw[2] = {Qundef, Qundef};
+
+  GetXThreadLRUCachePtr(self, cache);
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("max_bytes");
+    keywords[1] = rb_intern("ttl");
+  }
+  rb_scan_args(argc, argv, "01:", &max, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 2, kw);
+  }
+  xthread_lru_cache_setup(self, cache,
+			  NIL_P(max) ? 0 : NUM2LONG(max),
+			  kw[0] == Qundef || NIL_P(kw[0]) ? 0 : NUM2LONG(kw[0]),
+			  rb_block_given_p() ? rb_block_proc() : Qnil,
+			  kw[1] == Qundef ? 0 : xthread_lru_cache_ttl(kw[1]));
+  return self;
+}
+
+VALUE
+rb_xthread_lru_cache_new(long max)
+{
+  VALUE self;
+  xthread_lru_cache_t *cache;
+
+  self = xthread_lru_cache_alloc(rb_cXThreadLRUCache);
+  GetXThreadLRUCachePtr(self, cache);
+  xthread_lru_cache_setup(self, cache, max, 0, Qnil, 0);
+  return self;
+}
+
+/* list and slot primitives; the caller holds the mutex */
+
+static void
+xthread_lru_cache_link_front(xthread_lru_cache_t *cache, long i)
+{
+  xthread_lru_cache_node_t *node = &cache->nodes[i];
+
+  node->prev = LRU_CACHE_NONE;
+  node->next = cache->head;
+  if (cache->head != LRU_CACHE_NONE) {
+    cache->nodes[cache->head].prev = i;
+  }
+  else {
+    cache->tail = i;
+  }
+  cache->head = i;
+}
+
+static void
+xthread_lru_cache_unlink(xthread_lru_cache_t *cache, long i)
+{
+  xthread_lru_cache_node_t *node = &cache->nodes[i];
+
+  if (node->prev != LRU_CACHE_NONE) {
+    cache->nodes[node->prev].next = node->next;
+  }
+  else {
+    cache->head = node->next;
+  }
+  if (node->next != LRU_CACHE_NONE) {
+    cache->nodes[node->next].prev = node->prev;
+  }
+  else {
+    cache->tail = node->prev;
+  }
+}
+
+static long
+xthread_lru_cache_slot_alloc(xthread_lru_cache_t *cache)
+{
+  long i;
+
+  if (cache->free != LRU_CACHE_NONE) {
+    i = cache->free;
+    cache->free = cache->nodes[i].next;
+    return i;
+  }
+  if (cache->used == cache->capa) {
+    long capa = cache->capa == 0 ? LRU_CACHE_DEFAULT_CAPA : cache->capa * 2;
+
+    REALLOC_N(cache->nodes, xthread_lru_cache_node_t, capa);
+    cache->capa = capa;
+  }
+  i = cache->used++;
+  cache->nodes[i].key = Qnil;
+  cache->nodes[i].value = Qnil;
+  return i;
+}
+
+/* unlinks and frees slot i, dropping it from the index */
+static void
+xthread_lru_cache_remove(xthread_lru_cache_t *cache, long i)
+{
+  xthread_lru_cache_node_t *node = &cache->nodes[i];
+
+  rb_hash_delete(cache->index, node->key);
+  xthread_lru_cache_unlink(cache, i);
+  cache->length--;
+  cache->bytes -= node->size;
+  node->key = Qnil;
+  node->value = Qnil;
+  node->next = cache->free;
+  cache->free = i;
+}
+
+static int
+xthread_lru_cache_expired_p(xthread_lru_cache_t *cache, long i)
+{
+  xthread_hrtime_t expires = cache->nodes[i].expires;
+
+  return expires != 0 && expires <= rb_xthread_hrtime();
+}
+
+/* slot of a live entry for key, or NONE; drops it if it has expired */
+static long
+xthread_lru_cache_lookup(xthread_lru_cache_t *cache, VALUE key)
+{
+  VALUE v;
+  long i;
+
+  v = rb_hash_lookup2(cache->index, key, Qundef);
+  if (v == Qundef) {
+    return LRU_CACHE_NONE;
+  }
+  i = FIX2LONG(v);
+  if (xthread_lru_cache_expired_p(cache, i)) {
+    xthread_lru_cache_remove(cache, i);
+    cache->expirations++;
+    return LRU_CACHE_NONE;
+  }
+  return i;
+}
+
+static void
+xthread_lru_cache_trim(xthread_lru_cache_t *cache)
+{
+  while (cache->tail != LRU_CACHE_NONE &&
+	 ((cache->max_count > 0 && cache->length > cache->max_count) ||
+	  (cache->max_bytes > 0 && cache->bytes > cache->max_bytes))) {
+    if (xthread_lru_cache_expired_p(cache, cache->tail)) {
+      cache->expirations++;
+    }
+    else {
+      cache->evictions++;
+    }
+    xthread_lru_cache_remove(cache, cache->tail);
+  }
+}
+
+struct xthread_lru_cache_arg {
+  VALUE self;
+  xthread_lru_cache_t *cache;
+  VALUE key;
+  VALUE value;
+  long size;
+  xthread_hrtime_t ttl;
+};
+
+static VALUE
+xthread_lru_cache_unlock(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+
+  rb_mutex_unlock(arg->cache->mutex);
+  return Qnil;
+}
+
+static VALUE
+xthread_lru_cache_locked(VALUE self, VALUE (*body)(VALUE), struct xthread_lru_cache_arg *arg)
+{
+  GetXThreadLRUCachePtr(self, arg->cache);
+  arg->self = self;
+
+  rb_mutex_lock(arg->cache->mutex);
+  return rb_ensure(body, (VALUE)arg, xthread_lru_cache_unlock, (VALUE)arg);
+}
+
+static VALUE
+xthread_lru_cache_get_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+  xthread_lru_cache_t *cache = arg->cache;
+  long i;
+
+  i = xthread_lru_cache_lookup(cache, arg->key);
+  if (i == LRU_CACHE_NONE) {
+    cache->misses++;
+    return Qundef;
+  }
+  cache->hits++;
+  if (cache->head != i) {
+    xthread_lru_cache_unlink(cache, i);
+    xthread_lru_cache_link_front(cache, i);
+  }
+  return cache->nodes[i].value;
+}
+
+/*
+ *  call-seq:
+ *     get(key) -> value or nil
+ *     [key] -> value or nil
+ *
+ *  The value for +key+, which becomes the most recently used entry.
+ */
+VALUE
+rb_xthread_lru_cache_get(VALUE self, VALUE key)
+{
+  struct xthread_lru_cache_arg arg;
+  VALUE value;
+
+  arg.key = key;
+  value = xthread_lru_cache_locked(self, xthread_lru_cache_get_body, &arg);
+  return value == Qundef ? Qnil : value;
+}
+
+static VALUE
+xthread_lru_cache_put_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+  xthread_lru_cache_t *cache = arg->cache;
+  xthread_lru_cache_node_t *node;
+  long i;
+
+  i = xthread_lru_cache_lookup(cache, arg->key);
+  if (i != LRU_CACHE_NONE) {
+    xthread_lru_cache_unlink(cache, i);
+    cache->bytes -= cache->nodes[i].size;
+  }
+  else {
+    i = xthread_lru_cache_slot_alloc(cache);
+    rb_hash_aset(cache->index, arg->key, LONG2FIX(i));
+    RB_OBJ_WRITE(arg->self, &cache->nodes[i].key, arg->key);
+    cache->length++;
+  }
+  node = &cache->nodes[i];
+  RB_OBJ_WRITE(arg->self, &node->value, arg->value);
+  node->size = arg->size;
+  node->expires = arg->ttl ? rb_xthread_hrtime() + arg->ttl : 0;
+  cache->bytes += arg->size;
+  xthread_lru_cache_link_front(cache, i);
+  xthread_lru_cache_trim(cache);
+  return Qnil;
+}
+
+static VALUE
+xthread_lru_cache_put_ttl(VALUE self, VALUE key, VALUE value, VALUE ttl)
+{
+  struct xthread_lru_cache_arg arg;
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  arg.key = key;
+  arg.value = value;
+  arg.size = 0;
+  if (!NIL_P(cache->sizer)) {
+    arg.size = NUM2LONG(rb_funcall(cache->sizer, id_call, 2, key, value));
+    if (arg.size < 0) {
+      rb_raise(rb_eArgError, "negative entry size");
+    }
+  }
+  arg.ttl = ttl == Qundef ? cache->ttl : xthread_lru_cache_ttl(ttl);
+
+  xthread_lru_cache_locked(self, xthread_lru_cache_put_body, &arg);
+  return value;
+}
+
+VALUE
+rb_xthread_lru_cache_put(VALUE self, VALUE key, VALUE value)
+{
+  return xthread_lru_cache_put_ttl(self, key, value, Qundef);
+}
+
+/*
+ *  call-seq:
+ *     put(key, value, ttl: nil) -> value
+ *     [key] = value
+ *
+ *  Stores +value+ as the most recently used entry, evicting the least
+ *  recently used ones while the cache is over its capacity.  +ttl+
+ *  overrides the cache's ttl for this entry.
+ */
+static VALUE
+xthread_lru_cache_put(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[1];
+  VALUE key, value, opts;
+  VALUE ttl = Qundef;
+
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("ttl");
+  }
+  rb_scan_args(argc, argv, "2:", &key, &value, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &ttl);
+  }
+  return xthread_lru_cache_put_ttl(self, key, value, ttl);
+}
+
+/*
+ *  call-seq:
+ *     fetch(key) {|key| value } -> value
+ *
+ *  The value for +key+; on a miss the block computes it and it is put.
+ *  The block runs outside the lock, so two threads missing the same
+ *  key may both compute it.
+ */
+static VALUE
+xthread_lru_cache_fetch(VALUE self, VALUE key)
+{
+  struct xthread_lru_cache_arg arg;
+  VALUE value;
+
+  arg.key = key;
+  value = xthread_lru_cache_locked(self, xthread_lru_cache_get_body, &arg);
+  if (value != Qundef) {
+    return value;
+  }
+  value = rb_yield(key);
+  return rb_xthread_lru_cache_put(self, key, value);
+}
+
+static VALUE
+xthread_lru_cache_delete_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+  xthread_lru_cache_t *cache = arg->cache;
+  VALUE value;
+  long i;
+
+  i = xthread_lru_cache_lookup(cache, arg->key);
+  if (i == LRU_CACHE_NONE) {
+    return Qnil;
+  }
+  value = cache->nodes[i].value;
+  xthread_lru_cache_remove(cache, i);
+  return value;
+}
+
+VALUE
+rb_xthread_lru_cache_delete(VALUE self, VALUE key)
+{
+  struct xthread_lru_cache_arg arg;
+
+  arg.key = key;
+  return xthread_lru_cache_locked(self, xthread_lru_cache_delete_body, &arg);
+}
+
+static VALUE
+xthread_lru_cache_key_p_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+
+  return xthread_lru_cache_lookup(arg->cache, arg->key) == LRU_CACHE_NONE ? Qfalse : Qtrue;
+}
+
+/*
+ *  call-seq:
+ *     key?(key) -> true or false
+ *
+ *  Whether +key+ has a live entry.  Neither its recency nor the
+ *  hit/miss counters change.
+ */
+VALUE
+rb_xthread_lru_cache_key_p(VALUE self, VALUE key)
+{
+  struct xthread_lru_cache_arg arg;
+
+  arg.key = key;
+  return xthread_lru_cache_locked(self, xthread_lru_cache_key_p_body, &arg);
+}
+
+static VALUE
+xthread_lru_cache_evict_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+  xthread_lru_cache_t *cache = arg->cache;
+  VALUE pair;
+  long i;
+
+  i = cache->tail;
+  if (i == LRU_CACHE_NONE) {
+    return Qnil;
+  }
+  pair = rb_assoc_new(cache->nodes[i].key, cache->nodes[i].value);
+  xthread_lru_cache_remove(cache, i);
+  cache->evictions++;
+  return pair;
+}
+
+/*
+ *  call-seq:
+ *     evict -> [key, value] or nil
+ *
+ *  Removes and returns the least recently used entry.
+ */
+VALUE
+rb_xthread_lru_cache_evict(VALUE self)
+{
+  struct xthread_lru_cache_arg arg;
+
+  return xthread_lru_cache_locked(self, xthread_lru_cache_evict_body, &arg);
+}
+
+static VALUE
+xthread_lru_cache_clear_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+  xthread_lru_cache_t *cache = arg->cache;
+  long i;
+
+  rb_hash_clear(cache->index);
+  for (i = 0; i < cache->used; i++) {
+    cache->nodes[i].key = Qnil;
+    cache->nodes[i].value = Qnil;
+  }
+  cache->used = 0;
+  cache->free = LRU_CACHE_NONE;
+  cache->head = LRU_CACHE_NONE;
+  cache->tail = LRU_CACHE_NONE;
+  cache->length = 0;
+  cache->bytes = 0;
+  return Qnil;
+}
+
+VALUE
+rb_xthread_lru_cache_clear(VALUE self)
+{
+  struct xthread_lru_cache_arg arg;
+
+  xthread_lru_cache_locked(self, xthread_lru_cache_clear_body, &arg);
+  return self;
+}
+
+static VALUE
+xthread_lru_cache_to_a_body(VALUE v_arg)
+{
+  struct xthread_lru_cache_arg *arg = (struct xthread_lru_cache_arg *)v_arg;
+  xthread_lru_cache_t *cache = arg->cache;
+  VALUE ary;
+  long i;
+
+  ary = rb_ary_new2(cache->length);
+  for (i = cache->head; i != LRU_CACHE_NONE; i = cache->nodes[i].next) {
+    if (!xthread_lru_cache_expired_p(cache, i)) {
+      rb_ary_push(ary, rb_assoc_new(cache->nodes[i].key, cache->nodes[i].value));
+    }
+  }
+  return ary;
+}
+
+/*
+ *  call-seq:
+ *     to_a -> [[key, value], ...]
+ *
+ *  The live entries from the most to the least recently used.
+ */
+VALUE
+rb_xthread_lru_cache_to_a(VALUE self)
+{
+  struct xthread_lru_cache_arg arg;
+
+  return xthread_lru_cache_locked(self, xthread_lru_cache_to_a_body, &arg);
+}
+
+/* yields a snapshot, so the block may use the cache */
+static VALUE
+xthread_lru_cache_each(VALUE self)
+{
+  VALUE ary;
+  long i;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  ary = rb_xthread_lru_cache_to_a(self);
+  for (i = 0; i < RARRAY_LEN(ary); i++) {
+    rb_yield(RARRAY_AREF(ary, i));
+  }
+  return self;
+}
+
+VALUE
+rb_xthread_lru_cache_length(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  return LONG2NUM(cache->length);
+}
+
+static VALUE
+xthread_lru_cache_bytesize(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  return LONG2NUM(cache->bytes);
+}
+
+static VALUE
+xthread_lru_cache_max(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  return cache->max_count ? LONG2NUM(cache->max_count) : Qnil;
+}
+
+static VALUE
+xthread_lru_cache_max_bytes(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  return cache->max_bytes ? LONG2NUM(cache->max_bytes) : Qnil;
+}
+
+/*
+ *  call-seq:
+ *     stats -> hash
+ *
+ *  Counters of hits, misses, evictions (entries pushed out by capacity
+ *  or evict) and expirations (entries found past their ttl).
+ */
+VALUE
+rb_xthread_lru_cache_stats(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+  VALUE h;
+
+  GetXThreadLRUCachePtr(self, cache);
+  h = rb_hash_new();
+  rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULL2NUM(cache->hits));
+  rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULL2NUM(cache->misses));
+  rb_hash_aset(h, ID2SYM(rb_intern("evictions")), ULL2NUM(cache->evictions));
+  rb_hash_aset(h, ID2SYM(rb_intern("expirations")), ULL2NUM(cache->expirations));
+  rb_hash_aset(h, ID2SYM(rb_intern("length")), LONG2NUM(cache->length));
+  rb_hash_aset(h, ID2SYM(rb_intern("bytes")), LONG2NUM(cache->bytes));
+  return h;
+}
+
+static VALUE
+xthread_lru_cache_reset_stats(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+  cache->expirations = 0;
+  return self;
+}
+
+static VALUE
+xthread_lru_cache_inspect(VALUE self)
+{
+  xthread_lru_cache_t *cache;
+
+  GetXThreadLRUCachePtr(self, cache);
+  return rb_sprintf("#<%"PRIsVALUE" length=%ld max=%ld max_bytes=%ld>",
+		    rb_obj_class(self), cache->length, cache->max_count, cache->max_bytes);
+}
+
+void
+Init_XThreadLRUCache()
+{
+  id_call = rb_intern("call");
+
+  rb_cXThreadLRUCache = rb_define_class_under(rb_mXThread, "LRUCache", rb_cObject);
+  rb_include_module(rb_cXThreadLRUCache, rb_mEnumerable);
+
+  rb_define_alloc_func(rb_cXThreadLRUCache, xthread_lru_cache_alloc);
+  rb_define_method(rb_cXThreadLRUCache, "initialize", xthread_lru_cache_initialize, -1);
+  rb_define_method(rb_cXThreadLRUCache, "get", rb_xthread_lru_cache_get, 1);
+  rb_define_alias(rb_cXThreadLRUCache,  "[]", "get");
+  rb_define_method(rb_cXThreadLRUCache, "put", xthread_lru_cache_put, -1);
+  rb_define_method(rb_cXThreadLRUCache, "[]=", rb_xthread_lru_cache_put, 2);
+  rb_define_method(rb_cXThreadLRUCache, "fetch", xthread_lru_cache_fetch, 1);
+  rb_define_method(rb_cXThreadLRUCache, "delete", rb_xthread_lru_cache_delete, 1);
+  rb_define_method(rb_cXThreadLRUCache, "key?", rb_xthread_lru_cache_key_p, 1);
+  rb_define_alias(rb_cXThreadLRUCache,  "include?", "key?");
+  rb_define_method(rb_cXThreadLRUCache, "evict", rb_xthread_lru_cache_evict, 0);
+  rb_define_method(rb_cXThreadLRUCache, "clear", rb_xthread_lru_cache_clear, 0);
+
+  rb_define_method(rb_cXThreadLRUCache, "each", xthread_lru_cache_each, 0);
+  rb_define_method(rb_cXThreadLRUCache, "to_a", rb_xthread_lru_cache_to_a, 0);
+  rb_define_method(rb_cXThreadLRUCache, "length", rb_xthread_lru_cache_length, 0);
+  rb_define_alias(rb_cXThreadLRUCache,  "size", "length");
+  rb_define_method(rb_cXThreadLRUCache, "bytesize", xthread_lru_cache_bytesize, 0);
+  rb_define_method(rb_cXThreadLRUCache, "max", xthread_lru_cache_max, 0);
+  rb_define_method(rb_cXThreadLRUCache, "max_bytes", xthread_lru_cache_max_bytes, 0);
+
+  rb_define_method(rb_cXThreadLRUCache, "stats", rb_xthread_lru_cache_stats, 0);
+  rb_define_method(rb_cXThreadLRUCache, "reset_stats", xthread_lru_cache_reset_stats, 0);
+  rb_define_method(rb_cXThreadLRUCache, "inspect", xthread_lru_cache_inspect, 0);
+}
@@ -0,0 +1,844 @@
+/**********************************************************************
+
+  map.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+VALUE rb_cXThreadMap;
+
+static ID id_hash;
+static ID id_eql;
+
+/*
+ * Map spreads its entries over a power of two of stripes by key hash;
+ * each stripe is a Hash with its own Mutex.  Reads go to the stripe's
+ * Hash without locking (MRI's Hash stays consistent when a thread
+ * switch lands in the middle of a lookup); writes take the stripe
+ * lock, except for Fixnum, Symbol and String keys: Hash operations on
+ * those never run Ruby code, so the GVL already makes them atomic.
+ *
+ * compute_if_absent, compute and merge run their block outside the
+ * stripe lock.  While one runs, the stripe's pending Hash maps the key
+ * to the computing thread; any other write of that key waits on the
+ * stripe's condition variable until the key is released, and retries.
+ */
+typedef struct rb_xthread_map_stripe_struct
+{
+  VALUE table;
+  VALUE mutex;
+  VALUE pending;
+  VALUE cond;
+  long num_waiting;
+} xthread_map_stripe_t;
+
+typedef struct rb_xthread_map_struct
+{
+  long nstripes;
+  xthread_map_stripe_t *stripes;
+} xthread_map_t;
+
+#define MAP_DEFAULT_STRIPES 16
+
+#define GetXThreadMapPtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_map_t, &xthread_map_data_type, (tobj))
+
+static void
+xthread_map_mark(void *ptr)
+{
+  xthread_map_t *map = (xthread_map_t*)ptr;
+  long i;
+
+  for (i = 0; i < map->nstripes; i++) {
+    rb_gc_mark_movable(map->stripes[i].table);
+    rb_gc_mark_movable(map->stripes[i].mutex);
+    rb_gc_mark_movable(map->stripes[i].pending);
+    rb_gc_mark_movable(map->stripes[i].cond);
+  }
+}
+
+static void
+xthread_map_compact(void *ptr)
+{
+  xthread_map_t *map = (xthread_map_t*)ptr;
+  long i;
+
+  for (i = 0; i < map->nstripes; i++) {
+    map->stripes[i].table = rb_gc_location(map->stripes[i].table);
+    map->stripes[i].mutex = rb_gc_location(map->stripes[i].mutex);
+    map->stripes[i].pending = rb_gc_location(map->stripes[i].pending);
+    map->stripes[i].cond = rb_gc_location(map->stripes[i].cond);
+  }
+}
+
+static void
+xthread_map_free(void *ptr)
+{
+  xthread_map_t *map = (xthread_map_t*)ptr;
+
+  if (map->stripes) {
+    ruby_xfree(map->stripes);
+  }
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_map_memsize(const void *ptr)
+{
+  xthread_map_t *map = (xthread_map_t*)ptr;
+
+  return ptr ? sizeof(xthread_map_t) + map->nstripes * sizeof(xthread_map_stripe_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_map_data_type = {
+    "xthread_map",
+    {xthread_map_mark, xthread_map_free, xthread_map_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_map_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_map_data_type = {
+    "xthread_map",
+    xthread_map_mark,
+    xthread_map_free,
+    xthread_map_memsize,
+};
+#endif
+
+static VALUE
+xthread_map_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_map_t *map;
+
+  obj = TypedData_Make_Struct(klass, xthread_map_t, &xthread_map_data_type, map);
+  map->nstripes = 0;
+  map->stripes = NULL;
+  return obj;
+}
+
+static void
+xthread_map_setup(VALUE self, xthread_map_t *map, long nstripes)
+{
+  long n, i;
+
+  if (nstripes <= 0) {
+    rb_raise(rb_eArgError, "number of stripes must be positive");
+  }
+  if (map->stripes) {
+    rb_raise(rb_eArgError, "already initialized");
+  }
+  for (n = 1; n < nstripes; n <<= 1);
+
+  map->stripes = ALLOC_N(xthread_map_stripe_t, n);
+  for (i = 0; i < n; i++) {
+    map->stripes[i].table = Qnil;
+    map->stripes[i].mutex = Qnil;
+    map->stripes[i].pending = Qnil;
+    map->stripes[i].cond = Qnil;
+    map->stripes[i].num_waiting = 0;
+  }
+  map->nstripes = n;
+  for (i = 0; i < n; i++) {
+    RB_OBJ_WRITE(self, &map->stripes[i].table, rb_hash_new());
+    RB_OBJ_WRITE(self, &map->stripes[i].mutex, rb_mutex_new());
+    RB_OBJ_WRITE(self, &map->stripes[i].pending, rb_hash_new());
+    RB_OBJ_WRITE(self, &map->stripes[i].cond, rb_xthread_cond_new());
+  }
+}
+
+/*
+ *  call-seq:
+ *     Map.new(stripes: 16)
+ *
+ *  Creates an empty map.  +stripes+ is rounded up to a power of two.
+ */
+static VALUE
+xthread_map_initialize(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[1];
+  xthread_map_t *map;
+  VALUE opts;
+  VALUE stripes = Qundef;
+
+  GetXThreadMapPtr(self, map);
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("stripes");
+  }
+  rb_scan_args(argc, argv, "0:", &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &stripes);
+  }
+  xthread_map_setup(self, map,
+		    stripes == Qundef || NIL_P(stripes) ? MAP_DEFAULT_STRIPES : NUM2LONG(stripes));
+  return self;
+}
+
+VALUE
+rb_xthread_map_new(long nstripes)
+{
+  VALUE self;
+  xthread_map_t *map;
+
+  self = xthread_map_alloc(rb_cXThreadMap);
+  GetXThreadMapPtr(self, map);
+  xthread_map_setup(self, map, nstripes > 0 ? nstripes : MAP_DEFAULT_STRIPES);
+  return self;
+}
+
+static xthread_map_stripe_t *
+xthread_map_stripe(xthread_map_t *map, VALUE key)
+{
+  unsigned long h;
+
+  if (map->stripes == NULL) {
+    rb_raise(rb_eArgError, "uninitialized map");
+  }
+  h = (unsigned long)NUM2LONG(rb_hash(key));
+  /* the low bits also pick the Hash bucket; mix in the high ones */
+  h ^= h >> 16;
+  h ^= h >> 7;
+  return &map->stripes[h & (map->nstripes - 1)];
+}
+
+/* whether Hash operations on key cannot switch threads */
+static int
+xthread_map_builtin_key_p(VALUE key)
+{
+  VALUE klass;
+
+  if (FIXNUM_P(key)) {
+    klass = rb_cInteger;
+  }
+  else if (STATIC_SYM_P(key)) {
+    klass = rb_cSymbol;
+  }
+  else if (!SPECIAL_CONST_P(key) && RBASIC_CLASS(key) == rb_cString) {
+    klass = rb_cString;
+  }
+  else {
+    return 0;
+  }
+  return rb_method_basic_definition_p(klass, id_hash) &&
+    rb_method_basic_definition_p(klass, id_eql);
+}
+
+VALUE
+rb_xthread_map_get(VALUE self, VALUE key)
+{
+  xthread_map_t *map;
+
+  GetXThreadMapPtr(self, map);
+  return rb_hash_lookup2(xthread_map_stripe(map, key)->table, key, Qnil);
+}
+
+VALUE
+rb_xthread_map_key_p(VALUE self, VALUE key)
+{
+  xthread_map_t *map;
+
+  GetXThreadMapPtr(self, map);
+  return rb_hash_lookup2(xthread_map_stripe(map, key)->table, key, Qundef) == Qundef ?
+    Qfalse : Qtrue;
+}
+
+/*
+ *  call-seq:
+ *     fetch(key) -> obj
+ *     fetch(key, default) -> obj
+ *     fetch(key) {|key| ... } -> obj
+ *
+ *  Like Hash#fetch; nothing is stored.
+ */
+static VALUE
+xthread_map_fetch(int argc, VALUE *argv, VALUE self)
+{
+  xthread_map_t *map;
+  VALUE key, default_value, value;
+
+  GetXThreadMapPtr(self, map);
+  rb_scan_args(argc, argv, "11", &key, &default_value);
+  value = rb_hash_lookup2(xthread_map_stripe(map, key)->table, key, Qundef);
+  if (value != Qundef) {
+    return value;
+  }
+  if (rb_block_given_p()) {
+    return rb_yield(key);
+  }
+  if (argc == 2) {
+    return default_value;
+  }
+  rb_raise(rb_eKeyError, "key not found: %"PRIsVALUE, rb_inspect(key));
+  return Qnil;
+}
+
+/* stripe-locked writes */
+
+enum xthread_map_op {
+  XTHREAD_MAP_PUT,
+  XTHREAD_MAP_PUT_IF_ABSENT,
+  XTHREAD_MAP_DELETE,
+  XTHREAD_MAP_CLAIM,		/* take the key */
+  XTHREAD_MAP_RELEASE,		/* store the result and release the key */
+};
+
+struct xthread_map_arg {
+  VALUE self;
+  xthread_map_stripe_t *stripe;
+  enum xthread_map_op op;
+  VALUE key;
+  VALUE value;			/* Qundef: delete (for RELEASE) */
+  VALUE owner;			/* thread computing the key */
+  VALUE result;
+  int builtin_key;
+};
+
+static VALUE
+xthread_map_write_body(VALUE v_arg)
+{
+  struct xthread_map_arg *arg = (struct xthread_map_arg *)v_arg;
+  xthread_map_stripe_t *stripe = arg->stripe;
+  VALUE old;
+
+  if (arg->op == XTHREAD_MAP_RELEASE) {
+    if (arg->value == Qundef) {
+      rb_hash_delete(stripe->table, arg->key);
+    }
+    else {
+      rb_hash_aset(stripe->table, arg->key, arg->value);
+    }
+    rb_hash_delete(stripe->pending, arg->key);
+    if (stripe->num_waiting > 0) {
+      rb_xthread_cond_broadcast(stripe->cond);
+    }
+    return Qtrue;
+  }
+
+  if (RHASH_SIZE(stripe->pending) > 0) {
+    arg->owner = rb_hash_lookup2(stripe->pending, arg->key, Qundef);
+    if (arg->owner != Qundef) {
+      /* being computed: the caller waits and retries */
+      return Qfalse;
+    }
+  }
+
+  old = rb_hash_lookup2(stripe->table, arg->key, Qundef);
+  switch (arg->op) {
+  case XTHREAD_MAP_PUT:
+    rb_hash_aset(stripe->table, arg->key, arg->value);
+    break;
+  case XTHREAD_MAP_PUT_IF_ABSENT:
+    if (old == Qundef) {
+      rb_hash_aset(stripe->table, arg->key, arg->value);
+    }
+    break;
+  case XTHREAD_MAP_DELETE:
+    if (old != Qundef) {
+      rb_hash_delete(stripe->table, arg->key);
+    }
+    break;
+  case XTHREAD_MAP_CLAIM:
+    rb_hash_aset(stripe->pending, arg->key, rb_thread_current());
+    break;
+  default:
+    break;
+  }
+  arg->result = old == Qundef && arg->op != XTHREAD_MAP_CLAIM ? Qnil : old;
+  return Qtrue;
+}
+
+static VALUE
+xthread_map_stripe_unlock(VALUE v_arg)
+{
+  struct xthread_map_arg *arg = (struct xthread_map_arg *)v_arg;
+
+  rb_mutex_unlock(arg->stripe->mutex);
+  return Qnil;
+}
+
+static VALUE
+xthread_map_wait_body(VALUE v_arg)
+{
+  struct xthread_map_arg *arg = (struct xthread_map_arg *)v_arg;
+  xthread_map_stripe_t *stripe = arg->stripe;
+
+  /* the key may have been released before we got the lock */
+  if (rb_hash_lookup2(stripe->pending, arg->key, Qundef) == Qundef) {
+    return Qnil;
+  }
+  stripe->num_waiting++;
+  arg->result = Qtrue;
+  rb_xthread_cond_wait(stripe->cond, stripe->mutex, Qnil);
+  return Qnil;
+}
+
+static VALUE
+xthread_map_wait_leave(VALUE v_arg)
+{
+  struct xthread_map_arg *arg = (struct xthread_map_arg *)v_arg;
+
+  if (arg->result == Qtrue) {
+    arg->stripe->num_waiting--;
+  }
+  return xthread_map_stripe_unlock(v_arg);
+}
+
+/* returns the old value (nil if none) */
+static VALUE
+xthread_map_write(VALUE self, enum xthread_map_op op, VALUE key, VALUE value,
+		  struct xthread_map_arg *arg)
+{
+  xthread_map_t *map;
+
+  GetXThreadMapPtr(self, map);
+  arg->self = self;
+  arg->stripe = xthread_map_stripe(map, key);
+  arg->op = op;
+  arg->key = key;
+  arg->value = value;
+  arg->result = Qnil;
+  arg->builtin_key = xthread_map_builtin_key_p(key);
+
+  for (;;) {
+    if (arg->builtin_key) {
+      if (RTEST(xthread_map_write_body((VALUE)arg))) {
+	return arg->result;
+      }
+    }
+    else {
+      rb_mutex_lock(arg->stripe->mutex);
+      if (RTEST(rb_ensure(xthread_map_write_body, (VALUE)arg,
+			  xthread_map_stripe_unlock, (VALUE)arg))) {
+	return arg->result;
+      }
+    }
+    if (arg->owner == rb_thread_current()) {
+      rb_raise(rb_eThreadError, "key written from its own compute block");
+    }
+    arg->result = Qfalse;
+    rb_mutex_lock(arg->stripe->mutex);
+    rb_ensure(xthread_map_wait_body, (VALUE)arg, xthread_map_wait_leave, (VALUE)arg);
+    arg->result = Qnil;
+  }
+}
+
+/*
+ *  call-seq:
+ *     put(key, value) -> value
+ *     [key] = value
+ */
+VALUE
+rb_xthread_map_put(VALUE self, VALUE key, VALUE value)
+{
+  struct xthread_map_arg arg;
+
+  xthread_map_write(self, XTHREAD_MAP_PUT, key, value, &arg);
+  return value;
+}
+
+/*
+ *  call-seq:
+ *     put_if_absent(key, value) -> old value or nil
+ *
+ *  Stores +value+ unless +key+ is present, and returns what was there.
+ */
+VALUE
+rb_xthread_map_put_if_absent(VALUE self, VALUE key, VALUE value)
+{
+  struct xthread_map_arg arg;
+
+  return xthread_map_write(self, XTHREAD_MAP_PUT_IF_ABSENT, key, value, &arg);
+}
+
+VALUE
+rb_xthread_map_delete(VALUE self, VALUE key)
+{
+  struct xthread_map_arg arg;
+
+  return xthread_map_write(self, XTHREAD_MAP_DELETE, key, Qnil, &arg);
+}
+
+/* key-locked computations */
+
+enum xthread_map_compute_mode {
+  XTHREAD_MAP_IF_ABSENT,
+  XTHREAD_MAP_COMPUTE,
+  XTHREAD_MAP_MERGE,
+};
+
+struct xthread_map_compute_arg {
+  struct xthread_map_arg write;
+  enum xthread_map_compute_mode mode;
+  VALUE (*func)(VALUE, VALUE, VALUE);
+  VALUE farg;
+  VALUE old;
+  VALUE value;
+  VALUE result;			/* Qundef: absent */
+};
+
+static VALUE
+xthread_map_compute_body(VALUE v_arg)
+{
+  struct xthread_map_compute_arg *arg = (struct xthread_map_compute_arg *)v_arg;
+  VALUE key = arg->write.key;
+  VALUE result;
+
+  switch (arg->mode) {
+  case XTHREAD_MAP_IF_ABSENT:
+    if (arg->old != Qundef) {
+      /* put there while we waited for the key */
+      return Qnil;
+    }
+    result = arg->func(key, Qnil, arg->farg);
+    break;
+  case XTHREAD_MAP_MERGE:
+    if (arg->old == Qundef) {
+      result = arg->value;
+      break;
+    }
+    /* fall through */
+  default:
+    result = arg->func(key, arg->old == Qundef ? Qnil : arg->old, arg->farg);
+    break;
+  }
+  arg->result = NIL_P(result) ? Qundef : result;
+  return Qnil;
+}
+
+static VALUE
+xthread_map_compute_leave(VALUE v_arg)
+{
+  struct xthread_map_compute_arg *arg = (struct xthread_map_compute_arg *)v_arg;
+  struct xthread_map_arg *w = &arg->write;
+
+  /* arg->result is still the old value if the block raised */
+  w->op = XTHREAD_MAP_RELEASE;
+  w->value = arg->result;
+  if (w->builtin_key) {
+    xthread_map_write_body((VALUE)w);
+  }
+  else {
+    rb_mutex_lock(w->stripe->mutex);
+    rb_ensure(xthread_map_write_body, (VALUE)w, xthread_map_stripe_unlock, (VALUE)w);
+  }
+  return Qnil;
+}
+
+/*
+ * runs func(key, old value or nil, farg) holding the key lock and
+ * stores its result; nil removes the key.
+ */
+static VALUE
+xthread_map_compute0(VALUE self, VALUE key, enum xthread_map_compute_mode mode, VALUE value,
+		     VALUE (*func)(VALUE, VALUE, VALUE), VALUE farg)
+{
+  struct xthread_map_compute_arg arg;
+
+  xthread_map_write(self, XTHREAD_MAP_CLAIM, key, Qnil, &arg.write);
+  arg.mode = mode;
+  arg.func = func;
+  arg.farg = farg;
+  arg.value = value;
+  arg.old = arg.write.result;
+  arg.result = arg.old;
+  rb_ensure(xthread_map_compute_body, (VALUE)&arg, xthread_map_compute_leave, (VALUE)&arg);
+  return arg.result == Qundef ? Qnil : arg.result;
+}
+
+VALUE
+rb_xthread_map_compute_if_absent(VALUE self, VALUE key,
+				 VALUE (*func)(VALUE, VALUE, VALUE), VALUE farg)
+{
+  xthread_map_t *map;
+  VALUE value;
+
+  GetXThreadMapPtr(self, map);
+  value = rb_hash_lookup2(xthread_map_stripe(map, key)->table, key, Qundef);
+  if (value != Qundef) {
+    return value;
+  }
+  return xthread_map_compute0(self, key, XTHREAD_MAP_IF_ABSENT, Qnil, func, farg);
+}
+
+VALUE
+rb_xthread_map_compute(VALUE self, VALUE key, VALUE (*func)(VALUE, VALUE, VALUE), VALUE farg)
+{
+  return xthread_map_compute0(self, key, XTHREAD_MAP_COMPUTE, Qnil, func, farg);
+}
+
+VALUE
+rb_xthread_map_merge(VALUE self, VALUE key, VALUE value,
+		     VALUE (*func)(VALUE, VALUE, VALUE), VALUE farg)
+{
+  return xthread_map_compute0(self, key, XTHREAD_MAP_MERGE, value, func, farg);
+}
+
+static VALUE
+xthread_map_yield_key(VALUE key, VALUE old, VALUE farg)
+{
+  return rb_yield(key);
+}
+
+static VALUE
+xthread_map_yield_old(VALUE key, VALUE old, VALUE farg)
+{
+  return rb_yield(old);
+}
+
+static VALUE
+xthread_map_yield_merge(VALUE key, VALUE old, VALUE value)
+{
+  return rb_yield_values(2, old, value);
+}
+
+/*
+ *  call-seq:
+ *     compute_if_absent(key) {|key| ... } -> obj
+ *
+ *  The value for +key+; if there is none the block computes it and it
+ *  is stored, unless it is nil.  Other threads wanting the same key
+ *  wait for the block instead of running it again.
+ */
+static VALUE
+xthread_map_compute_if_absent(VALUE self, VALUE key)
+{
+  rb_need_block();
+  return rb_xthread_map_compute_if_absent(self, key, xthread_map_yield_key, Qnil);
+}
+
+/*
+ *  call-seq:
+ *     compute(key) {|old_value| ... } -> obj
+ *
+ *  Replaces the value for +key+ (nil when absent) with the block's
+ *  result atomically; a nil result removes the key.
+ */
+static VALUE
+xthread_map_compute(VALUE self, VALUE key)
+{
+  rb_need_block();
+  return rb_xthread_map_compute(self, key, xthread_map_yield_old, Qnil);
+}
+
+/*
+ *  call-seq:
+ *     merge(key, value) {|old_value, value| ... } -> obj
+ *
+ *  Stores +value+ if +key+ is absent, otherwise the block's result; a
+ *  nil result removes the key.
+ */
+static VALUE
+xthread_map_merge(VALUE self, VALUE key, VALUE value)
+{
+  rb_need_block();
+  return rb_xthread_map_merge(self, key, value, xthread_map_yield_merge, value);
+}
+
+/* whole map */
+
+VALUE
+rb_xthread_map_size(VALUE self)
+{
+  xthread_map_t *map;
+  long i, n = 0;
+
+  GetXThreadMapPtr(self, map);
+  for (i = 0; i < map->nstripes; i++) {
+    n += RHASH_SIZE(map->stripes[i].table);
+  }
+  return LONG2NUM(n);
+}
+
+static VALUE
+xthread_map_empty_p(VALUE self)
+{
+  xthread_map_t *map;
+  long i;
+
+  GetXThreadMapPtr(self, map);
+  for (i = 0; i < map->nstripes; i++) {
+    if (RHASH_SIZE(map->stripes[i].table) > 0) {
+      return Qfalse;
+    }
+  }
+  return Qtrue;
+}
+
+static VALUE
+xthread_map_clear_body(VALUE v_arg)
+{
+  struct xthread_map_arg *arg = (struct xthread_map_arg *)v_arg;
+
+  rb_hash_clear(arg->stripe->table);
+  return Qnil;
+}
+
+/* keys under compute keep their result */
+VALUE
+rb_xthread_map_clear(VALUE self)
+{
+  xthread_map_t *map;
+  struct xthread_map_arg arg;
+  long i;
+
+  GetXThreadMapPtr(self, map);
+  for (i = 0; i < map->nstripes; i++) {
+    arg.stripe = &map->stripes[i];
+    rb_mutex_lock(arg.stripe->mutex);
+    rb_ensure(xthread_map_clear_body, (VALUE)&arg, xthread_map_stripe_unlock, (VALUE)&arg);
+  }
+  return self;
+}
+
+static int
+xthread_map_each_i(VALUE key, VALUE value, VALUE arg)
+{
+  rb_yield(rb_assoc_new(key, value));
+  return ST_CONTINUE;
+}
+
+/*
+ *  call-seq:
+ *     each {|key, value| ... }
+ *
+ *  Iterates stripe by stripe over a copy of each stripe, so the block
+ *  may write the map; writes to stripes not reached yet are seen.
+ */
+VALUE
+rb_xthread_map_each(VALUE self)
+{
+  xthread_map_t *map;
+  long i;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  GetXThreadMapPtr(self, map);
+  for (i = 0; i < map->nstripes; i++) {
+    if (RHASH_SIZE(map->stripes[i].table) > 0) {
+      rb_hash_foreach(rb_hash_dup(map->stripes[i].table), xthread_map_each_i, Qnil);
+    }
+  }
+  return self;
+}
+
+static int
+xthread_map_to_h_i(VALUE key, VALUE value, VALUE h)
+{
+  rb_hash_aset(h, key, value);
+  return ST_CONTINUE;
+}
+
+VALUE
+rb_xthread_map_to_h(VALUE self)
+{
+  xthread_map_t *map;
+  VALUE h;
+  long i;
+
+  GetXThreadMapPtr(self, map);
+  h = rb_hash_new();
+  for (i = 0; i < map->nstripes; i++) {
+    rb_hash_foreach(map->stripes[i].table, xthread_map_to_h_i, h);
+  }
+  return h;
+}
+
+static VALUE
+xthread_map_keys(VALUE self)
+{
+  xthread_map_t *map;
+  VALUE ary;
+  long i;
+
+  GetXThreadMapPtr(self, map);
+  ary = rb_ary_new();
+  for (i = 0; i < map->nstripes; i++) {
+    rb_ary_concat(ary, rb_funcall(map->stripes[i].table, rb_intern("keys"), 0));
+  }
+  return ary;
+}
+
+static VALUE
+xthread_map_values(VALUE self)
+{
+  xthread_map_t *map;
+  VALUE ary;
+  long i;
+
+  GetXThreadMapPtr(self, map);
+  ary = rb_ary_new();
+  for (i = 0; i < map->nstripes; i++) {
+    rb_ary_concat(ary, rb_funcall(map->stripes[i].table, rb_intern("values"), 0));
+  }
+  return ary;
+}
+
+static VALUE
+xthread_map_stripes(VALUE self)
+{
+  xthread_map_t *map;
+
+  GetXThreadMapPtr(self, map);
+  return LONG2NUM(map->nstripes);
+}
+
+static VALUE
+xthread_map_inspect(VALUE self)
+{
+  VALUE str;
+
+  str = rb_sprintf("<%s ", rb_obj_classname(self));
+  rb_str_append(str, rb_inspect(rb_xthread_map_to_h(self)));
+  rb_str_cat2(str, ">");
+  return str;
+}
+
+void
+Init_XThreadMap()
+{
+  id_hash = rb_intern("hash");
+  id_eql = rb_intern("eql?");
+
+  rb_cXThreadMap = rb_define_class_under(rb_mXThread, "Map", rb_cObject);
+  rb_include_module(rb_cXThreadMap, rb_mEnumerable);
+
+  rb_define_alloc_func(rb_cXThreadMap, xthread_map_alloc);
+  rb_define_method(rb_cXThreadMap, "initialize", xthread_map_initialize, -1);
+  rb_define_method(rb_cXThreadMap, "[]", rb_xthread_map_get, 1);
+  rb_define_alias(rb_cXThreadMap,  "get", "[]");
+  rb_define_method(rb_cXThreadMap, "fetch", xthread_map_fetch, -1);
+  rb_define_method(rb_cXThreadMap, "key?", rb_xthread_map_key_p, 1);
+  rb_define_alias(rb_cXThreadMap,  "include?", "key?");
+  rb_define_method(rb_cXThreadMap, "[]=", rb_xthread_map_put, 2);
+  rb_define_alias(rb_cXThreadMap,  "put", "[]=");
+  rb_define_method(rb_cXThreadMap, "put_if_absent", rb_xthread_map_put_if_absent, 2);
+  rb_define_method(rb_cXThreadMap, "delete", rb_xthread_map_delete, 1);
+  rb_define_method(rb_cXThreadMap, "compute_if_absent", xthread_map_compute_if_absent, 1);
+  rb_define_method(rb_cXThreadMap, "compute", xthread_map_compute, 1);
+  rb_define_method(rb_cXThreadMap, "merge", xthread_map_merge, 2);
+
+  rb_define_method(rb_cXThreadMap, "size", rb_xthread_map_size, 0);
+  rb_define_alias(rb_cXThreadMap,  "length", "size");
+  rb_define_method(rb_cXThreadMap, "empty?", xthread_map_empty_p, 0);
+  rb_define_method(rb_cXThreadMap, "clear", rb_xthread_map_clear, 0);
+  rb_define_method(rb_cXThreadMap, "each", rb_xthread_map_each, 0);
+  rb_define_alias(rb_cXThreadMap,  "each_pair", "each");
+  rb_define_method(rb_cXThreadMap, "keys", xthread_map_keys, 0);
+  rb_define_method(rb_cXThreadMap, "values", xthread_map_values, 0);
+  rb_define_method(rb_cXThreadMap, "to_h", rb_xthread_map_to_h, 0);
+  rb_define_method(rb_cXThreadMap, "stripes", xthread_map_stripes, 0);
+  rb_define_method(rb_cXThreadMap, "inspect", xthread_map_inspect, 0);
+}
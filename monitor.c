@@ -10,15 +10,21 @@
 #include "ruby.h"
 
 #include "xthread.h"
+#include "xthread-internal.h"
+#include "probes.h"
 
 VALUE rb_cXThreadMonitor;
 VALUE rb_cXThreadMonitorCond;
+VALUE rb_mXThreadMonitorMixin;
+
+static ID id_mon;
 
 typedef struct rb_xthread_monitor_struct
 {
   VALUE owner;
   long count;
-  VALUE mutex;
+  int fair;
+  xthread_fifo_t waiters;
 } xthread_monitor_t;
 
 #define GetXThreadMonitorPtr(obj, tobj) \
@@ -40,26 +46,47 @@ xthread_monitor_mark(void *ptr)
 {
   xthread_monitor_t *mon = (xthread_monitor_t*)ptr;
   
-  rb_gc_mark(mon->owner);
-  rb_gc_mark(mon->mutex);
+  rb_gc_mark_movable(mon->owner);
+  xthread_fifo_ring_mark(&mon->waiters);
+}
+
+static void
+xthread_monitor_compact(void *ptr)
+{
+  xthread_monitor_t *mon = (xthread_monitor_t*)ptr;
+  
+  mon->owner = rb_gc_location(mon->owner);
+  xthread_fifo_ring_compact(&mon->waiters);
 }
 
 static void
 xthread_monitor_free(void *ptr)
 {
+  xthread_monitor_t *mon = (xthread_monitor_t*)ptr;
+
+  xthread_fifo_ring_free(&mon->waiters);
   ruby_xfree(ptr);
 }
 
 static size_t
 xthread_monitor_memsize(const void *ptr)
 {
-  return ptr ? sizeof(xthread_monitor_t) : 0;
+  xthread_monitor_t *mon = (xthread_monitor_t*)ptr;
+
+  return ptr ? sizeof(xthread_monitor_t) + mon->waiters.capa * sizeof(VALUE) : 0;
 }
 
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xthread_monitor_data_type = {
     "xthread_monitor",
-    {xthread_monitor_mark, xthread_monitor_free, xthread_monitor_memsize,},
+    {xthread_monitor_mark, xthread_monitor_free, xthread_monitor_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_monitor_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 #else
 static const rb_data_type_t xthread_monitor_data_type = {
@@ -79,15 +106,44 @@ xthread_monitor_alloc(VALUE klass)
   obj = TypedData_Make_Struct(klass, xthread_monitor_t, &xthread_monitor_data_type, mon);
   mon->owner = Qnil;
   mon->count = 0;
-  mon->mutex = rb_mutex_new();
+  mon->fair = 0;
+  xthread_fifo_ring_init(&mon->waiters);
 
   return obj;
 }
 
+static int
+xthread_monitor_policy_fair_p(VALUE policy)
+{
+  if (NIL_P(policy) || policy == ID2SYM(rb_intern("throughput"))) {
+    return 0;
+  }
+  if (policy == ID2SYM(rb_intern("fair"))) {
+    return 1;
+  }
+  rb_raise(rb_eArgError, "unknown monitor policy: %"PRIsVALUE, rb_inspect(policy));
+  return 0;
+}
+
+/*
+ *  call-seq:
+ *     Monitor.new(policy = :throughput)
+ *
+ *  With :throughput, a released monitor goes to whichever thread takes
+ *  it first, so a running thread may barge ahead of waiting ones.  With
+ *  :fair, exit hands the monitor directly to the longest waiting
+ *  thread.
+ */
 static VALUE
-xthread_monitor_initialize(VALUE self)
+xthread_monitor_initialize(int argc, VALUE *argv, VALUE self)
 {
-    return self;
+  xthread_monitor_t *mon;
+  VALUE policy;
+
+  GetXThreadMonitorPtr(self, mon);
+  rb_scan_args(argc, argv, "01", &policy);
+  mon->fair = xthread_monitor_policy_fair_p(policy);
+  return self;
 }
 
 VALUE
@@ -96,6 +152,25 @@ rb_xthread_monitor_new(void)
   return xthread_monitor_alloc(rb_cXThreadMonitor);
 }
 
+VALUE
+rb_xthread_monitor_policy(VALUE self)
+{
+  xthread_monitor_t *mon;
+
+  GetXThreadMonitorPtr(self, mon);
+  return ID2SYM(rb_intern(mon->fair ? "fair" : "throughput"));
+}
+
+VALUE
+rb_xthread_monitor_set_policy(VALUE self, VALUE policy)
+{
+  xthread_monitor_t *mon;
+
+  GetXThreadMonitorPtr(self, mon);
+  mon->fair = xthread_monitor_policy_fair_p(policy);
+  return policy;
+}
+
 
 /*
 static VALUE
@@ -128,6 +203,110 @@ rb_xthread_monitor_valid_owner_p(VALUE self)
   }
 }
 
+/*
+ * the lock itself.  Threads that find the monitor taken wait in
+ * mon->waiters (under the GVL, like the queues).  On release a fair
+ * monitor makes the first live waiter the owner before waking it; a
+ * throughput monitor just drops ownership and wakes one waiter, which
+ * competes with every other thread for it.
+ */
+static void
+xthread_monitor_release(VALUE self, xthread_monitor_t *mon)
+{
+  VALUE th;
+
+  XTHREAD_PROBE_MONITOR_EXIT(self, XTHREAD_FIFO_RING_LENGTH(&mon->waiters));
+  if (mon->fair) {
+    while ((th = xthread_fifo_ring_pop(&mon->waiters)) != Qnil) {
+      if (rb_thread_wakeup_alive(th) != Qnil) {
+	RB_OBJ_WRITE(self, &mon->owner, th);
+	return;
+      }
+    }
+    mon->owner = Qnil;
+  }
+  else {
+    mon->owner = Qnil;
+    xthread_waiters_signal(&mon->waiters);
+  }
+}
+
+struct xthread_monitor_lock_arg {
+  VALUE self;
+  xthread_monitor_t *mon;
+  VALUE th;
+  int locked;
+  xthread_hrtime_t start;
+};
+
+static VALUE
+xthread_monitor_lock_wait(VALUE v_arg)
+{
+  struct xthread_monitor_lock_arg *arg = (struct xthread_monitor_lock_arg *)v_arg;
+  xthread_monitor_t *mon = arg->mon;
+
+  while (mon->owner != arg->th) {
+    /* a free monitor is taken in either policy: the waiter may have
+       been woken by a throughput exit before policy= made it fair */
+    if (NIL_P(mon->owner)) {
+      RB_OBJ_WRITE(arg->self, &mon->owner, arg->th);
+      break;
+    }
+    xthread_waiters_wait(arg->self, &mon->waiters);
+  }
+  arg->locked = 1;
+  XTHREAD_PROBE_MONITOR_ACQUIRED(arg->self, XTHREAD_PROBE_HRTIME() - arg->start);
+  return Qnil;
+}
+
+static VALUE
+xthread_monitor_lock_leave(VALUE v_arg)
+{
+  struct xthread_monitor_lock_arg *arg = (struct xthread_monitor_lock_arg *)v_arg;
+
+  if (!arg->locked && arg->mon->owner == arg->th) {
+    /* handed the monitor, but interrupted before taking it */
+    xthread_monitor_release(arg->self, arg->mon);
+  }
+  return Qnil;
+}
+
+static void
+xthread_monitor_lock(VALUE self, xthread_monitor_t *mon, VALUE th)
+{
+  struct xthread_monitor_lock_arg arg;
+
+  if (NIL_P(mon->owner) &&
+      (!mon->fair || XTHREAD_FIFO_RING_EMPTY_P(&mon->waiters))) {
+    RB_OBJ_WRITE(self, &mon->owner, th);
+    return;
+  }
+  arg.self = self;
+  arg.mon = mon;
+  arg.th = th;
+  arg.locked = 0;
+  XTHREAD_PROBE_MONITOR_CONTENDED(self, XTHREAD_FIFO_RING_LENGTH(&mon->waiters));
+  arg.start = XTHREAD_PROBE_HRTIME();
+  rb_ensure(xthread_monitor_lock_wait, (VALUE)&arg,
+	    xthread_monitor_lock_leave, (VALUE)&arg);
+}
+
+VALUE
+rb_xthread_monitor_locked_p(VALUE self)
+{
+  xthread_monitor_t *mon;
+
+  GetXThreadMonitorPtr(self, mon);
+  return NIL_P(mon->owner) ? Qfalse : Qtrue;
+}
+
+static VALUE
+xthread_monitor_check_owner(VALUE self)
+{
+  XTHREAD_MONITOR_CHECK_OWNER(self);
+  return Qnil;
+}
+
 VALUE
 rb_xthread_monitor_try_enter(VALUE self)
 {
@@ -137,10 +316,11 @@ rb_xthread_monitor_try_enter(VALUE self)
   GetXThreadMonitorPtr(self, mon);
 
   if (mon->owner != th) {
-    if (rb_mutex_trylock(mon->mutex) == Qfalse) {
+    if (!NIL_P(mon->owner) ||
+	(mon->fair && !XTHREAD_FIFO_RING_EMPTY_P(&mon->waiters))) {
       return Qfalse;
     }
-    mon->owner = th;
+    RB_OBJ_WRITE(self, &mon->owner, th);
   }
   mon->count++;
   return Qtrue;
@@ -154,26 +334,25 @@ rb_xthread_monitor_enter(VALUE self)
 
   GetXThreadMonitorPtr(self, mon);
   if (mon->owner != th) {
-    rb_mutex_lock(mon->mutex);
-    mon->owner = th;
+    xthread_monitor_lock(self, mon, th);
   }
   mon->count += 1;
+  return Qnil;
 }
 
 VALUE
 rb_xthread_monitor_exit(VALUE self)
 {
   xthread_monitor_t *mon;
-  VALUE th = rb_thread_current();
   
   GetXThreadMonitorPtr(self, mon);
 
   XTHREAD_MONITOR_CHECK_OWNER(self);
   mon->count--;
   if(mon->count == 0) {
-    mon->owner = Qnil;
-    rb_mutex_unlock(mon->mutex);
+    xthread_monitor_release(self, mon);
   }
+  return Qnil;
 }
 
 VALUE
@@ -192,7 +371,7 @@ xthread_monitor_synchronize(VALUE self)
 VALUE
 rb_xthread_monitor_new_cond(VALUE self)
 {
-  rb_xthread_monitor_cond_new(self);
+  return rb_xthread_monitor_cond_new(self);
 }
 
 VALUE
@@ -203,8 +382,9 @@ rb_xthread_monitor_enter_for_cond(VALUE self, long count)
   
   GetXThreadMonitorPtr(self, mon);
 
-  mon->owner = th;
+  xthread_monitor_lock(self, mon, th);
   mon->count = count;
+  return Qnil;
 }
 
 long
@@ -216,16 +396,15 @@ rb_xthread_monitor_exit_for_cond(VALUE self)
   GetXThreadMonitorPtr(self, mon);
 
   count = mon->count;
-  mon->owner = Qnil;
   mon->count = 0;
+  xthread_monitor_release(self, mon);
   return count;
 }
 
 typedef struct rb_xthread_monitor_cond_struct
 {
   VALUE monitor;
-  VALUE cond;
-
+  xthread_fifo_t waiters;
 } xthread_monitor_cond_t;
 
 #define GetXThreadMonitorCondPtr(obj, tobj) \
@@ -236,26 +415,47 @@ xthread_monitor_cond_mark(void *ptr)
 {
   xthread_monitor_cond_t *cv = (xthread_monitor_cond_t*)ptr;
   
-  rb_gc_mark(cv->monitor);
-  rb_gc_mark(cv->cond);
+  rb_gc_mark_movable(cv->monitor);
+  xthread_fifo_ring_mark(&cv->waiters);
+}
+
+static void
+xthread_monitor_cond_compact(void *ptr)
+{
+  xthread_monitor_cond_t *cv = (xthread_monitor_cond_t*)ptr;
+  
+  cv->monitor = rb_gc_location(cv->monitor);
+  xthread_fifo_ring_compact(&cv->waiters);
 }
 
 static void
 xthread_monitor_cond_free(void *ptr)
 {
-    ruby_xfree(ptr);
+  xthread_monitor_cond_t *cv = (xthread_monitor_cond_t*)ptr;
+
+  xthread_fifo_ring_free(&cv->waiters);
+  ruby_xfree(ptr);
 }
 
 static size_t
 xthread_monitor_cond_memsize(const void *ptr)
 {
-    return ptr ? sizeof(xthread_monitor_cond_t) : 0;
+  xthread_monitor_cond_t *cv = (xthread_monitor_cond_t*)ptr;
+
+  return ptr ? sizeof(xthread_monitor_cond_t) + cv->waiters.capa * sizeof(VALUE) : 0;
 }
 
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xthread_monitor_cond_data_type = {
     "xthread_monitor_cond",
-    {xthread_monitor_cond_mark, xthread_monitor_cond_free, xthread_monitor_cond_memsize,},
+    {xthread_monitor_cond_mark, xthread_monitor_cond_free, xthread_monitor_cond_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_monitor_cond_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 #else
 static const rb_data_type_t xthread_monitor_cond_data_type = {
@@ -276,7 +476,7 @@ xthread_monitor_cond_alloc(VALUE klass)
 			      xthread_monitor_cond_t, &xthread_monitor_cond_data_type, cv);
   
   cv->monitor = Qnil;
-  cv->cond = rb_xthread_cond_new();
+  xthread_fifo_ring_init(&cv->waiters);
   return obj;
 }
 
@@ -286,7 +486,7 @@ xthread_monitor_cond_initialize(VALUE self, VALUE mon)
   xthread_monitor_cond_t *cv;
   GetXThreadMonitorCondPtr(self, cv);
 
-  cv->monitor = mon;
+  RB_OBJ_WRITE(self, &cv->monitor, mon);
   return self;
 }
 
@@ -300,28 +500,39 @@ rb_xthread_monitor_cond_new(VALUE mon)
   return self;
 }
 
+/*
+ * a waiter sits in cv->waiters while it has released the monitor and
+ * takes the monitor again, with its count, on the way out.
+ */
 struct xthread_monitor_cond_wait_arg {
-  VALUE cond;
-  VALUE monitor;
+  xthread_monitor_cond_t *cv;
+  VALUE th;
   VALUE timeout;
   long count;
 };
 
 static VALUE
-rb_xthread_monitor_cond_wait_cond(struct xthread_monitor_cond_wait_arg *arg)
+xthread_monitor_cond_sleep(VALUE v_arg)
 {
-  xthread_monitor_t *mon;
-  VALUE v_mon = arg->monitor;
-  GetXThreadMonitorPtr(v_mon, mon);
+  struct xthread_monitor_cond_wait_arg *arg = (struct xthread_monitor_cond_wait_arg *)v_arg;
 
-  rb_xthread_cond_wait(arg->cond, mon->mutex, arg->timeout);
+  if (NIL_P(arg->timeout)) {
+    rb_thread_sleep_deadly();
+  }
+  else {
+    rb_thread_wait_for(rb_time_interval(arg->timeout));
+  }
   return Qtrue;
 }
 
 static VALUE
-rb_xthread_monitor_cond_wait_enter(struct xthread_monitor_cond_wait_arg *arg)
+xthread_monitor_cond_wait_enter(VALUE v_arg)
 {
-  rb_xthread_monitor_enter_for_cond(arg->monitor, arg->count);
+  struct xthread_monitor_cond_wait_arg *arg = (struct xthread_monitor_cond_wait_arg *)v_arg;
+
+  xthread_fifo_ring_delete(&arg->cv->waiters, arg->th);
+  rb_xthread_monitor_enter_for_cond(arg->cv->monitor, arg->count);
+  return Qnil;
 }
 
 VALUE
@@ -333,13 +544,14 @@ rb_xthread_monitor_cond_wait(VALUE self, VALUE timeout)
   GetXThreadMonitorCondPtr(self, cv);
 
   XTHREAD_MONITOR_CHECK_OWNER(cv->monitor);
-  arg.cond = cv->cond;
-  arg.monitor = cv->monitor;
+  arg.cv = cv;
+  arg.th = rb_thread_current();
   arg.timeout = timeout;
+  xthread_fifo_ring_push(&cv->waiters, self, arg.th);
   arg.count = rb_xthread_monitor_exit_for_cond(cv->monitor);
   
-  return rb_ensure(rb_xthread_monitor_cond_wait_cond, (VALUE)&arg,
-		   rb_xthread_monitor_cond_wait_enter, (VALUE)&arg);
+  return rb_ensure(xthread_monitor_cond_sleep, (VALUE)&arg,
+		   xthread_monitor_cond_wait_enter, (VALUE)&arg);
 }
 
 static VALUE
@@ -351,20 +563,95 @@ xthread_monitor_cond_wait(int argc, VALUE *argv, VALUE self)
     return rb_xthread_monitor_cond_wait(self, timeout);
 }
 
+/*
+ * waits until pred(arg) returns true, at most +timeout+ seconds (nil
+ * for no limit) in total however often the thread is woken.  Returns
+ * Qtrue if the predicate holds, Qfalse on timeout.
+ */
 VALUE
-rb_xthread_monitor_cond_wait_while(VALUE self)
+rb_xthread_monitor_cond_wait_for(VALUE self, VALUE (*pred)(VALUE), VALUE arg, VALUE timeout)
 {
-  while (RTEST(rb_yield)) {
-    rb_xthread_monitor_cond_wait(self, Qnil);
+  xthread_hrtime_t deadline = 0;
+
+  if (!NIL_P(timeout)) {
+    double t = NUM2DBL(timeout);
+
+    deadline = rb_xthread_hrtime() + (t > 0 ? (xthread_hrtime_t)(t * XTHREAD_NSEC_PER_SEC) : 0);
+  }
+  for (;;) {
+    xthread_hrtime_t now;
+
+    if (RTEST(pred(arg))) {
+      return Qtrue;
+    }
+    if (NIL_P(timeout)) {
+      rb_xthread_monitor_cond_wait(self, Qnil);
+      continue;
+    }
+    now = rb_xthread_hrtime();
+    if (now >= deadline) {
+      return Qfalse;
+    }
+    rb_xthread_monitor_cond_wait(self, DBL2NUM((double)(deadline - now) / XTHREAD_NSEC_PER_SEC));
   }
 }
 
+static VALUE
+xthread_monitor_cond_block_false_p(VALUE dummy)
+{
+  return RTEST(rb_yield(Qnil)) ? Qfalse : Qtrue;
+}
+
+static VALUE
+xthread_monitor_cond_block_true_p(VALUE dummy)
+{
+  return rb_yield(Qnil);
+}
+
 VALUE
-rb_xthread_monitor_cond_wait_until(VALUE self)
+rb_xthread_monitor_cond_wait_while(VALUE self, VALUE timeout)
 {
-  while (!RTEST(rb_yield)) {
-    rb_xthread_monitor_cond_wait(self, Qnil);
-  }
+  return rb_xthread_monitor_cond_wait_for(self, xthread_monitor_cond_block_false_p, Qnil, timeout);
+}
+
+VALUE
+rb_xthread_monitor_cond_wait_until(VALUE self, VALUE timeout)
+{
+  return rb_xthread_monitor_cond_wait_for(self, xthread_monitor_cond_block_true_p, Qnil, timeout);
+}
+
+/*
+ *  call-seq:
+ *     wait_while(timeout = nil) { ... }  -> true or false
+ *
+ *  Waits while the block returns true.  Returns false if +timeout+
+ *  seconds passed with the block still true.
+ */
+static VALUE
+xthread_monitor_cond_wait_while(int argc, VALUE *argv, VALUE self)
+{
+  VALUE timeout;
+
+  rb_scan_args(argc, argv, "01", &timeout);
+  rb_need_block();
+  return rb_xthread_monitor_cond_wait_while(self, timeout);
+}
+
+/*
+ *  call-seq:
+ *     wait_until(timeout = nil) { ... }  -> true or false
+ *
+ *  Waits until the block returns true.  Returns false if +timeout+
+ *  seconds passed without that.
+ */
+static VALUE
+xthread_monitor_cond_wait_until(int argc, VALUE *argv, VALUE self)
+{
+  VALUE timeout;
+
+  rb_scan_args(argc, argv, "01", &timeout);
+  rb_need_block();
+  return rb_xthread_monitor_cond_wait_until(self, timeout);
 }
 
 VALUE
@@ -374,7 +661,8 @@ rb_xthread_monitor_cond_signal(VALUE self)
   GetXThreadMonitorCondPtr(self, cv);
   
   XTHREAD_MONITOR_CHECK_OWNER(cv->monitor);
-  rb_xthread_cond_signal(cv->cond);
+  xthread_waiters_signal(&cv->waiters);
+  return self;
 }
 
 VALUE
@@ -384,7 +672,107 @@ rb_xthread_monitor_cond_broadcast(VALUE self)
   GetXThreadMonitorCondPtr(self, cv);
   
   XTHREAD_MONITOR_CHECK_OWNER(cv->monitor);
-  rb_xthread_cond_broadcast(cv->cond);
+  xthread_waiters_broadcast(&cv->waiters);
+  return self;
+}
+
+/*
+ * MonitorMixin.  The monitor of an object lives under an ID without the
+ * '@' prefix: an instance variable that Ruby code cannot see or touch
+ * and that is read with a single rb_ivar_get.
+ */
+static VALUE
+xthread_monitor_mixin_initialize_monitor(VALUE self)
+{
+  VALUE mon = rb_xthread_monitor_new();
+
+  rb_ivar_set(self, id_mon, mon);
+  return mon;
+}
+
+static VALUE
+xthread_monitor_mixin_monitor(VALUE self)
+{
+  VALUE mon = rb_ivar_get(self, id_mon);
+
+  if (NIL_P(mon)) {
+    /* the including class did not call super from initialize */
+    mon = xthread_monitor_mixin_initialize_monitor(self);
+  }
+  return mon;
+}
+
+static VALUE
+xthread_monitor_mixin_s_extend_object(VALUE mod, VALUE obj)
+{
+  rb_extend_object(obj, mod);
+  xthread_monitor_mixin_initialize_monitor(obj);
+  return obj;
+}
+
+static VALUE
+xthread_monitor_mixin_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE ret = rb_call_super_kw(argc, argv, RB_PASS_CALLED_KEYWORDS);
+
+  xthread_monitor_mixin_initialize_monitor(self);
+  return ret;
+}
+
+static VALUE
+xthread_monitor_mixin_mon_initialize(VALUE self)
+{
+  xthread_monitor_mixin_initialize_monitor(self);
+  return Qnil;
+}
+
+static VALUE
+xthread_monitor_mixin_mon_try_enter(VALUE self)
+{
+  return rb_xthread_monitor_try_enter(xthread_monitor_mixin_monitor(self));
+}
+
+static VALUE
+xthread_monitor_mixin_mon_enter(VALUE self)
+{
+  return rb_xthread_monitor_enter(xthread_monitor_mixin_monitor(self));
+}
+
+static VALUE
+xthread_monitor_mixin_mon_exit(VALUE self)
+{
+  return rb_xthread_monitor_exit(xthread_monitor_mixin_monitor(self));
+}
+
+static VALUE
+xthread_monitor_mixin_mon_synchronize(VALUE self)
+{
+  return rb_xthread_monitor_synchronize(xthread_monitor_mixin_monitor(self), rb_yield, self);
+}
+
+static VALUE
+xthread_monitor_mixin_new_cond(VALUE self)
+{
+  return rb_xthread_monitor_cond_new(xthread_monitor_mixin_monitor(self));
+}
+
+static VALUE
+xthread_monitor_mixin_mon_locked_p(VALUE self)
+{
+  return rb_xthread_monitor_locked_p(xthread_monitor_mixin_monitor(self));
+}
+
+static VALUE
+xthread_monitor_mixin_mon_owned_p(VALUE self)
+{
+  return rb_xthread_monitor_valid_owner_p(xthread_monitor_mixin_monitor(self));
+}
+
+static VALUE
+xthread_monitor_mixin_mon_check_owner(VALUE self)
+{
+  XTHREAD_MONITOR_CHECK_OWNER(xthread_monitor_mixin_monitor(self));
+  return Qnil;
 }
 
 void
@@ -393,30 +781,67 @@ Init_XThreadMonitor(void)
   rb_cXThreadMonitor =
     rb_define_class_under(rb_mXThread, "Monitor", rb_cObject);
   rb_define_alloc_func(rb_cXThreadMonitor, xthread_monitor_alloc);
-  rb_define_method(rb_cXThreadMonitor, "initialize", xthread_monitor_initialize, 0);
+  rb_define_method(rb_cXThreadMonitor, "initialize", xthread_monitor_initialize, -1);
+  rb_define_method(rb_cXThreadMonitor, "policy", rb_xthread_monitor_policy, 0);
+  rb_define_method(rb_cXThreadMonitor, "policy=", rb_xthread_monitor_set_policy, 1);
   rb_define_method(rb_cXThreadMonitor, "try_enter", rb_xthread_monitor_try_enter, 0);
   rb_define_method(rb_cXThreadMonitor, "enter", rb_xthread_monitor_enter, 0);
   rb_define_method(rb_cXThreadMonitor, "exit", rb_xthread_monitor_exit, 0);
   rb_define_method(rb_cXThreadMonitor, "synchronize", xthread_monitor_synchronize, 0);
   rb_define_method(rb_cXThreadMonitor, "new_cond", rb_xthread_monitor_new_cond, 0);
-  rb_define_method(rb_cXThreadMonitor, "synchronize", xthread_monitor_synchronize, 0);
+  rb_define_method(rb_cXThreadMonitor, "mon_locked?", rb_xthread_monitor_locked_p, 0);
+  rb_define_method(rb_cXThreadMonitor, "mon_owned?", rb_xthread_monitor_valid_owner_p, 0);
+  rb_define_method(rb_cXThreadMonitor, "mon_check_owner", xthread_monitor_check_owner, 0);
+  rb_define_alias(rb_cXThreadMonitor, "try_mon_enter", "try_enter");
+  rb_define_alias(rb_cXThreadMonitor, "mon_try_enter", "try_enter");
+  rb_define_alias(rb_cXThreadMonitor, "mon_enter", "enter");
+  rb_define_alias(rb_cXThreadMonitor, "mon_exit", "exit");
+  rb_define_alias(rb_cXThreadMonitor, "mon_synchronize", "synchronize");
   
   rb_cXThreadMonitorCond =
     rb_define_class_under(rb_cXThreadMonitor, "ConditionVariable", rb_cObject);
   rb_define_alloc_func(rb_cXThreadMonitorCond, xthread_monitor_cond_alloc);
   rb_define_method(rb_cXThreadMonitorCond,
-		   "initialize", xthread_monitor_cond_initialize, 0);
+		   "initialize", xthread_monitor_cond_initialize, 1);
   
   rb_define_method(rb_cXThreadMonitorCond,
 		   "wait", xthread_monitor_cond_wait, -1);
   rb_define_method(rb_cXThreadMonitorCond,
-		   "wait_while", rb_xthread_monitor_cond_wait_while, 0);
+		   "wait_while", xthread_monitor_cond_wait_while, -1);
   rb_define_method(rb_cXThreadMonitorCond,
-		   "wait_until", rb_xthread_monitor_cond_wait_until, 0);
+		   "wait_until", xthread_monitor_cond_wait_until, -1);
 
   rb_define_method(rb_cXThreadMonitorCond,
 		   "signal", rb_xthread_monitor_cond_signal, 0);
   rb_define_method(rb_cXThreadMonitorCond,
 		   "broadcast", rb_xthread_monitor_cond_broadcast, 0);
 
+  id_mon = rb_intern("__xthread_monitor__");
+  rb_mXThreadMonitorMixin = rb_define_module_under(rb_mXThread, "MonitorMixin");
+  rb_define_singleton_method(rb_mXThreadMonitorMixin,
+			     "extend_object", xthread_monitor_mixin_s_extend_object, 1);
+  rb_define_private_method(rb_mXThreadMonitorMixin,
+			   "initialize", xthread_monitor_mixin_initialize, -1);
+  rb_define_private_method(rb_mXThreadMonitorMixin,
+			   "mon_initialize", xthread_monitor_mixin_mon_initialize, 0);
+  rb_define_private_method(rb_mXThreadMonitorMixin,
+			   "mon_check_owner", xthread_monitor_mixin_mon_check_owner, 0);
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "mon_try_enter", xthread_monitor_mixin_mon_try_enter, 0);
+  rb_define_alias(rb_mXThreadMonitorMixin, "try_mon_enter", "mon_try_enter");
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "mon_enter", xthread_monitor_mixin_mon_enter, 0);
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "mon_exit", xthread_monitor_mixin_mon_exit, 0);
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "mon_synchronize", xthread_monitor_mixin_mon_synchronize, 0);
+  rb_define_alias(rb_mXThreadMonitorMixin, "synchronize", "mon_synchronize");
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "new_cond", xthread_monitor_mixin_new_cond, 0);
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "mon_locked?", xthread_monitor_mixin_mon_locked_p, 0);
+  rb_define_method(rb_mXThreadMonitorMixin,
+		   "mon_owned?", xthread_monitor_mixin_mon_owned_p, 0);
+  rb_define_const(rb_mXThreadMonitorMixin, "ConditionVariable", rb_cXThreadMonitorCond);
+
 }
@@ -0,0 +1,77 @@
+/**********************************************************************
+
+  probes.h -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#ifndef XTHREAD_PROBES_H
+#define XTHREAD_PROBES_H
+
+/*
+ * USDT probes for SystemTap and bpftrace, provider "xthread".  With
+ * sys/sdt.h each probe is a single nop plus an ELF note; without it
+ * (or with extconf.rb --disable-probes) they expand to nothing.
+ *
+ * Object arguments are the VALUE of the receiver, which GC.compact may
+ * change.  Wait times are in nanoseconds.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define XTHREAD_PROBE_HRTIME() rb_xthread_hrtime()
+
+#define XTHREAD_PROBE_FIFO_PUSH(obj, depth) \
+  DTRACE_PROBE2(xthread, fifo__push, (obj), (depth))
+#define XTHREAD_PROBE_FIFO_POP(obj, depth) \
+  DTRACE_PROBE2(xthread, fifo__pop, (obj), (depth))
+
+#define XTHREAD_PROBE_QUEUE_PUSH(obj, depth) \
+  DTRACE_PROBE2(xthread, queue__push, (obj), (depth))
+#define XTHREAD_PROBE_QUEUE_POP(obj, depth) \
+  DTRACE_PROBE2(xthread, queue__pop, (obj), (depth))
+/* producer is 1 for a full SizedQueue push, 0 for an empty pop */
+#define XTHREAD_PROBE_QUEUE_BLOCK(obj, depth, producer) \
+  DTRACE_PROBE3(xthread, queue__block, (obj), (depth), (producer))
+#define XTHREAD_PROBE_QUEUE_UNBLOCK(obj, depth, producer, wait) \
+  DTRACE_PROBE4(xthread, queue__unblock, (obj), (depth), (producer), (wait))
+
+#define XTHREAD_PROBE_COND_WAIT(obj, waiters) \
+  DTRACE_PROBE2(xthread, cond__wait, (obj), (waiters))
+#define XTHREAD_PROBE_COND_WAKE(obj, wait) \
+  DTRACE_PROBE2(xthread, cond__wake, (obj), (wait))
+#define XTHREAD_PROBE_COND_SIGNAL(obj, waiters) \
+  DTRACE_PROBE2(xthread, cond__signal, (obj), (waiters))
+#define XTHREAD_PROBE_COND_BROADCAST(obj, waiters) \
+  DTRACE_PROBE2(xthread, cond__broadcast, (obj), (waiters))
+
+#define XTHREAD_PROBE_MONITOR_CONTENDED(obj, waiters) \
+  DTRACE_PROBE2(xthread, monitor__contended, (obj), (waiters))
+#define XTHREAD_PROBE_MONITOR_ACQUIRED(obj, wait) \
+  DTRACE_PROBE2(xthread, monitor__acquired, (obj), (wait))
+#define XTHREAD_PROBE_MONITOR_EXIT(obj, waiters) \
+  DTRACE_PROBE2(xthread, monitor__exit, (obj), (waiters))
+
+#else
+
+#define XTHREAD_PROBE_HRTIME() ((xthread_hrtime_t)0)
+
+#define XTHREAD_PROBE_FIFO_PUSH(obj, depth) do {} while (0)
+#define XTHREAD_PROBE_FIFO_POP(obj, depth) do {} while (0)
+#define XTHREAD_PROBE_QUEUE_PUSH(obj, depth) do {} while (0)
+#define XTHREAD_PROBE_QUEUE_POP(obj, depth) do {} while (0)
+#define XTHREAD_PROBE_QUEUE_BLOCK(obj, depth, producer) do {} while (0)
+#define XTHREAD_PROBE_QUEUE_UNBLOCK(obj, depth, producer, wait) do {} while (0)
+#define XTHREAD_PROBE_COND_WAIT(obj, waiters) do {} while (0)
+#define XTHREAD_PROBE_COND_WAKE(obj, wait) do {} while (0)
+#define XTHREAD_PROBE_COND_SIGNAL(obj, waiters) do {} while (0)
+#define XTHREAD_PROBE_COND_BROADCAST(obj, waiters) do {} while (0)
+#define XTHREAD_PROBE_MONITOR_CONTENDED(obj, waiters) do {} while (0)
+#define XTHREAD_PROBE_MONITOR_ACQUIRED(obj, wait) do {} while (0)
+#define XTHREAD_PROBE_MONITOR_EXIT(obj, waiters) do {} while (0)
+
+#endif
+
+#endif /* XTHREAD_PROBES_H */
@@ -10,20 +10,70 @@
 #include "ruby.h"
 
 #include "xthread.h"
+#include "xthread-internal.h"
+#include "probes.h"
 
 #define SIZED_QUEUE_DEFAULT_MAX 16
 
 VALUE rb_cXThreadQueue;
 VALUE rb_cXThreadSizedQueue;
+VALUE rb_cXThreadJournalQueue;
 
+static VALUE xthread_eClosedQueueError;
+
+/*
+ * always-on counters.  Block times are only measured on the path that
+ * actually sleeps, so a push or pop that does not wait pays for a few
+ * increments and one compare.
+ */
+typedef struct rb_xthread_queue_stats_struct
+{
+  unsigned LONG_LONG pushes;
+  unsigned LONG_LONG pops;
+  long high_water;
+
+  unsigned LONG_LONG consumer_blocks;
+  xthread_hrtime_t consumer_block_time;
+  unsigned LONG_LONG producer_blocks;
+  xthread_hrtime_t producer_block_time;
+} xthread_queue_stats_t;
+
+/*
+ * the element ring and the list of waiting consumers are embedded, so a
+ * queue is a single allocation.  Waiters sleep directly on the GVL-held
+ * queue state instead of going through a Mutex and ConditionVariable.
+ */
 typedef struct rb_xthread_queue_struct
 {
-  VALUE lock;
-  VALUE cond;
+  xthread_fifo_t elements;
+  xthread_fifo_t waiters;
+  int closed;
+
+  /* enqueue-to-dequeue latency, NULL unless tracking is enabled */
+  xthread_histogram_t *latency;
+
+  xthread_queue_stats_t stats;
+  VALUE metrics_name;
 
-  VALUE elements;
+  /* every live queue is linked here for XThread.queue_stats */
+  const char *kind;
+  long serial;
+  struct rb_xthread_queue_struct *prev;
+  struct rb_xthread_queue_struct *next;
 } xthread_queue_t;
 
+static xthread_queue_t *xthread_queue_registry;
+static long xthread_queue_serial;
+
+#define QUEUE_KIND_PLAIN 0
+#define QUEUE_KIND_SIZED 1
+#define QUEUE_KIND_JOURNAL 2
+
+static int xthread_queue_kind(VALUE);
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static VALUE xthread_journal_queue_pop_timeout(VALUE, VALUE);
+#endif
+
 #define GetXThreadQueuePtr(obj, tobj) \
     TypedData_Get_Struct((obj), xthread_queue_t, &xthread_queue_data_type, (tobj))
 
@@ -32,27 +82,88 @@ xthread_queue_mark(void *ptr)
 {
   xthread_queue_t *que = (xthread_queue_t*)ptr;
   
-  rb_gc_mark(que->lock);
-  rb_gc_mark(que->cond);
-  rb_gc_mark(que->elements);
+  xthread_fifo_ring_mark(&que->elements);
+  xthread_fifo_ring_mark(&que->waiters);
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+  rb_gc_mark_movable(que->metrics_name);
+#else
+  rb_gc_mark(que->metrics_name);
+#endif
+}
+
+static void
+xthread_queue_compact(void *ptr)
+{
+  xthread_queue_t *que = (xthread_queue_t*)ptr;
+  
+  xthread_fifo_ring_compact(&que->elements);
+  xthread_fifo_ring_compact(&que->waiters);
+  que->metrics_name = rb_gc_location(que->metrics_name);
+}
+
+static void
+xthread_queue_unregister(xthread_queue_t *que)
+{
+  if (que->prev) {
+    que->prev->next = que->next;
+  }
+  else if (xthread_queue_registry == que) {
+    xthread_queue_registry = que->next;
+  }
+  if (que->next) {
+    que->next->prev = que->prev;
+  }
+  que->prev = que->next = NULL;
+}
+
+static void
+xthread_queue_free_rings(xthread_queue_t *que)
+{
+  xthread_queue_unregister(que);
+  xthread_fifo_ring_free(&que->elements);
+  xthread_fifo_ring_free(&que->waiters);
+  if (que->latency) {
+    xthread_histogram_free(que->latency);
+    que->latency = NULL;
+  }
 }
 
 static void
 xthread_queue_free(void *ptr)
 {
+  xthread_queue_free_rings((xthread_queue_t*)ptr);
   ruby_xfree(ptr);
 }
 
+static size_t
+xthread_queue_rings_memsize(const xthread_queue_t *que)
+{
+  size_t size = (que->elements.capa + que->waiters.capa) * sizeof(VALUE);
+
+  if (que->latency) {
+    size += que->elements.capa * sizeof(xthread_hrtime_t) +
+      xthread_histogram_memsize(que->latency);
+  }
+  return size;
+}
+
 static size_t
 xthread_queue_memsize(const void *ptr)
 {
-  return ptr ? sizeof(xthread_queue_t) : 0;
+  return ptr ? sizeof(xthread_queue_t) + xthread_queue_rings_memsize(ptr) : 0;
 }
 
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xthread_queue_data_type = {
     "xthread_queue",
-    {xthread_queue_mark, xthread_queue_free, xthread_queue_memsize,},
+    {xthread_queue_mark, xthread_queue_free, xthread_queue_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_queue_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 #else
 static const rb_data_type_t xthread_queue_data_type = {
@@ -64,11 +175,24 @@ static const rb_data_type_t xthread_queue_data_type = {
 #endif
 
 static void
-xthread_queue_alloc_init(xthread_queue_t *que)
+xthread_queue_alloc_init(xthread_queue_t *que, const char *kind)
 {
-  que->lock = rb_mutex_new();
-  que->cond = rb_xthread_cond_new();
-  que->elements = rb_xthread_fifo_new();
+  xthread_fifo_ring_init(&que->elements);
+  xthread_fifo_ring_init(&que->waiters);
+  que->closed = 0;
+  que->latency = NULL;
+
+  MEMZERO(&que->stats, xthread_queue_stats_t, 1);
+  que->metrics_name = Qnil;
+
+  que->kind = kind;
+  que->serial = ++xthread_queue_serial;
+  que->prev = NULL;
+  que->next = xthread_queue_registry;
+  if (xthread_queue_registry) {
+    xthread_queue_registry->prev = que;
+  }
+  xthread_queue_registry = que;
 }
 
 static VALUE
@@ -78,14 +202,33 @@ xthread_queue_alloc(VALUE klass)
   xthread_queue_t *que;
 
   obj = TypedData_Make_Struct(klass, xthread_queue_t, &xthread_queue_data_type, que);
-  xthread_queue_alloc_init(que);
+  xthread_queue_alloc_init(que, "Queue");
   return obj;
 }
 
+/*
+ *  call-seq:
+ *     Queue.new(items = nil)
+ *
+ *  Creates a new queue, holding the elements of +items+ if given.
+ */
 static VALUE
-xthread_queue_initialize(VALUE self)
+xthread_queue_initialize(int argc, VALUE *argv, VALUE self)
 {
-    return self;
+  xthread_queue_t *que;
+  VALUE items;
+
+  GetXThreadQueuePtr(self, que);
+  rb_scan_args(argc, argv, "01", &items);
+  if (!NIL_P(items)) {
+    long i;
+
+    items = rb_convert_type(items, T_ARRAY, "Array", "to_a");
+    for (i = 0; i < RARRAY_LEN(items); i++) {
+      xthread_fifo_ring_push(&que->elements, self, RARRAY_AREF(items, i));
+    }
+  }
+  return self;
 }
 
 VALUE
@@ -94,72 +237,286 @@ rb_xthread_queue_new(void)
   return xthread_queue_alloc(rb_cXThreadQueue);
 }
 
+static void
+xthread_queue_check_closed(xthread_queue_t *que)
+{
+  if (que->closed) {
+    rb_raise(xthread_eClosedQueueError, "queue closed");
+  }
+}
+
+static VALUE
+xthread_queue_do_push(VALUE self, VALUE item)
+{
+  xthread_queue_t *que;
+  
+  GetXThreadQueuePtr(self, que);
+
+  xthread_queue_check_closed(que);
+  xthread_fifo_ring_push(&que->elements, self, item);
+  que->stats.pushes++;
+  if (XTHREAD_FIFO_RING_LENGTH(&que->elements) > que->stats.high_water) {
+    que->stats.high_water = XTHREAD_FIFO_RING_LENGTH(&que->elements);
+  }
+  XTHREAD_PROBE_QUEUE_PUSH(self, XTHREAD_FIFO_RING_LENGTH(&que->elements));
+  if (!XTHREAD_FIFO_RING_EMPTY_P(&que->waiters)) {
+    xthread_waiters_signal(&que->waiters);
+  }
+  return self;
+}
+
+/*
+ * the C API entry points dispatch on the kind of queue, so that a
+ * SizedQueue or JournalQueue keeps its bound, spill tier and journal.
+ */
 VALUE
 rb_xthread_queue_push(VALUE self, VALUE item)
+{
+  switch (xthread_queue_kind(self)) {
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  case QUEUE_KIND_SIZED:
+    return rb_xthread_sized_queue_push(self, item);
+  case QUEUE_KIND_JOURNAL:
+    return rb_xthread_journal_queue_push(self, item);
+#endif
+  default:
+    return xthread_queue_do_push(self, item);
+  }
+}
+
+/*
+ *  call-seq:
+ *     requeue_front(obj)
+ *
+ *  Puts +obj+ back at the head of the queue, typically an item whose
+ *  processing failed, so that it is the next one popped.  Never waits:
+ *  on a full SizedQueue it goes over max until the next pop.  A
+ *  JournalQueue has no such operation.
+ */
+VALUE
+rb_xthread_queue_requeue_front(VALUE self, VALUE item)
 {
   xthread_queue_t *que;
-  int signal_p = 0;
   
   GetXThreadQueuePtr(self, que);
+  if (xthread_queue_kind(self) == QUEUE_KIND_JOURNAL) {
+    /* the journal has no record for it; a popped entry is acked */
+    rb_raise(rb_eNotImpError, "requeue_front is not supported by JournalQueue");
+  }
 
-  if (RTEST(rb_xthread_fifo_empty_p(que->elements))) {
-    signal_p = 1;
+  xthread_queue_check_closed(que);
+  xthread_fifo_ring_unshift(&que->elements, self, item);
+  que->stats.pushes++;
+  if (XTHREAD_FIFO_RING_LENGTH(&que->elements) > que->stats.high_water) {
+    que->stats.high_water = XTHREAD_FIFO_RING_LENGTH(&que->elements);
   }
-  rb_xthread_fifo_push(que->elements, item);
-  if (signal_p) {
-    rb_xthread_cond_signal(que->cond);
+  XTHREAD_PROBE_QUEUE_PUSH(self, XTHREAD_FIFO_RING_LENGTH(&que->elements));
+  if (!XTHREAD_FIFO_RING_EMPTY_P(&que->waiters)) {
+    xthread_waiters_signal(&que->waiters);
   }
   return self;
 }
 
-VALUE
-rb_xthread_queue_pop(VALUE self)
+/* deadline of a timeout given in seconds; 0 for none */
+static xthread_hrtime_t
+xthread_queue_deadline(VALUE timeout)
+{
+  double t;
+
+  if (NIL_P(timeout)) {
+    return 0;
+  }
+  t = NUM2DBL(timeout);
+  return rb_xthread_hrtime() + (t > 0 ? (xthread_hrtime_t)(t * XTHREAD_NSEC_PER_SEC) : 0);
+}
+
+/*
+ * waits on +waiters+ until woken or +deadline+ passes.  Returns 0 once
+ * the deadline has passed.
+ */
+static int
+xthread_queue_wait(VALUE self, xthread_fifo_t *waiters, xthread_hrtime_t deadline)
+{
+  xthread_hrtime_t now;
+
+  if (deadline == 0) {
+    xthread_waiters_wait(self, waiters);
+    return 1;
+  }
+  now = rb_xthread_hrtime();
+  if (now >= deadline) {
+    return 0;
+  }
+  xthread_waiters_wait_for(self, waiters, (double)(deadline - now) / XTHREAD_NSEC_PER_SEC);
+  return 1;
+}
+
+/*
+ * takes the head element.  Returns Qundef instead of an element when
+ * the queue is closed and empty or the timeout passes.
+ */
+static VALUE
+xthread_queue_do_pop(VALUE self, int non_block, VALUE timeout)
 {
   xthread_queue_t *que;
-  VALUE item;
+  xthread_hrtime_t deadline;
+  xthread_hrtime_t start;
   
   GetXThreadQueuePtr(self, que);
 
-  if (RTEST(rb_xthread_fifo_empty_p(que->elements))) {
-    rb_mutex_lock(que->lock);
-    while (RTEST(rb_xthread_fifo_empty_p(que->elements))) {
-      rb_xthread_cond_wait(que->cond, que->lock, Qnil);
+  if (XTHREAD_FIFO_RING_EMPTY_P(&que->elements)) {
+    if (non_block) {
+      rb_raise(rb_eThreadError, "queue empty");
     }
-    rb_mutex_unlock(que->lock);
+    deadline = xthread_queue_deadline(timeout);
+    start = rb_xthread_hrtime();
+    que->stats.consumer_blocks++;
+    XTHREAD_PROBE_QUEUE_BLOCK(self, 0, 0);
+    while (XTHREAD_FIFO_RING_EMPTY_P(&que->elements)) {
+      if (que->closed || !xthread_queue_wait(self, &que->waiters, deadline)) {
+	que->stats.consumer_block_time += rb_xthread_hrtime() - start;
+	XTHREAD_PROBE_QUEUE_UNBLOCK(self, 0, 0, rb_xthread_hrtime() - start);
+	return Qundef;
+      }
+    }
+    que->stats.consumer_block_time += rb_xthread_hrtime() - start;
+    XTHREAD_PROBE_QUEUE_UNBLOCK(self, XTHREAD_FIFO_RING_LENGTH(&que->elements), 0,
+				rb_xthread_hrtime() - start);
+  }
+  que->stats.pops++;
+  XTHREAD_PROBE_QUEUE_POP(self, XTHREAD_FIFO_RING_LENGTH(&que->elements) - 1);
+  if (que->latency) {
+    xthread_histogram_record(que->latency, rb_xthread_hrtime() -
+			     que->elements.stamps[XTHREAD_FIFO_RING_INDEX(&que->elements, 0)]);
   }
-  return rb_xthread_fifo_pop(que->elements);
+  return xthread_fifo_ring_pop(&que->elements);
 }
 
 VALUE
-rb_xthread_queue_pop_non_block(VALUE self)
+rb_xthread_queue_pop(VALUE self)
 {
-  xthread_queue_t *que;
   VALUE item;
-  
-  GetXThreadQueuePtr(self, que);
 
-  if (RTEST(rb_xthread_fifo_empty_p(que->elements))) {
-    rb_raise(rb_eThreadError, "xthread_queue empty");
+  switch (xthread_queue_kind(self)) {
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  case QUEUE_KIND_SIZED:
+    return rb_xthread_sized_queue_pop(self);
+  case QUEUE_KIND_JOURNAL:
+    return rb_xthread_journal_queue_pop(self);
+#endif
   }
-  else {
-    return rb_xthread_fifo_pop(que->elements);
+  item = xthread_queue_do_pop(self, 0, Qnil);
+  return item == Qundef ? Qnil : item;
+}
+
+VALUE
+rb_xthread_queue_pop_non_block(VALUE self)
+{
+  switch (xthread_queue_kind(self)) {
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  case QUEUE_KIND_SIZED:
+    return rb_xthread_sized_queue_pop_non_block(self);
+  case QUEUE_KIND_JOURNAL:
+    return rb_xthread_journal_queue_pop_non_block(self);
+#endif
+  }
+  return xthread_queue_do_pop(self, 1, Qnil);
+}
+
+/*
+ * waits at most +timeout+ seconds; nil when none arrived.
+ */
+VALUE
+rb_xthread_queue_pop_timeout(VALUE self, VALUE timeout)
+{
+  VALUE item;
+
+  switch (xthread_queue_kind(self)) {
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  case QUEUE_KIND_SIZED:
+    return rb_xthread_sized_queue_pop_timeout(self, timeout);
+  case QUEUE_KIND_JOURNAL:
+    return xthread_journal_queue_pop_timeout(self, timeout);
+#endif
   }
+  item = xthread_queue_do_pop(self, 0, timeout);
+  return item == Qundef ? Qnil : item;
 }
 
+/* pop(non_block = false, timeout: nil), Qundef if nothing was taken */
 static VALUE
-xthread_queue_pop(int argc, VALUE *argv, VALUE self)
+xthread_queue_pop_args(int argc, VALUE *argv, VALUE self)
 {
+  static ID keywords[1];
   VALUE non_block;
+  VALUE opts;
+  VALUE timeout = Qnil;
   
-  rb_scan_args(argc, argv, "01", &non_block);
-  if (RTEST(non_block)) {
-    return rb_xthread_queue_pop_non_block(self);
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("timeout");
   }
-  else {
-    return rb_xthread_queue_pop(self);
+  rb_scan_args(argc, argv, "01:", &non_block, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &timeout);
+    if (timeout == Qundef) {
+      timeout = Qnil;
+    }
+  }
+  if (RTEST(non_block) && !NIL_P(timeout)) {
+    rb_raise(rb_eArgError, "can't set a timeout if non_block is enabled");
   }
+  return xthread_queue_do_pop(self, RTEST(non_block), timeout);
+}
+
+/*
+ *  call-seq:
+ *     pop(non_block = false, timeout: nil)
+ *
+ *  Retrieves the head element, waiting for one if the queue is empty.
+ *  With +non_block+ raises ThreadError instead of waiting.  Returns nil
+ *  after +timeout+ seconds without an element, or when the queue is
+ *  closed and empty.
+ */
+static VALUE
+xthread_queue_pop(int argc, VALUE *argv, VALUE self)
+{
+  VALUE item = xthread_queue_pop_args(argc, argv, self);
+
+  return item == Qundef ? Qnil : item;
+}
+
+/*
+ * closes the queue: further pushes raise ClosedQueueError and waiting
+ * consumers get nil once the queue has run empty.
+ */
+VALUE
+rb_xthread_queue_close(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  que->closed = 1;
+  xthread_waiters_broadcast(&que->waiters);
+  return self;
 }
 
+VALUE
+rb_xthread_queue_closed_p(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  return que->closed ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_queue_num_waiting(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  return LONG2NUM(XTHREAD_FIFO_RING_LENGTH(&que->waiters));
+}
 
 VALUE
 rb_xthread_queue_empty_p(VALUE self)
@@ -167,7 +524,7 @@ rb_xthread_queue_empty_p(VALUE self)
   xthread_queue_t *que;
   GetXThreadQueuePtr(self, que);
 
-  return rb_xthread_fifo_empty_p(que->elements);
+  return XTHREAD_FIFO_RING_EMPTY_P(&que->elements) ? Qtrue : Qfalse;
 }
 
 VALUE
@@ -176,7 +533,7 @@ rb_xthread_queue_clear(VALUE self)
   xthread_queue_t *que;
   GetXThreadQueuePtr(self, que);
 
-  rb_xthread_fifo_clear(que->elements);
+  xthread_fifo_ring_clear(&que->elements);
   return self;
 }
 
@@ -186,16 +543,251 @@ rb_xthread_queue_length(VALUE self)
   xthread_queue_t *que;
   GetXThreadQueuePtr(self, que);
 
-  return rb_xthread_fifo_length(que->elements);
+  return LONG2NUM(XTHREAD_FIFO_RING_LENGTH(&que->elements));
+}
+
+/*
+ *  call-seq:
+ *     enable_latency_tracking
+ *
+ *  Starts timestamping every pushed element and recording how long it
+ *  stayed in the queue.  Elements already queued count from now.
+ */
+VALUE
+rb_xthread_queue_enable_latency_tracking(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  if (!que->latency) {
+    xthread_fifo_ring_enable_stamps(&que->elements);
+    que->latency = xthread_histogram_new();
+  }
+  return self;
+}
+
+VALUE
+rb_xthread_queue_disable_latency_tracking(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  if (que->latency) {
+    xthread_histogram_free(que->latency);
+    que->latency = NULL;
+    xthread_fifo_ring_disable_stamps(&que->elements);
+  }
+  return self;
+}
+
+VALUE
+rb_xthread_queue_latency_tracking_p(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  return que->latency ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     latency_percentiles(*percentiles)
+ *
+ *  Returns a Hash from each percentile (default 50, 90, 99 and 99.9)
+ *  to the dwell time in seconds, nil when nothing was recorded.  Values
+ *  are bucket upper bounds, within about 3% of the true latency.
+ */
+static VALUE
+xthread_queue_latency_percentiles(int argc, VALUE *argv, VALUE self)
+{
+  static const double defaults[] = {50.0, 90.0, 99.0, 99.9};
+  xthread_queue_t *que;
+  VALUE result;
+  int i, n;
+
+  GetXThreadQueuePtr(self, que);
+  if (!que->latency) {
+    rb_raise(rb_eRuntimeError, "latency tracking is not enabled");
+  }
+
+  result = rb_hash_new();
+  n = argc > 0 ? argc : (int)(sizeof(defaults) / sizeof(defaults[0]));
+  for (i = 0; i < n; i++) {
+    VALUE key = argc > 0 ? argv[i] : DBL2NUM(defaults[i]);
+    double p = NUM2DBL(key);
+    VALUE v = Qnil;
+
+    if (p < 0 || p > 100) {
+      rb_raise(rb_eArgError, "percentile out of range: %f", p);
+    }
+    if (xthread_histogram_count(que->latency) > 0) {
+      v = DBL2NUM((double)xthread_histogram_percentile(que->latency, p) /
+		  XTHREAD_NSEC_PER_SEC);
+    }
+    rb_hash_aset(result, key, v);
+  }
+  return result;
+}
+
+VALUE
+rb_xthread_queue_latency_count(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  if (!que->latency) {
+    return INT2FIX(0);
+  }
+  return ULL2NUM(xthread_histogram_count(que->latency));
+}
+
+VALUE
+rb_xthread_queue_reset_latency(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  if (que->latency) {
+    xthread_histogram_reset(que->latency);
+  }
+  return self;
+}
+
+static VALUE
+xthread_queue_stats_hash(xthread_queue_t *que)
+{
+  VALUE hash = rb_hash_new();
+
+#define STAT_SET(key, val) rb_hash_aset(hash, ID2SYM(rb_intern(key)), (val))
+  STAT_SET("kind", rb_str_new2(que->kind));
+  STAT_SET("serial", LONG2NUM(que->serial));
+  STAT_SET("name", que->metrics_name);
+  STAT_SET("length", LONG2NUM(XTHREAD_FIFO_RING_LENGTH(&que->elements)));
+  STAT_SET("pushes", ULL2NUM(que->stats.pushes));
+  STAT_SET("pops", ULL2NUM(que->stats.pops));
+  STAT_SET("high_water", LONG2NUM(que->stats.high_water));
+  STAT_SET("consumer_blocks", ULL2NUM(que->stats.consumer_blocks));
+  STAT_SET("consumer_block_time",
+	   DBL2NUM((double)que->stats.consumer_block_time / XTHREAD_NSEC_PER_SEC));
+  STAT_SET("producer_blocks", ULL2NUM(que->stats.producer_blocks));
+  STAT_SET("producer_block_time",
+	   DBL2NUM((double)que->stats.producer_block_time / XTHREAD_NSEC_PER_SEC));
+#undef STAT_SET
+  return hash;
+}
+
+/*
+ *  call-seq:
+ *     stats
+ *
+ *  Returns the counters of this queue as a Hash: pushes, pops,
+ *  high_water (deepest the queue has been), consumer_blocks and
+ *  producer_blocks (waits that actually slept) and their total
+ *  durations in seconds.
+ */
+VALUE
+rb_xthread_queue_stats(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  return xthread_queue_stats_hash(que);
+}
+
+VALUE
+rb_xthread_queue_metrics_name(VALUE self)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  return que->metrics_name;
+}
+
+/*
+ *  call-seq:
+ *     metrics_name = name
+ *
+ *  Names the queue in XThread.queue_stats and XThread.metrics.
+ */
+VALUE
+rb_xthread_queue_set_metrics_name(VALUE self, VALUE name)
+{
+  xthread_queue_t *que;
+  GetXThreadQueuePtr(self, que);
+
+  if (!NIL_P(name)) {
+    name = rb_str_new_frozen(StringValue(name));
+  }
+  RB_OBJ_WRITE(self, &que->metrics_name, name);
+  return name;
+}
+
+static VALUE
+xthread_queue_collect_stats(VALUE ary)
+{
+  xthread_queue_t *que;
+
+  for (que = xthread_queue_registry; que; que = que->next) {
+    rb_ary_push(ary, xthread_queue_stats_hash(que));
+  }
+  return ary;
+}
+
+static VALUE
+xthread_queue_collect_stats_ensure(VALUE disabled)
+{
+  if (!RTEST(disabled)) {
+    rb_gc_enable();
+  }
+  return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     XThread.queue_stats
+ *
+ *  Returns Queue#stats of every live queue.  GC is held off while the
+ *  registry is walked, since a sweep would unlink queues under us.
+ */
+static VALUE
+xthread_s_queue_stats(VALUE mod)
+{
+  VALUE ary = rb_ary_new();
+  VALUE disabled = rb_gc_disable();
+
+  return rb_ensure(xthread_queue_collect_stats, ary,
+		   xthread_queue_collect_stats_ensure, disabled);
 }
 
+/*
+ * adaptive mode: max is tuned between adapt_min and adapt_max so that
+ * the time an item stays in the queue approaches adapt_target.  The
+ * latency is estimated once per window by Little's law (depth / dequeue
+ * rate); max grows only while producers are actually blocked.
+ */
+typedef struct rb_xthread_sized_queue_adaptive_struct
+{
+  xthread_hrtime_t target;
+  long min;
+  long max;
+
+  xthread_hrtime_t window_start;
+  long pops;
+  xthread_hrtime_t blocked;
+} xthread_sized_queue_adaptive_t;
+
 typedef struct rb_xthread_sized_queue_struct
 {
   xthread_queue_t super;
 
   long max;
-  VALUE cond_wait;
+  xthread_fifo_t push_waiters;
+
+  int adaptive_p;
+  xthread_sized_queue_adaptive_t adaptive;
 
+  /* overflow tier on disk, NULL unless spill_to was called */
+  xthread_spill_t *spill;
 } xthread_sized_queue_t;
 
 #define GetXThreadSizedQueuePtr(obj, tobj) \
@@ -207,7 +799,16 @@ xthread_sized_queue_mark(void *ptr)
   xthread_sized_queue_t *que = (xthread_sized_queue_t*)ptr;
 
   xthread_queue_mark(ptr);
-  rb_gc_mark(que->cond_wait);
+  xthread_fifo_ring_mark(&que->push_waiters);
+}
+
+static void
+xthread_sized_queue_compact(void *ptr)
+{
+  xthread_sized_queue_t *que = (xthread_sized_queue_t*)ptr;
+
+  xthread_queue_compact(ptr);
+  xthread_fifo_ring_compact(&que->push_waiters);
 }
 
 static void
@@ -215,6 +816,11 @@ xthread_sized_queue_free(void *ptr)
 {
   xthread_sized_queue_t *que = (xthread_sized_queue_t*)ptr;
   
+  xthread_queue_free_rings(&que->super);
+  xthread_fifo_ring_free(&que->push_waiters);
+  if (que->spill) {
+    xthread_spill_free(que->spill);
+  }
   ruby_xfree(ptr);
 }
 
@@ -223,15 +829,24 @@ xthread_sized_queue_memsize(const void *ptr)
 {
   xthread_sized_queue_t *que = (xthread_sized_queue_t*)ptr;
   
-  return ptr ? sizeof(xthread_sized_queue_t) : 0;
+  return ptr ? sizeof(xthread_sized_queue_t) +
+    xthread_queue_rings_memsize(&que->super) +
+    que->push_waiters.capa * sizeof(VALUE) : 0;
 }
 
 
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
 static const rb_data_type_t xthread_sized_queue_data_type = {
     "xthread_sized_queue",
-    {xthread_sized_queue_mark, xthread_sized_queue_free, xthread_sized_queue_memsize,},
+    {xthread_sized_queue_mark, xthread_sized_queue_free, xthread_sized_queue_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_sized_queue_compact,
+#endif
+    },
     &xthread_queue_data_type,
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 
 static VALUE
@@ -242,10 +857,12 @@ xthread_sized_queue_alloc(VALUE klass)
 
   obj = TypedData_Make_Struct(klass,
 			      xthread_sized_queue_t, &xthread_sized_queue_data_type, que);
-  xthread_queue_alloc_init(&que->super);
+  xthread_queue_alloc_init(&que->super, "SizedQueue");
 
   que->max = SIZED_QUEUE_DEFAULT_MAX;
-  que->cond_wait = rb_xthread_cond_new();
+  xthread_fifo_ring_init(&que->push_waiters);
+  que->adaptive_p = 0;
+  que->spill = NULL;
 
   return obj;
 }
@@ -258,6 +875,9 @@ xthread_sized_queue_initialize(VALUE self, VALUE v_max)
   
   GetXThreadSizedQueuePtr(self, que);
 
+  if (max <= 0) {
+    rb_raise(rb_eArgError, "queue size must be positive");
+  }
   que->max = max;
   
   return self;
@@ -271,6 +891,9 @@ rb_xthread_sized_queue_new(long max)
   
   GetXThreadSizedQueuePtr(obj, que);
 
+  if (max <= 0) {
+    rb_raise(rb_eArgError, "queue size must be positive");
+  }
   que->max = max;
   return obj;
 }
@@ -284,42 +907,374 @@ rb_xthread_sized_queue_max(VALUE self)
   return LONG2NUM(que->max);
 }
 
-VALUE
+static void
+xthread_sized_queue_resize(xthread_sized_queue_t *que, long max)
+{
+  long len = XTHREAD_FIFO_RING_LENGTH(&que->super.elements);
+  long diff = 0;
+
+  if (max > que->max && len < max) {
+    diff = max - (len > que->max ? len : que->max);
+  }
+  que->max = max;
+
+  if (diff > 0) {
+    xthread_waiters_signal_n(&que->push_waiters, diff);
+  }
+}
+
+VALUE
 rb_xthread_sized_queue_set_max(VALUE self, VALUE v_max)
 {
   xthread_sized_queue_t *que;
   long max = NUM2LONG(v_max);
-  long diff = 0;
-  long i;
   
   GetXThreadSizedQueuePtr(self, que);
 
-  if (max < que->max) {
-    diff = max - que->max;
+  if (max <= 0) {
+    rb_raise(rb_eArgError, "queue size must be positive");
   }
-  que->max = max;
+  xthread_sized_queue_resize(que, max);
+  return v_max;
+}
+
+/*
+ * ends the current window once it is over.  Runs on every pop and also
+ * when a producer is about to block, so that max still shrinks when
+ * the consumers have stalled and nothing pops at all.
+ */
+static void
+xthread_sized_queue_adapt(xthread_sized_queue_t *que)
+{
+  xthread_sized_queue_adaptive_t *ad = &que->adaptive;
+  xthread_hrtime_t now = rb_xthread_hrtime();
+  xthread_hrtime_t elapsed = now - ad->window_start;
+  long len;
+  long max;
+  double rate;
+  double latency = 0;
+  double desired;
+
+  if (elapsed < ad->target) {
+    return;
+  }
+
+  len = XTHREAD_FIFO_RING_LENGTH(&que->super.elements);
+  rate = (double)ad->pops * XTHREAD_NSEC_PER_SEC / elapsed;
+  if (rate > 0) {
+    latency = (double)len * XTHREAD_NSEC_PER_SEC / rate;
+  }
+  desired = rate * ad->target / XTHREAD_NSEC_PER_SEC;
+
+  max = que->max;
+  if ((rate == 0 && len > 0) || latency > ad->target) {
+    /* consumers lag: shrink toward the depth they can drain in time */
+    max = (long)((que->max + desired) / 2);
+  }
+  else if (ad->blocked > 0 && desired > que->max) {
+    /* producers wait while consumers keep up: grow */
+    max = (long)((que->max + desired) / 2) + 1;
+  }
+
+  if (max < ad->min) max = ad->min;
+  if (max > ad->max) max = ad->max;
+  if (max != que->max) {
+    xthread_sized_queue_resize(que, max);
+  }
+
+  ad->window_start = now;
+  ad->pops = 0;
+  ad->blocked = 0;
+}
+
+VALUE
+rb_xthread_sized_queue_enable_adaptive(VALUE self, VALUE target, VALUE v_min, VALUE v_max)
+{
+  xthread_sized_queue_t *que;
+  double sec = NUM2DBL(target);
+  long min = NUM2LONG(v_min);
+  long max = NUM2LONG(v_max);
+  
+  GetXThreadSizedQueuePtr(self, que);
+
+  if (sec <= 0) {
+    rb_raise(rb_eArgError, "target latency must be positive");
+  }
+  if (min <= 0 || min > max) {
+    rb_raise(rb_eArgError, "invalid bounds: %ld..%ld", min, max);
+  }
+
+  que->adaptive.target = (xthread_hrtime_t)(sec * XTHREAD_NSEC_PER_SEC);
+  que->adaptive.min = min;
+  que->adaptive.max = max;
+  que->adaptive.window_start = rb_xthread_hrtime();
+  que->adaptive.pops = 0;
+  que->adaptive.blocked = 0;
+  que->adaptive_p = 1;
+
+  if (que->max < min) {
+    xthread_sized_queue_resize(que, min);
+  }
+  else if (que->max > max) {
+    xthread_sized_queue_resize(que, max);
+  }
+  return self;
+}
+
+VALUE
+rb_xthread_sized_queue_disable_adaptive(VALUE self)
+{
+  xthread_sized_queue_t *que;
+  
+  GetXThreadSizedQueuePtr(self, que);
+  que->adaptive_p = 0;
+  return self;
+}
 
-  for (i = 0; i < diff; i++) {
-    rb_xthread_cond_signal(que->cond_wait);
+VALUE
+rb_xthread_sized_queue_adaptive_p(VALUE self)
+{
+  xthread_sized_queue_t *que;
+  
+  GetXThreadSizedQueuePtr(self, que);
+  return que->adaptive_p ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_sized_queue_spill_to(VALUE self, VALUE dir, VALUE segment_size)
+{
+  xthread_sized_queue_t *que;
+  
+  GetXThreadSizedQueuePtr(self, que);
+
+  if (que->spill) {
+    rb_raise(rb_eArgError, "spill directory already set");
   }
+  FilePathValue(dir);
+  que->spill = xthread_spill_new(RSTRING_PTR(dir),
+				 NIL_P(segment_size) ? 0 : NUM2SIZET(segment_size));
+
+  /* producers no longer block */
+  while (!XTHREAD_FIFO_RING_EMPTY_P(&que->push_waiters)) {
+    xthread_waiters_signal(&que->push_waiters);
+  }
+  return self;
+}
+
+static VALUE
+xthread_sized_queue_spill_to(int argc, VALUE *argv, VALUE self)
+{
+  VALUE dir;
+  VALUE segment_size;
+  
+  rb_scan_args(argc, argv, "11", &dir, &segment_size);
+  return rb_xthread_sized_queue_spill_to(self, dir, segment_size);
+}
+
+VALUE
+rb_xthread_sized_queue_spilled_length(VALUE self)
+{
+  xthread_sized_queue_t *que;
+  
+  GetXThreadSizedQueuePtr(self, que);
+  return LONG2NUM(que->spill ? xthread_spill_length(que->spill) : 0);
+}
+
+VALUE
+rb_xthread_sized_queue_length(VALUE self)
+{
+  xthread_sized_queue_t *que;
+  long len;
+  
+  GetXThreadSizedQueuePtr(self, que);
+  len = XTHREAD_FIFO_RING_LENGTH(&que->super.elements);
+  if (que->spill) {
+    len += xthread_spill_length(que->spill);
+  }
+  return LONG2NUM(len);
+}
+
+/*
+ * appends +item+, waiting for room.  Returns Qnil if +deadline+ passes
+ * first.
+ */
+static VALUE
+xthread_sized_queue_do_push(VALUE self, VALUE item, int non_block, xthread_hrtime_t deadline)
+{
+  xthread_sized_queue_t *que;
+  xthread_hrtime_t start, now;
+
+  GetXThreadSizedQueuePtr(self, que);
+
+  xthread_queue_check_closed(&que->super);
+  if (que->spill) {
+    if (xthread_spill_length(que->spill) > 0 ||
+	XTHREAD_FIFO_RING_LENGTH(&que->super.elements) >= que->max) {
+      long len;
+
+      xthread_spill_push(que->spill, item);
+      que->super.stats.pushes++;
+      len = XTHREAD_FIFO_RING_LENGTH(&que->super.elements) +
+	xthread_spill_length(que->spill);
+      if (len > que->super.stats.high_water) {
+	que->super.stats.high_water = len;
+      }
+      return self;
+    }
+    return xthread_queue_do_push(self, item);
+  }
+
+  if (XTHREAD_FIFO_RING_LENGTH(&que->super.elements) < que->max) {
+    return xthread_queue_do_push(self, item);
+  }
+  if (que->adaptive_p) {
+    xthread_sized_queue_adapt(que);
+    if (XTHREAD_FIFO_RING_LENGTH(&que->super.elements) < que->max) {
+      return xthread_queue_do_push(self, item);
+    }
+  }
+  if (non_block) {
+    rb_raise(rb_eThreadError, "queue full");
+  }
+  start = rb_xthread_hrtime();
+  que->super.stats.producer_blocks++;
+  XTHREAD_PROBE_QUEUE_BLOCK(self, XTHREAD_FIFO_RING_LENGTH(&que->super.elements), 1);
+  while (XTHREAD_FIFO_RING_LENGTH(&que->super.elements) >= que->max) {
+    int woken = xthread_queue_wait(self, &que->push_waiters, deadline);
+
+    if (!woken || que->super.closed || que->spill) {
+      que->super.stats.producer_block_time += rb_xthread_hrtime() - start;
+      XTHREAD_PROBE_QUEUE_UNBLOCK(self, XTHREAD_FIFO_RING_LENGTH(&que->super.elements),
+				  1, rb_xthread_hrtime() - start);
+      if (!woken) {
+	return Qnil;
+      }
+      xthread_queue_check_closed(&que->super);
+      return xthread_sized_queue_do_push(self, item, 0, deadline);
+    }
+  }
+  now = rb_xthread_hrtime();
+  que->super.stats.producer_block_time += now - start;
+  XTHREAD_PROBE_QUEUE_UNBLOCK(self, XTHREAD_FIFO_RING_LENGTH(&que->super.elements),
+			      1, now - start);
+  if (que->adaptive_p) {
+    que->adaptive.blocked += now - start;
+  }
+  return xthread_queue_do_push(self, item);
 }
 
 VALUE
 rb_xthread_sized_queue_push(VALUE self, VALUE item)
+{
+  return xthread_sized_queue_do_push(self, item, 0, 0);
+}
+
+/*
+ * waits at most +timeout+ seconds for room; nil if there was none.
+ */
+VALUE
+rb_xthread_sized_queue_push_timeout(VALUE self, VALUE item, VALUE timeout)
+{
+  return xthread_sized_queue_do_push(self, item, 0, xthread_queue_deadline(timeout));
+}
+
+/*
+ *  call-seq:
+ *     push(obj, non_block = false, timeout: nil)
+ *
+ *  Appends +obj+, waiting while the queue is full.  With +non_block+
+ *  raises ThreadError instead of waiting.  Returns nil if no room
+ *  became available within +timeout+ seconds.
+ */
+static VALUE
+xthread_sized_queue_push(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[1];
+  VALUE item;
+  VALUE non_block;
+  VALUE opts;
+  VALUE timeout = Qnil;
+  
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("timeout");
+  }
+  rb_scan_args(argc, argv, "11:", &item, &non_block, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &timeout);
+    if (timeout == Qundef) {
+      timeout = Qnil;
+    }
+  }
+  if (RTEST(non_block) && !NIL_P(timeout)) {
+    rb_raise(rb_eArgError, "can't set a timeout if non_block is enabled");
+  }
+  return xthread_sized_queue_do_push(self, item, RTEST(non_block),
+				     xthread_queue_deadline(timeout));
+}
+
+static VALUE
+xthread_sized_queue_enq(VALUE self, VALUE item)
+{
+  return xthread_sized_queue_do_push(self, item, 0, 0);
+}
+
+VALUE
+rb_xthread_sized_queue_close(VALUE self)
 {
   xthread_sized_queue_t *que;
+  GetXThreadSizedQueuePtr(self, que);
+
+  rb_xthread_queue_close(self);
+  xthread_waiters_broadcast(&que->push_waiters);
+  return self;
+}
 
+VALUE
+rb_xthread_sized_queue_clear(VALUE self)
+{
+  xthread_sized_queue_t *que;
+  GetXThreadSizedQueuePtr(self, que);
+
+  xthread_fifo_ring_clear(&que->super.elements);
+  if (que->spill) {
+    while (xthread_spill_length(que->spill) > 0) {
+      xthread_spill_shift(que->spill);
+    }
+  }
+  /* only as many producers as there is now room for */
+  xthread_waiters_signal_n(&que->push_waiters, que->max);
+  return self;
+}
+
+VALUE
+rb_xthread_sized_queue_num_waiting(VALUE self)
+{
+  xthread_sized_queue_t *que;
   GetXThreadSizedQueuePtr(self, que);
 
-  if (NUM2LONG(rb_xthread_fifo_length(que->super.elements)) < que->max) {
-    return rb_xthread_queue_push(self, item);
+  return LONG2NUM(XTHREAD_FIFO_RING_LENGTH(&que->super.waiters) +
+		  XTHREAD_FIFO_RING_LENGTH(&que->push_waiters));
+}
+
+static void
+xthread_sized_queue_popped(VALUE self, xthread_sized_queue_t *que)
+{
+  if (que->adaptive_p) {
+    que->adaptive.pops++;
+    xthread_sized_queue_adapt(que);
   }
-  rb_mutex_lock(que->super.lock);
-  while (NUM2LONG(rb_xthread_fifo_length(que->super.elements)) >= que->max) {
-    rb_xthread_cond_wait(que->cond_wait, que->super.lock, Qnil);
+  if (que->spill) {
+    /* keep the in-memory tier full; spilled items are always newer */
+    while (XTHREAD_FIFO_RING_LENGTH(&que->super.elements) < que->max &&
+	   xthread_spill_length(que->spill) > 0) {
+      xthread_fifo_ring_push(&que->super.elements, self,
+			     xthread_spill_shift(que->spill));
+    }
+  }
+  if (XTHREAD_FIFO_RING_LENGTH(&que->super.elements) < que->max &&
+      !XTHREAD_FIFO_RING_EMPTY_P(&que->push_waiters)) {
+    xthread_waiters_signal(&que->push_waiters);
   }
-  rb_mutex_unlock(que->super.lock);
-  return rb_xthread_queue_push(self, item);
 }
 
 VALUE
@@ -329,11 +1284,11 @@ rb_xthread_sized_queue_pop(VALUE self)
   xthread_sized_queue_t *que;
   GetXThreadSizedQueuePtr(self, que);
 
-  item = rb_xthread_queue_pop(self);
-
-  if (NUM2LONG(rb_xthread_fifo_length(que->super.elements)) < que->max) {
-    rb_xthread_cond_signal(que->cond_wait);
+  item = xthread_queue_do_pop(self, 0, Qnil);
+  if (item == Qundef) {
+    return Qnil;
   }
+  xthread_sized_queue_popped(self, que);
   return item;
 }
 
@@ -344,11 +1299,23 @@ rb_xthread_sized_queue_pop_non_block(VALUE self)
   xthread_sized_queue_t *que;
   GetXThreadSizedQueuePtr(self, que);
 
-  item = rb_xthread_queue_pop_non_block(self);
+  item = xthread_queue_do_pop(self, 1, Qnil);
+  xthread_sized_queue_popped(self, que);
+  return item;
+}
+
+VALUE
+rb_xthread_sized_queue_pop_timeout(VALUE self, VALUE timeout)
+{
+  VALUE item;
+  xthread_sized_queue_t *que;
+  GetXThreadSizedQueuePtr(self, que);
 
-  if (NUM2LONG(rb_xthread_fifo_length(que->super.elements)) < que->max) {
-    rb_xthread_cond_signal(que->cond_wait);
+  item = xthread_queue_do_pop(self, 0, timeout);
+  if (item == Qundef) {
+    return Qnil;
   }
+  xthread_sized_queue_popped(self, que);
   return item;
 }
 
@@ -359,46 +1326,520 @@ xthread_sized_queue_pop(int argc, VALUE *argv, VALUE self)
   xthread_sized_queue_t *que;
   GetXThreadSizedQueuePtr(self, que);
 
-  item = xthread_queue_pop(argc, argv, self);
+  item = xthread_queue_pop_args(argc, argv, self);
+  if (item == Qundef) {
+    return Qnil;
+  }
+  xthread_sized_queue_popped(self, que);
+  return item;
+}
+
+/*
+ * JournalQueue: a Queue of byte strings whose pushes and pops are
+ * logged to a local file (see journal.c) and replayed by new.
+ */
+typedef struct rb_xthread_journal_queue_struct
+{
+  xthread_queue_t super;
+
+  xthread_journal_t *journal;
+} xthread_journal_queue_t;
+
+#define GetXThreadJournalQueuePtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_journal_queue_t, &xthread_journal_queue_data_type, (tobj))
+
+static void
+xthread_journal_queue_mark(void *ptr)
+{
+  xthread_journal_queue_t *que = (xthread_journal_queue_t*)ptr;
+
+  xthread_queue_mark(ptr);
+  if (que->journal) {
+    xthread_journal_mark(que->journal);
+  }
+}
+
+static void
+xthread_journal_queue_compact(void *ptr)
+{
+  xthread_journal_queue_t *que = (xthread_journal_queue_t*)ptr;
+
+  xthread_queue_compact(ptr);
+  if (que->journal) {
+    xthread_journal_compact_refs(que->journal);
+  }
+}
+
+static void
+xthread_journal_queue_free(void *ptr)
+{
+  xthread_journal_queue_t *que = (xthread_journal_queue_t*)ptr;
+  
+  xthread_queue_free_rings(&que->super);
+  if (que->journal) {
+    xthread_journal_free(que->journal);
+  }
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_journal_queue_memsize(const void *ptr)
+{
+  xthread_journal_queue_t *que = (xthread_journal_queue_t*)ptr;
+  
+  return ptr ? sizeof(xthread_journal_queue_t) +
+    xthread_queue_rings_memsize(&que->super) +
+    (que->journal ? xthread_journal_memsize(que->journal) : 0) : 0;
+}
+
+static const rb_data_type_t xthread_journal_queue_data_type = {
+    "xthread_journal_queue",
+    {xthread_journal_queue_mark, xthread_journal_queue_free, xthread_journal_queue_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_journal_queue_compact,
+#endif
+    },
+    &xthread_queue_data_type,
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+
+static VALUE
+xthread_journal_queue_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_journal_queue_t *que;
+
+  obj = TypedData_Make_Struct(klass,
+			      xthread_journal_queue_t, &xthread_journal_queue_data_type, que);
+  xthread_queue_alloc_init(&que->super, "JournalQueue");
+  que->journal = NULL;
+  return obj;
+}
+
+static xthread_journal_queue_t *
+xthread_journal_queue_ptr(VALUE self)
+{
+  xthread_journal_queue_t *que;
+
+  GetXThreadJournalQueuePtr(self, que);
+  if (!que->journal) {
+    rb_raise(rb_eArgError, "uninitialized journal queue");
+  }
+  return que;
+}
+
+/*
+ *  call-seq:
+ *     JournalQueue.new(path, sync = :always)
+ *
+ *  Opens the journal at +path+ and restores the items it holds.  +sync+
+ *  is :always (a push returns once its record is on disk), :none (the
+ *  record is written but never fsynced), or a number of seconds between
+ *  fsyncs.
+ */
+static VALUE
+xthread_journal_queue_initialize(int argc, VALUE *argv, VALUE self)
+{
+  xthread_journal_queue_t *que;
+  VALUE path;
+  VALUE sync;
+  int mode;
+  double interval = 0;
+  
+  GetXThreadJournalQueuePtr(self, que);
+  rb_scan_args(argc, argv, "11", &path, &sync);
+
+  if (que->journal) {
+    rb_raise(rb_eArgError, "journal already opened");
+  }
+  FilePathValue(path);
+  if (NIL_P(sync) || sync == ID2SYM(rb_intern("always"))) {
+    mode = XTHREAD_JOURNAL_SYNC_ALWAYS;
+  }
+  else if (sync == ID2SYM(rb_intern("none"))) {
+    mode = XTHREAD_JOURNAL_SYNC_NONE;
+  }
+  else {
+    mode = XTHREAD_JOURNAL_SYNC_INTERVAL;
+    interval = NUM2DBL(sync);
+  }
+  que->journal = xthread_journal_open(RSTRING_PTR(path), mode, interval,
+				      self, &que->super.elements);
+  return self;
+}
+
+VALUE
+rb_xthread_journal_queue_push(VALUE self, VALUE item)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+
+  StringValue(item);
+  xthread_queue_check_closed(&que->super);
+  xthread_journal_push(self, que->journal, item);
+  return xthread_queue_do_push(self, item);
+}
+
+VALUE
+rb_xthread_journal_queue_pop(VALUE self)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+  VALUE item;
 
-  if (NUM2LONG(rb_xthread_fifo_length(que->super.elements)) < que->max) {
-    rb_xthread_cond_signal(que->cond_wait);
+  item = xthread_queue_do_pop(self, 0, Qnil);
+  if (item == Qundef) {
+    return Qnil;
   }
+  xthread_journal_ack(self, que->journal);
   return item;
 }
+
+VALUE
+rb_xthread_journal_queue_pop_non_block(VALUE self)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+  VALUE item;
+
+  item = xthread_queue_do_pop(self, 1, Qnil);
+  xthread_journal_ack(self, que->journal);
+  return item;
+}
+
+static VALUE
+xthread_journal_queue_pop_timeout(VALUE self, VALUE timeout)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+  VALUE item;
+
+  item = xthread_queue_do_pop(self, 0, timeout);
+  if (item == Qundef) {
+    return Qnil;
+  }
+  xthread_journal_ack(self, que->journal);
+  return item;
+}
+
+static VALUE
+xthread_journal_queue_pop(int argc, VALUE *argv, VALUE self)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+  VALUE item;
+
+  item = xthread_queue_pop_args(argc, argv, self);
+  if (item == Qundef) {
+    return Qnil;
+  }
+  xthread_journal_ack(self, que->journal);
+  return item;
+}
+
+VALUE
+rb_xthread_journal_queue_clear(VALUE self)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+
+  xthread_journal_clear(self, que->journal);
+  return rb_xthread_queue_clear(self);
+}
+
+/*
+ * forces every record logged so far to disk.
+ */
+VALUE
+rb_xthread_journal_queue_sync(VALUE self)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+
+  xthread_journal_sync(self, que->journal);
+  return self;
+}
+
+/*
+ * rewrites the journal with only the live items.  Normally started in
+ * the background once acknowledged records outnumber live ones.
+ */
+VALUE
+rb_xthread_journal_queue_compact(VALUE self)
+{
+  xthread_journal_queue_t *que = xthread_journal_queue_ptr(self);
+
+  xthread_journal_compact(self, que->journal, &que->super.elements);
+  return self;
+}
+#endif
+
+/*
+ * status code API (see xthread.h).  Each call goes through the same
+ * paths as the Ruby methods, so counters, probes, spilling and the
+ * journal all see it.
+ */
+static int
+xthread_queue_kind(VALUE self)
+{
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  if (rb_typeddata_is_kind_of(self, &xthread_sized_queue_data_type)) {
+    return QUEUE_KIND_SIZED;
+  }
+  if (rb_typeddata_is_kind_of(self, &xthread_journal_queue_data_type)) {
+    return QUEUE_KIND_JOURNAL;
+  }
 #endif
+  return QUEUE_KIND_PLAIN;
+}
+
+static void
+xthread_queue_popped(VALUE self, int kind)
+{
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  if (kind == QUEUE_KIND_SIZED) {
+    xthread_sized_queue_t *que;
+
+    GetXThreadSizedQueuePtr(self, que);
+    xthread_sized_queue_popped(self, que);
+  }
+  else if (kind == QUEUE_KIND_JOURNAL) {
+    xthread_journal_ack(self, xthread_journal_queue_ptr(self)->journal);
+  }
+#endif
+}
+
+xthread_status_t
+rb_xthread_queue_try_push(VALUE self, VALUE item)
+{
+  xthread_queue_t *que;
+  
+  GetXThreadQueuePtr(self, que);
+  if (que->closed) {
+    return XTHREAD_CLOSED;
+  }
+  switch (xthread_queue_kind(self)) {
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  case QUEUE_KIND_SIZED:
+    {
+      xthread_sized_queue_t *sq;
+
+      GetXThreadSizedQueuePtr(self, sq);
+      if (XTHREAD_FIFO_RING_LENGTH(&que->elements) >= sq->max ||
+	  (sq->spill && xthread_spill_length(sq->spill) > 0)) {
+	if (!sq->spill) {
+	  return XTHREAD_FULL;
+	}
+	/* goes to the spill tier, which only takes Strings */
+	item = rb_check_string_type(item);
+	if (NIL_P(item)) {
+	  return XTHREAD_INVALID;
+	}
+      }
+      xthread_sized_queue_do_push(self, item, 1, 0);
+    }
+    break;
+  case QUEUE_KIND_JOURNAL:
+    item = rb_check_string_type(item);
+    if (NIL_P(item)) {
+      return XTHREAD_INVALID;
+    }
+    rb_xthread_journal_queue_push(self, item);
+    break;
+#endif
+  default:
+    xthread_queue_do_push(self, item);
+  }
+  return XTHREAD_OK;
+}
+
+xthread_status_t
+rb_xthread_queue_try_pop(VALUE self, VALUE *item)
+{
+  xthread_queue_t *que;
+  
+  GetXThreadQueuePtr(self, que);
+  if (XTHREAD_FIFO_RING_EMPTY_P(&que->elements)) {
+    return que->closed ? XTHREAD_CLOSED : XTHREAD_EMPTY;
+  }
+  *item = xthread_queue_do_pop(self, 1, Qnil);
+  xthread_queue_popped(self, xthread_queue_kind(self));
+  return XTHREAD_OK;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+struct xthread_queue_timed_push_arg {
+  VALUE self;
+  VALUE item;
+  xthread_hrtime_t deadline;
+};
+
+static VALUE
+xthread_queue_timed_push_body(VALUE v_arg)
+{
+  struct xthread_queue_timed_push_arg *arg = (struct xthread_queue_timed_push_arg *)v_arg;
+
+  return xthread_sized_queue_do_push(arg->self, arg->item, 0, arg->deadline);
+}
+
+static VALUE
+xthread_queue_timed_push_closed(VALUE dummy, VALUE exc)
+{
+  return Qundef;
+}
+#endif
+
+xthread_status_t
+rb_xthread_queue_timed_push(VALUE self, VALUE item, double timeout)
+{
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+  struct xthread_queue_timed_push_arg arg;
+  xthread_queue_t *que;
+  VALUE r;
+
+  if (xthread_queue_kind(self) != QUEUE_KIND_SIZED) {
+    return rb_xthread_queue_try_push(self, item);
+  }
+  GetXThreadQueuePtr(self, que);
+  if (que->closed) {
+    return XTHREAD_CLOSED;
+  }
+  arg.self = self;
+  arg.item = item;
+  arg.deadline = timeout < 0 ? 0 :
+    rb_xthread_hrtime() + (xthread_hrtime_t)(timeout * XTHREAD_NSEC_PER_SEC);
+  r = rb_rescue2(xthread_queue_timed_push_body, (VALUE)&arg,
+		 xthread_queue_timed_push_closed, Qnil,
+		 xthread_eClosedQueueError, (VALUE)0);
+  if (r == Qundef) {
+    return XTHREAD_CLOSED;
+  }
+  return NIL_P(r) ? XTHREAD_TIMEOUT : XTHREAD_OK;
+#else
+  return rb_xthread_queue_try_push(self, item);
+#endif
+}
+
+xthread_status_t
+rb_xthread_queue_timed_pop(VALUE self, VALUE *item, double timeout)
+{
+  xthread_queue_t *que;
+  VALUE v;
+  
+  GetXThreadQueuePtr(self, que);
+  v = xthread_queue_do_pop(self, 0, timeout < 0 ? Qnil : DBL2NUM(timeout));
+  if (v == Qundef) {
+    return que->closed && XTHREAD_FIFO_RING_EMPTY_P(&que->elements) ?
+      XTHREAD_CLOSED : XTHREAD_TIMEOUT;
+  }
+  *item = v;
+  xthread_queue_popped(self, xthread_queue_kind(self));
+  return XTHREAD_OK;
+}
+
+long
+rb_xthread_queue_push_batch(VALUE self, const VALUE *items, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++) {
+    if (rb_xthread_queue_try_push(self, items[i]) != XTHREAD_OK) {
+      break;
+    }
+  }
+  return i;
+}
+
+long
+rb_xthread_queue_pop_batch(VALUE self, VALUE *items, long max)
+{
+  long i;
+
+  for (i = 0; i < max; i++) {
+    if (rb_xthread_queue_try_pop(self, &items[i]) != XTHREAD_OK) {
+      break;
+    }
+  }
+  return i;
+}
 
 void
 Init_XThreadQueue()
 {
   rb_cXThreadQueue  = rb_define_class_under(rb_mXThread, "Queue", rb_cObject);
 
+  xthread_eClosedQueueError = rb_path2class("ClosedQueueError");
+  rb_global_variable(&xthread_eClosedQueueError);
+
   rb_define_alloc_func(rb_cXThreadQueue, xthread_queue_alloc);
-  rb_define_method(rb_cXThreadQueue, "initialize", xthread_queue_initialize, 0);
+  rb_define_method(rb_cXThreadQueue, "initialize", xthread_queue_initialize, -1);
   rb_define_method(rb_cXThreadQueue, "pop", xthread_queue_pop, -1);
   rb_define_alias(rb_cXThreadQueue,  "shift", "pop");
   rb_define_alias(rb_cXThreadQueue,  "deq", "pop");
-  rb_define_method(rb_cXThreadQueue, "push", rb_xthread_queue_push, 1);
+  rb_define_method(rb_cXThreadQueue, "push", xthread_queue_do_push, 1);
   rb_define_alias(rb_cXThreadQueue,  "<<", "push");
   rb_define_alias(rb_cXThreadQueue,  "enq", "push");
+  rb_define_method(rb_cXThreadQueue, "requeue_front", rb_xthread_queue_requeue_front, 1);
   rb_define_method(rb_cXThreadQueue, "empty?", rb_xthread_queue_empty_p, 0);
   rb_define_method(rb_cXThreadQueue, "clear", rb_xthread_queue_clear, 0);
   rb_define_method(rb_cXThreadQueue, "length", rb_xthread_queue_length, 0);
   rb_define_alias(rb_cXThreadQueue,  "size", "length");
+  rb_define_method(rb_cXThreadQueue, "close", rb_xthread_queue_close, 0);
+  rb_define_method(rb_cXThreadQueue, "closed?", rb_xthread_queue_closed_p, 0);
+  rb_define_method(rb_cXThreadQueue, "num_waiting", rb_xthread_queue_num_waiting, 0);
+  rb_define_method(rb_cXThreadQueue, "enable_latency_tracking",
+		   rb_xthread_queue_enable_latency_tracking, 0);
+  rb_define_method(rb_cXThreadQueue, "disable_latency_tracking",
+		   rb_xthread_queue_disable_latency_tracking, 0);
+  rb_define_method(rb_cXThreadQueue, "latency_tracking?",
+		   rb_xthread_queue_latency_tracking_p, 0);
+  rb_define_method(rb_cXThreadQueue, "latency_percentiles",
+		   xthread_queue_latency_percentiles, -1);
+  rb_define_method(rb_cXThreadQueue, "latency_count", rb_xthread_queue_latency_count, 0);
+  rb_define_method(rb_cXThreadQueue, "reset_latency", rb_xthread_queue_reset_latency, 0);
+  rb_define_method(rb_cXThreadQueue, "stats", rb_xthread_queue_stats, 0);
+  rb_define_method(rb_cXThreadQueue, "metrics_name", rb_xthread_queue_metrics_name, 0);
+  rb_define_method(rb_cXThreadQueue, "metrics_name=", rb_xthread_queue_set_metrics_name, 1);
+  rb_define_module_function(rb_mXThread, "queue_stats", xthread_s_queue_stats, 0);
 
 #ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
   rb_cXThreadSizedQueue  = rb_define_class_under(rb_mXThread, "SizedQueue", rb_cXThreadQueue);
 
   rb_define_alloc_func(rb_cXThreadSizedQueue, xthread_sized_queue_alloc);
   rb_define_method(rb_cXThreadSizedQueue, "initialize", xthread_sized_queue_initialize, 1);
-  rb_define_method(rb_cXThreadSizedQueue, "pop", xthread_sized_queue_pop, 0);
+  rb_define_method(rb_cXThreadSizedQueue, "pop", xthread_sized_queue_pop, -1);
   rb_define_alias(rb_cXThreadSizedQueue,  "shift", "pop");
   rb_define_alias(rb_cXThreadSizedQueue,  "deq", "pop");
-  rb_define_method(rb_cXThreadSizedQueue, "push", rb_xthread_sized_queue_push, 1);
-  rb_define_alias(rb_cXThreadSizedQueue,  "<<", "push");
+  rb_define_method(rb_cXThreadSizedQueue, "push", xthread_sized_queue_push, -1);
+  rb_define_method(rb_cXThreadSizedQueue, "<<", xthread_sized_queue_enq, 1);
   rb_define_alias(rb_cXThreadSizedQueue,  "enq", "push");
+  rb_define_method(rb_cXThreadSizedQueue, "close", rb_xthread_sized_queue_close, 0);
+  rb_define_method(rb_cXThreadSizedQueue, "clear", rb_xthread_sized_queue_clear, 0);
+  rb_define_method(rb_cXThreadSizedQueue, "num_waiting", rb_xthread_sized_queue_num_waiting, 0);
 
   rb_define_method(rb_cXThreadSizedQueue, "max", rb_xthread_sized_queue_max, 0);
   rb_define_method(rb_cXThreadSizedQueue, "max=", rb_xthread_sized_queue_set_max, 1);
+  rb_define_method(rb_cXThreadSizedQueue, "enable_adaptive",
+		   rb_xthread_sized_queue_enable_adaptive, 3);
+  rb_define_method(rb_cXThreadSizedQueue, "disable_adaptive",
+		   rb_xthread_sized_queue_disable_adaptive, 0);
+  rb_define_method(rb_cXThreadSizedQueue, "adaptive?",
+		   rb_xthread_sized_queue_adaptive_p, 0);
+  rb_define_method(rb_cXThreadSizedQueue, "spill_to", xthread_sized_queue_spill_to, -1);
+  rb_define_method(rb_cXThreadSizedQueue, "spilled_length",
+		   rb_xthread_sized_queue_spilled_length, 0);
+  rb_define_method(rb_cXThreadSizedQueue, "length", rb_xthread_sized_queue_length, 0);
+  rb_define_alias(rb_cXThreadSizedQueue,  "size", "length");
+
+  rb_cXThreadJournalQueue  = rb_define_class_under(rb_mXThread, "JournalQueue", rb_cXThreadQueue);
+
+  rb_define_alloc_func(rb_cXThreadJournalQueue, xthread_journal_queue_alloc);
+  rb_define_method(rb_cXThreadJournalQueue, "initialize", xthread_journal_queue_initialize, -1);
+  /* a popped entry is already acked in the journal */
+  rb_undef_method(rb_cXThreadJournalQueue, "requeue_front");
+  rb_define_method(rb_cXThreadJournalQueue, "pop", xthread_journal_queue_pop, -1);
+  rb_define_alias(rb_cXThreadJournalQueue,  "shift", "pop");
+  rb_define_alias(rb_cXThreadJournalQueue,  "deq", "pop");
+  rb_define_method(rb_cXThreadJournalQueue, "push", rb_xthread_journal_queue_push, 1);
+  rb_define_alias(rb_cXThreadJournalQueue,  "<<", "push");
+  rb_define_alias(rb_cXThreadJournalQueue,  "enq", "push");
+  rb_define_method(rb_cXThreadJournalQueue, "clear", rb_xthread_journal_queue_clear, 0);
+  rb_define_method(rb_cXThreadJournalQueue, "sync", rb_xthread_journal_queue_sync, 0);
+  rb_define_method(rb_cXThreadJournalQueue, "compact", rb_xthread_journal_queue_compact, 0);
 #endif
 }
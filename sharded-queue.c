@@ -0,0 +1,521 @@
+/**********************************************************************
+
+  sharded-queue.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+VALUE rb_cXThreadShardedQueue;
+
+static VALUE xthread_eClosedQueueError;
+static ID id_producer_slot;
+static long xthread_sharded_queue_slots;
+
+/*
+ * ShardedQueue spreads its items over several lanes.  A producer
+ * thread always pushes into the same lane (chosen by a slot number it
+ * gets on its first push), so each producer's items stay in order.
+ * Consumers start at a rotating lane and take from the first lane that
+ * has an item.
+ *
+ * In ordered mode every item is preceded in its lane by a Fixnum
+ * sequence number, and consumers take the lane head with the lowest
+ * one, which gives global FIFO order.
+ */
+typedef struct rb_xthread_sharded_queue_struct
+{
+  long nlanes;
+  xthread_fifo_t *lanes;
+  long length;
+  long cursor;
+
+  /* lane of the last pushing thread; compared only, never marked */
+  VALUE last_producer;
+  xthread_fifo_t *last_lane;
+
+  int ordered;
+  long seq;
+
+  xthread_fifo_t waiters;
+  int closed;
+} xthread_sharded_queue_t;
+
+#define SHARDED_QUEUE_DEFAULT_LANES 8
+
+#define GetXThreadShardedQueuePtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_sharded_queue_t, &xthread_sharded_queue_data_type, (tobj))
+
+static void
+xthread_sharded_queue_mark(void *ptr)
+{
+  xthread_sharded_queue_t *que = (xthread_sharded_queue_t*)ptr;
+  long i;
+
+  for (i = 0; i < que->nlanes; i++) {
+    xthread_fifo_ring_mark(&que->lanes[i]);
+  }
+  xthread_fifo_ring_mark(&que->waiters);
+}
+
+static void
+xthread_sharded_queue_compact(void *ptr)
+{
+  xthread_sharded_queue_t *que = (xthread_sharded_queue_t*)ptr;
+  long i;
+
+  for (i = 0; i < que->nlanes; i++) {
+    xthread_fifo_ring_compact(&que->lanes[i]);
+  }
+  xthread_fifo_ring_compact(&que->waiters);
+}
+
+static void
+xthread_sharded_queue_free(void *ptr)
+{
+  xthread_sharded_queue_t *que = (xthread_sharded_queue_t*)ptr;
+  long i;
+
+  for (i = 0; i < que->nlanes; i++) {
+    xthread_fifo_ring_free(&que->lanes[i]);
+  }
+  if (que->lanes) {
+    ruby_xfree(que->lanes);
+  }
+  xthread_fifo_ring_free(&que->waiters);
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_sharded_queue_memsize(const void *ptr)
+{
+  xthread_sharded_queue_t *que = (xthread_sharded_queue_t*)ptr;
+  size_t size;
+  long i;
+
+  if (!ptr) {
+    return 0;
+  }
+  size = sizeof(xthread_sharded_queue_t) + que->nlanes * sizeof(xthread_fifo_t) +
+    que->waiters.capa * sizeof(VALUE);
+  for (i = 0; i < que->nlanes; i++) {
+    size += que->lanes[i].capa * sizeof(VALUE);
+  }
+  return size;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_sharded_queue_data_type = {
+    "xthread_sharded_queue",
+    {xthread_sharded_queue_mark, xthread_sharded_queue_free, xthread_sharded_queue_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_sharded_queue_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_sharded_queue_data_type = {
+    "xthread_sharded_queue",
+    xthread_sharded_queue_mark,
+    xthread_sharded_queue_free,
+    xthread_sharded_queue_memsize,
+};
+#endif
+
+static VALUE
+xthread_sharded_queue_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_sharded_queue_t *que;
+
+  obj = TypedData_Make_Struct(klass, xthread_sharded_queue_t,
+			      &xthread_sharded_queue_data_type, que);
+  que->nlanes = 0;
+  que->lanes = NULL;
+  que->length = 0;
+  que->cursor = 0;
+  que->last_producer = Qnil;
+  que->last_lane = NULL;
+  que->ordered = 0;
+  que->seq = 0;
+  xthread_fifo_ring_init(&que->waiters);
+  que->closed = 0;
+  return obj;
+}
+
+static void
+xthread_sharded_queue_setup(xthread_sharded_queue_t *que, long nlanes, int ordered)
+{
+  long i;
+
+  if (nlanes <= 0) {
+    rb_raise(rb_eArgError, "number of lanes must be positive");
+  }
+  if (que->lanes) {
+    rb_raise(rb_eArgError, "already initialized");
+  }
+  que->lanes = ALLOC_N(xthread_fifo_t, nlanes);
+  for (i = 0; i < nlanes; i++) {
+    xthread_fifo_ring_init(&que->lanes[i]);
+  }
+  que->nlanes = nlanes;
+  que->ordered = ordered;
+}
+
+/*
+ *  call-seq:
+ *     ShardedQueue.new(lanes = 8, ordered: false)
+ *
+ *  Creates a queue of +lanes+ lanes.  With +ordered+ items come out in
+ *  global push order; otherwise only the items of each producer thread
+ *  keep their order.
+ */
+static VALUE
+xthread_sharded_queue_initialize(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[1];
+  xthread_sharded_queue_t *que;
+  VALUE v_lanes;
+  VALUE opts;
+  VALUE ordered = Qundef;
+
+  GetXThreadShardedQueuePtr(self, que);
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("ordered");
+  }
+  rb_scan_args(argc, argv, "01:", &v_lanes, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &ordered);
+  }
+  xthread_sharded_queue_setup(que,
+			      NIL_P(v_lanes) ? SHARDED_QUEUE_DEFAULT_LANES : NUM2LONG(v_lanes),
+			      ordered != Qundef && RTEST(ordered));
+  return self;
+}
+
+VALUE
+rb_xthread_sharded_queue_new(long nlanes, int ordered)
+{
+  VALUE self = xthread_sharded_queue_alloc(rb_cXThreadShardedQueue);
+  xthread_sharded_queue_t *que;
+
+  GetXThreadShardedQueuePtr(self, que);
+  xthread_sharded_queue_setup(que, nlanes, ordered);
+  return self;
+}
+
+static xthread_sharded_queue_t *
+xthread_sharded_queue_ptr(VALUE self)
+{
+  xthread_sharded_queue_t *que;
+
+  GetXThreadShardedQueuePtr(self, que);
+  if (!que->lanes) {
+    rb_raise(rb_eTypeError, "uninitialized ShardedQueue");
+  }
+  return que;
+}
+
+/*
+ * lane of the current thread.  A thread keeps pushing until the GVL
+ * moves on, so the last answer is remembered to skip the thread-local
+ * lookup.
+ */
+static xthread_fifo_t *
+xthread_sharded_queue_lane(xthread_sharded_queue_t *que)
+{
+  VALUE th = rb_thread_current();
+  VALUE slot;
+
+  if (th == que->last_producer) {
+    return que->last_lane;
+  }
+  slot = rb_thread_local_aref(th, id_producer_slot);
+  if (NIL_P(slot)) {
+    slot = LONG2FIX(xthread_sharded_queue_slots++ & FIXNUM_MAX);
+    rb_thread_local_aset(th, id_producer_slot, slot);
+  }
+  que->last_producer = th;
+  que->last_lane = &que->lanes[FIX2LONG(slot) % que->nlanes];
+  return que->last_lane;
+}
+
+VALUE
+rb_xthread_sharded_queue_push(VALUE self, VALUE item)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+  xthread_fifo_t *lane;
+
+  if (que->closed) {
+    rb_raise(xthread_eClosedQueueError, "queue closed");
+  }
+  lane = xthread_sharded_queue_lane(que);
+  if (que->ordered) {
+    xthread_fifo_ring_push(lane, self, LONG2FIX(que->seq++ & FIXNUM_MAX));
+  }
+  xthread_fifo_ring_push(lane, self, item);
+  que->length++;
+  if (!XTHREAD_FIFO_RING_EMPTY_P(&que->waiters)) {
+    xthread_waiters_signal(&que->waiters);
+  }
+  return self;
+}
+
+/* takes an item; the queue must not be empty */
+static VALUE
+xthread_sharded_queue_take(xthread_sharded_queue_t *que)
+{
+  xthread_fifo_t *lane = NULL;
+  long i;
+
+  if (que->ordered) {
+    long min = 0;
+
+    for (i = 0; i < que->nlanes; i++) {
+      xthread_fifo_t *l = &que->lanes[i];
+      long seq;
+
+      if (XTHREAD_FIFO_RING_EMPTY_P(l)) {
+	continue;
+      }
+      seq = FIX2LONG(l->elements[XTHREAD_FIFO_RING_INDEX(l, 0)]);
+      if (!lane || seq < min) {
+	lane = l;
+	min = seq;
+      }
+    }
+    xthread_fifo_ring_pop(lane);
+  }
+  else {
+    for (i = 0; i < que->nlanes; i++) {
+      lane = &que->lanes[(que->cursor + i) % que->nlanes];
+      if (!XTHREAD_FIFO_RING_EMPTY_P(lane)) {
+	break;
+      }
+    }
+    que->cursor = (que->cursor + 1) % que->nlanes;
+  }
+  que->length--;
+  return xthread_fifo_ring_pop(lane);
+}
+
+/*
+ * waits on the consumer list until woken or +deadline+ passes.
+ * Returns 0 once the deadline has passed.
+ */
+static int
+xthread_sharded_queue_wait(VALUE self, xthread_sharded_queue_t *que, xthread_hrtime_t deadline)
+{
+  xthread_hrtime_t now;
+
+  if (deadline == 0) {
+    xthread_waiters_wait(self, &que->waiters);
+    return 1;
+  }
+  now = rb_xthread_hrtime();
+  if (now >= deadline) {
+    return 0;
+  }
+  xthread_waiters_wait_for(self, &que->waiters, (double)(deadline - now) / XTHREAD_NSEC_PER_SEC);
+  return 1;
+}
+
+static VALUE
+xthread_sharded_queue_do_pop(VALUE self, int non_block, VALUE timeout)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+  xthread_hrtime_t deadline = 0;
+
+  if (que->length == 0) {
+    if (non_block) {
+      rb_raise(rb_eThreadError, "queue empty");
+    }
+    if (!NIL_P(timeout)) {
+      double t = NUM2DBL(timeout);
+
+      deadline = rb_xthread_hrtime() +
+	(t > 0 ? (xthread_hrtime_t)(t * XTHREAD_NSEC_PER_SEC) : 0);
+    }
+    while (que->length == 0) {
+      if (que->closed || !xthread_sharded_queue_wait(self, que, deadline)) {
+	return Qnil;
+      }
+    }
+  }
+  return xthread_sharded_queue_take(que);
+}
+
+VALUE
+rb_xthread_sharded_queue_pop(VALUE self)
+{
+  return xthread_sharded_queue_do_pop(self, 0, Qnil);
+}
+
+VALUE
+rb_xthread_sharded_queue_pop_non_block(VALUE self)
+{
+  return xthread_sharded_queue_do_pop(self, 1, Qnil);
+}
+
+/*
+ *  call-seq:
+ *     pop(non_block = false, timeout: nil)
+ *
+ *  Takes an item, waiting for one while the queue is empty.  Behaves
+ *  like Queue#pop.
+ */
+static VALUE
+xthread_sharded_queue_pop(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[1];
+  VALUE non_block;
+  VALUE opts;
+  VALUE timeout = Qnil;
+
+  if (!keywords[0]) {
+    keywords[0] = rb_intern("timeout");
+  }
+  rb_scan_args(argc, argv, "01:", &non_block, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, keywords, 0, 1, &timeout);
+    if (timeout == Qundef) {
+      timeout = Qnil;
+    }
+  }
+  if (RTEST(non_block) && !NIL_P(timeout)) {
+    rb_raise(rb_eArgError, "can't set a timeout if non_block is enabled");
+  }
+  return xthread_sharded_queue_do_pop(self, RTEST(non_block), timeout);
+}
+
+VALUE
+rb_xthread_sharded_queue_close(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  que->closed = 1;
+  xthread_waiters_broadcast(&que->waiters);
+  return self;
+}
+
+VALUE
+rb_xthread_sharded_queue_closed_p(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  return que->closed ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_sharded_queue_clear(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+  long i;
+
+  for (i = 0; i < que->nlanes; i++) {
+    xthread_fifo_ring_clear(&que->lanes[i]);
+  }
+  que->length = 0;
+  return self;
+}
+
+VALUE
+rb_xthread_sharded_queue_length(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  return LONG2NUM(que->length);
+}
+
+VALUE
+rb_xthread_sharded_queue_empty_p(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  return que->length == 0 ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_sharded_queue_num_waiting(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  return LONG2NUM(XTHREAD_FIFO_RING_LENGTH(&que->waiters));
+}
+
+VALUE
+rb_xthread_sharded_queue_lanes(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  return LONG2NUM(que->nlanes);
+}
+
+VALUE
+rb_xthread_sharded_queue_ordered_p(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+
+  return que->ordered ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     lane_lengths
+ *
+ *  Returns the number of items in each lane, to check the spread.
+ */
+VALUE
+rb_xthread_sharded_queue_lane_lengths(VALUE self)
+{
+  xthread_sharded_queue_t *que = xthread_sharded_queue_ptr(self);
+  VALUE ary = rb_ary_new_capa(que->nlanes);
+  long i;
+
+  for (i = 0; i < que->nlanes; i++) {
+    long len = XTHREAD_FIFO_RING_LENGTH(&que->lanes[i]);
+
+    rb_ary_push(ary, LONG2NUM(que->ordered ? len / 2 : len));
+  }
+  return ary;
+}
+
+void
+Init_XThreadShardedQueue()
+{
+  rb_cXThreadShardedQueue = rb_define_class_under(rb_mXThread, "ShardedQueue", rb_cObject);
+
+  xthread_eClosedQueueError = rb_path2class("ClosedQueueError");
+  rb_global_variable(&xthread_eClosedQueueError);
+  id_producer_slot = rb_intern("__xthread_producer_slot__");
+
+  rb_define_alloc_func(rb_cXThreadShardedQueue, xthread_sharded_queue_alloc);
+  rb_define_method(rb_cXThreadShardedQueue, "initialize", xthread_sharded_queue_initialize, -1);
+  rb_define_method(rb_cXThreadShardedQueue, "push", rb_xthread_sharded_queue_push, 1);
+  rb_define_alias(rb_cXThreadShardedQueue,  "<<", "push");
+  rb_define_alias(rb_cXThreadShardedQueue,  "enq", "push");
+  rb_define_method(rb_cXThreadShardedQueue, "pop", xthread_sharded_queue_pop, -1);
+  rb_define_alias(rb_cXThreadShardedQueue,  "shift", "pop");
+  rb_define_alias(rb_cXThreadShardedQueue,  "deq", "pop");
+  rb_define_method(rb_cXThreadShardedQueue, "close", rb_xthread_sharded_queue_close, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "closed?", rb_xthread_sharded_queue_closed_p, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "clear", rb_xthread_sharded_queue_clear, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "length", rb_xthread_sharded_queue_length, 0);
+  rb_define_alias(rb_cXThreadShardedQueue,  "size", "length");
+  rb_define_method(rb_cXThreadShardedQueue, "empty?", rb_xthread_sharded_queue_empty_p, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "num_waiting",
+		   rb_xthread_sharded_queue_num_waiting, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "lanes", rb_xthread_sharded_queue_lanes, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "ordered?", rb_xthread_sharded_queue_ordered_p, 0);
+  rb_define_method(rb_cXThreadShardedQueue, "lane_lengths",
+		   rb_xthread_sharded_queue_lane_lengths, 0);
+}
@@ -0,0 +1,748 @@
+/**********************************************************************
+
+  sorted-list.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+VALUE rb_cXThreadSortedList;
+
+static ID id_cmp;
+static ID id_call;
+
+/*
+ * SortedList is a skip list kept in ascending key order.  The key of
+ * an element is the element itself, or what the block given to new
+ * returns for it; keys are compared with a C comparator when one was
+ * given, directly when both are Fixnums or both Floats, and with <=>
+ * otherwise.  Every node also gets an insertion number, so equal keys
+ * stay in insertion order and (key, seq) is a total order.
+ *
+ * <=> and the key block may switch threads.  A search therefore
+ * remembers the list's serial, which every change bumps, and starts
+ * over when it moved while Ruby code ran; iteration resumes after the
+ * (key, seq) of the last yielded node the same way.
+ */
+#define SORTED_LIST_MAX_LEVEL 32
+
+typedef struct xthread_sorted_list_node_struct
+{
+  VALUE key;
+  VALUE element;
+  unsigned LONG_LONG seq;
+  struct xthread_sorted_list_node_struct *prev;
+  int level;
+  struct xthread_sorted_list_node_struct *next[1];
+} xthread_sorted_list_node_t;
+
+typedef struct rb_xthread_sorted_list_struct
+{
+  xthread_sorted_list_node_t *head;
+  xthread_sorted_list_node_t *tail;
+  int level;
+  long length;
+  long links;
+
+  unsigned LONG_LONG seq;
+  unsigned long serial;
+  unsigned LONG_LONG rand;
+
+  VALUE key_proc;
+  int (*cmp)(VALUE, VALUE);
+} xthread_sorted_list_t;
+
+#define SORTED_LIST_NODE_SIZE(level) \
+  (offsetof(xthread_sorted_list_node_t, next) + (level) * sizeof(xthread_sorted_list_node_t*))
+
+#define GetXThreadSortedListPtr(obj, tobj) \
+  TypedData_Get_Struct((obj), xthread_sorted_list_t, &xthread_sorted_list_data_type, (tobj))
+
+static void
+xthread_sorted_list_mark(void *ptr)
+{
+  xthread_sorted_list_t *sl = (xthread_sorted_list_t*)ptr;
+  xthread_sorted_list_node_t *node;
+
+  for (node = sl->head->next[0]; node != NULL; node = node->next[0]) {
+    rb_gc_mark_movable(node->key);
+    rb_gc_mark_movable(node->element);
+  }
+  rb_gc_mark_movable(sl->key_proc);
+}
+
+static void
+xthread_sorted_list_compact(void *ptr)
+{
+  xthread_sorted_list_t *sl = (xthread_sorted_list_t*)ptr;
+  xthread_sorted_list_node_t *node;
+
+  for (node = sl->head->next[0]; node != NULL; node = node->next[0]) {
+    node->key = rb_gc_location(node->key);
+    node->element = rb_gc_location(node->element);
+  }
+  sl->key_proc = rb_gc_location(sl->key_proc);
+}
+
+static void
+xthread_sorted_list_free_nodes(xthread_sorted_list_t *sl)
+{
+  xthread_sorted_list_node_t *node;
+  xthread_sorted_list_node_t *next;
+
+  for (node = sl->head->next[0]; node != NULL; node = next) {
+    next = node->next[0];
+    ruby_xfree(node);
+  }
+}
+
+static void
+xthread_sorted_list_free(void *ptr)
+{
+  xthread_sorted_list_t *sl = (xthread_sorted_list_t*)ptr;
+
+  xthread_sorted_list_free_nodes(sl);
+  ruby_xfree(sl->head);
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_sorted_list_memsize(const void *ptr)
+{
+  xthread_sorted_list_t *sl = (xthread_sorted_list_t*)ptr;
+
+  if (!ptr) {
+    return 0;
+  }
+  return sizeof(xthread_sorted_list_t) + SORTED_LIST_NODE_SIZE(SORTED_LIST_MAX_LEVEL) +
+    sl->length * SORTED_LIST_NODE_SIZE(0) + sl->links * sizeof(xthread_sorted_list_node_t*);
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_sorted_list_data_type = {
+    "xthread_sorted_list",
+    {xthread_sorted_list_mark, xthread_sorted_list_free, xthread_sorted_list_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_sorted_list_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_sorted_list_data_type = {
+    "xthread_sorted_list",
+    xthread_sorted_list_mark,
+    xthread_sorted_list_free,
+    xthread_sorted_list_memsize,
+};
+#endif
+
+static VALUE
+xthread_sorted_list_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_sorted_list_t *sl;
+
+  obj = TypedData_Make_Struct(klass, xthread_sorted_list_t, &xthread_sorted_list_data_type, sl);
+  sl->head = ruby_xcalloc(1, SORTED_LIST_NODE_SIZE(SORTED_LIST_MAX_LEVEL));
+  sl->head->key = Qnil;
+  sl->head->element = Qnil;
+  sl->head->level = SORTED_LIST_MAX_LEVEL;
+  sl->tail = NULL;
+  sl->level = 1;
+  sl->length = 0;
+  sl->links = 0;
+  sl->seq = 0;
+  sl->serial = 0;
+  sl->rand = (unsigned LONG_LONG)rb_xthread_hrtime() ^ (unsigned LONG_LONG)(VALUE)sl;
+  if (sl->rand == 0) {
+    sl->rand = 0x9e3779b97f4a7c15ULL;
+  }
+  sl->key_proc = Qnil;
+  sl->cmp = NULL;
+  return obj;
+}
+
+/* level of a new node: each further level with probability 1/4 */
+static int
+xthread_sorted_list_random_level(xthread_sorted_list_t *sl)
+{
+  unsigned LONG_LONG r;
+  int level = 1;
+
+  r = sl->rand;
+  r ^= r << 13;
+  r ^= r >> 7;
+  r ^= r << 17;
+  sl->rand = r;
+
+  while (level < SORTED_LIST_MAX_LEVEL && (r & 3) == 0) {
+    level++;
+    r >>= 2;
+  }
+  return level;
+}
+
+static int
+xthread_sorted_list_cmp(xthread_sorted_list_t *sl, VALUE a, VALUE b)
+{
+  if (sl->cmp) {
+    return sl->cmp(a, b);
+  }
+  if (FIXNUM_P(a) && FIXNUM_P(b)) {
+    long x = FIX2LONG(a), y = FIX2LONG(b);
+
+    return x < y ? -1 : x > y;
+  }
+  if (RB_FLOAT_TYPE_P(a) && RB_FLOAT_TYPE_P(b)) {
+    double x = RFLOAT_VALUE(a), y = RFLOAT_VALUE(b);
+
+    if (x < y) return -1;
+    if (x > y) return 1;
+    if (x == y) return 0;
+    /* NaN: let <=> raise */
+  }
+  return rb_cmpint(rb_funcall(a, id_cmp, 1, b), a, b);
+}
+
+static VALUE
+xthread_sorted_list_key(xthread_sorted_list_t *sl, VALUE item)
+{
+  if (NIL_P(sl->key_proc)) {
+    return item;
+  }
+  return rb_funcall(sl->key_proc, id_call, 1, item);
+}
+
+/*
+ * last node ordered at or before (key, seq), the head if none.  With
+ * update the predecessor on every level is stored there too.  seq 0
+ * finds the node before the first one with an equal key.
+ */
+static xthread_sorted_list_node_t *
+xthread_sorted_list_search(xthread_sorted_list_t *sl, VALUE key, unsigned LONG_LONG seq,
+			   xthread_sorted_list_node_t **update)
+{
+  xthread_sorted_list_node_t *x;
+  xthread_sorted_list_node_t *next;
+  unsigned long serial;
+  unsigned LONG_LONG next_seq;
+  VALUE next_key;
+  int i, c;
+
+ retry:
+  serial = sl->serial;
+  x = sl->head;
+  for (i = sl->level - 1; i >= 0; i--) {
+    while ((next = x->next[i]) != NULL) {
+      next_key = next->key;
+      next_seq = next->seq;
+      c = xthread_sorted_list_cmp(sl, next_key, key);
+      if (sl->serial != serial) {
+	goto retry;
+      }
+      if (c > 0 || (c == 0 && next_seq > seq)) {
+	break;
+      }
+      x = next;
+    }
+    if (update) {
+      update[i] = x;
+    }
+  }
+  return x;
+}
+
+static void
+xthread_sorted_list_unlink(xthread_sorted_list_t *sl, xthread_sorted_list_node_t *node,
+			   xthread_sorted_list_node_t **update)
+{
+  int i;
+
+  for (i = 0; i < node->level; i++) {
+    update[i]->next[i] = node->next[i];
+  }
+  if (node->next[0]) {
+    node->next[0]->prev = node->prev;
+  }
+  else {
+    sl->tail = node->prev == sl->head ? NULL : node->prev;
+  }
+  while (sl->level > 1 && sl->head->next[sl->level - 1] == NULL) {
+    sl->level--;
+  }
+  sl->length--;
+  sl->links -= node->level;
+  sl->serial++;
+  ruby_xfree(node);
+}
+
+/* predecessors of a node found by walking each level from the head side */
+static void
+xthread_sorted_list_predecessors(xthread_sorted_list_t *sl, xthread_sorted_list_node_t *node,
+				 xthread_sorted_list_node_t **update)
+{
+  int i;
+
+  for (i = 0; i < node->level; i++) {
+    while (update[i]->next[i] != node) {
+      update[i] = update[i]->next[i];
+    }
+  }
+}
+
+static VALUE
+xthread_sorted_list_push_key(VALUE self, VALUE key, VALUE item)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *update[SORTED_LIST_MAX_LEVEL];
+  xthread_sorted_list_node_t *node;
+  unsigned LONG_LONG seq;
+  int level, i;
+
+  GetXThreadSortedListPtr(self, sl);
+
+  seq = ++sl->seq;
+  xthread_sorted_list_search(sl, key, seq, update);
+
+  level = xthread_sorted_list_random_level(sl);
+  for (i = sl->level; i < level; i++) {
+    update[i] = sl->head;
+  }
+
+  node = ruby_xmalloc(SORTED_LIST_NODE_SIZE(level));
+  node->key = Qnil;
+  node->element = Qnil;
+  node->seq = seq;
+  node->level = level;
+  for (i = 0; i < level; i++) {
+    node->next[i] = update[i]->next[i];
+    update[i]->next[i] = node;
+  }
+  node->prev = update[0];
+  if (node->next[0]) {
+    node->next[0]->prev = node;
+  }
+  else {
+    sl->tail = node;
+  }
+  RB_OBJ_WRITE(self, &node->key, key);
+  RB_OBJ_WRITE(self, &node->element, item);
+
+  if (level > sl->level) {
+    sl->level = level;
+  }
+  sl->length++;
+  sl->links += level;
+  sl->serial++;
+  return self;
+}
+
+static VALUE
+xthread_sorted_list_initialize(int argc, VALUE *argv, VALUE self)
+{
+  xthread_sorted_list_t *sl;
+  int i;
+
+  GetXThreadSortedListPtr(self, sl);
+  if (rb_block_given_p()) {
+    RB_OBJ_WRITE(self, &sl->key_proc, rb_block_proc());
+  }
+  for (i = 0; i < argc; i++) {
+    rb_xthread_sorted_list_push(self, argv[i]);
+  }
+  return self;
+}
+
+VALUE
+rb_xthread_sorted_list_new(void)
+{
+  return xthread_sorted_list_alloc(rb_cXThreadSortedList);
+}
+
+/*
+ * list ordered by a C comparator on the elements, returning <0, 0 or
+ * >0 like strcmp.  It must not call back into Ruby.
+ */
+VALUE
+rb_xthread_sorted_list_new_with_cmp(int (*cmp)(VALUE, VALUE))
+{
+  VALUE self;
+  xthread_sorted_list_t *sl;
+
+  self = rb_xthread_sorted_list_new();
+  GetXThreadSortedListPtr(self, sl);
+  sl->cmp = cmp;
+  return self;
+}
+
+/*
+ *  call-seq:
+ *     push(obj)
+ *
+ *  Inserts +obj+ after the elements whose key is less than or equal to
+ *  its key.  O(log n).
+ */
+VALUE
+rb_xthread_sorted_list_push(VALUE self, VALUE item)
+{
+  xthread_sorted_list_t *sl;
+
+  GetXThreadSortedListPtr(self, sl);
+  return xthread_sorted_list_push_key(self, xthread_sorted_list_key(sl, item), item);
+}
+
+/*
+ *  call-seq:
+ *     delete(obj)
+ *
+ *  Removes the first element with the key of +obj+ that is == +obj+,
+ *  and returns it; nil when there is none.  O(log n) plus the run of
+ *  equal keys.
+ */
+VALUE
+rb_xthread_sorted_list_delete(VALUE self, VALUE item)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *update[SORTED_LIST_MAX_LEVEL];
+  xthread_sorted_list_node_t *node;
+  unsigned long serial;
+  VALUE key;
+  VALUE element;
+  int c, eq;
+
+  GetXThreadSortedListPtr(self, sl);
+  key = xthread_sorted_list_key(sl, item);
+
+ retry:
+  xthread_sorted_list_search(sl, key, 0, update);
+  serial = sl->serial;
+  for (node = update[0]->next[0]; node != NULL; node = node->next[0]) {
+    element = node->element;
+    c = xthread_sorted_list_cmp(sl, node->key, key);
+    if (sl->serial != serial) {
+      goto retry;
+    }
+    if (c != 0) {
+      break;
+    }
+    eq = element == item || rb_equal(element, item);
+    if (sl->serial != serial) {
+      goto retry;
+    }
+    if (eq) {
+      xthread_sorted_list_predecessors(sl, node, update);
+      xthread_sorted_list_unlink(sl, node, update);
+      return element;
+    }
+  }
+  return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     first -> obj or nil
+ *
+ *  The element with the smallest key.
+ */
+VALUE
+rb_xthread_sorted_list_first(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+
+  GetXThreadSortedListPtr(self, sl);
+  if (sl->head->next[0] == NULL) {
+    return Qnil;
+  }
+  return sl->head->next[0]->element;
+}
+
+/*
+ *  call-seq:
+ *     last -> obj or nil
+ *
+ *  The element with the largest key.
+ */
+VALUE
+rb_xthread_sorted_list_last(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+
+  GetXThreadSortedListPtr(self, sl);
+  if (sl->tail == NULL) {
+    return Qnil;
+  }
+  return sl->tail->element;
+}
+
+/*
+ *  call-seq:
+ *     pop_min -> obj or nil
+ *     shift -> obj or nil
+ *
+ *  Removes and returns the element with the smallest key.  O(1)
+ *  expected.
+ */
+VALUE
+rb_xthread_sorted_list_pop_min(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *update[SORTED_LIST_MAX_LEVEL];
+  xthread_sorted_list_node_t *node;
+  VALUE element;
+  int i;
+
+  GetXThreadSortedListPtr(self, sl);
+  node = sl->head->next[0];
+  if (node == NULL) {
+    return Qnil;
+  }
+  for (i = 0; i < node->level; i++) {
+    update[i] = sl->head;
+  }
+  element = node->element;
+  xthread_sorted_list_unlink(sl, node, update);
+  return element;
+}
+
+/*
+ *  call-seq:
+ *     pop_max -> obj or nil
+ *
+ *  Removes and returns the element with the largest key.  O(log n).
+ */
+VALUE
+rb_xthread_sorted_list_pop_max(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *update[SORTED_LIST_MAX_LEVEL];
+  xthread_sorted_list_node_t *node;
+  xthread_sorted_list_node_t *x;
+  VALUE element;
+  int i;
+
+  GetXThreadSortedListPtr(self, sl);
+  node = sl->tail;
+  if (node == NULL) {
+    return Qnil;
+  }
+  /* the tail is the last node on every level it is on */
+  x = sl->head;
+  for (i = sl->level - 1; i >= 0; i--) {
+    while (x->next[i] != NULL && x->next[i] != node) {
+      x = x->next[i];
+    }
+    update[i] = x;
+  }
+  element = node->element;
+  xthread_sorted_list_unlink(sl, node, update);
+  return element;
+}
+
+/*
+ *  call-seq:
+ *     lower_bound(key) -> obj or nil
+ *
+ *  The first element whose key is not less than +key+.  O(log n).
+ */
+VALUE
+rb_xthread_sorted_list_lower_bound(VALUE self, VALUE key)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *node;
+
+  GetXThreadSortedListPtr(self, sl);
+  node = xthread_sorted_list_search(sl, key, 0, NULL)->next[0];
+  return node ? node->element : Qnil;
+}
+
+/*
+ * yields the elements with lo <= key < hi (or <= hi when !excl), in
+ * order.  lo and hi may be Qundef for an open end.
+ */
+static VALUE
+xthread_sorted_list_each_between(VALUE self, VALUE lo, VALUE hi, int excl)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *node;
+  unsigned long serial;
+  unsigned LONG_LONG seq;
+  VALUE key;
+  int c;
+
+  GetXThreadSortedListPtr(self, sl);
+  if (lo == Qundef) {
+    node = sl->head->next[0];
+  }
+  else {
+    node = xthread_sorted_list_search(sl, lo, 0, NULL)->next[0];
+  }
+  serial = sl->serial;
+  while (node != NULL) {
+    key = node->key;
+    seq = node->seq;
+    if (hi != Qundef) {
+      VALUE element = node->element;
+
+      c = xthread_sorted_list_cmp(sl, key, hi);
+      if (c > 0 || (excl && c == 0)) {
+	break;
+      }
+      rb_yield(element);
+    }
+    else {
+      rb_yield(node->element);
+    }
+    if (sl->serial != serial) {
+      node = xthread_sorted_list_search(sl, key, seq, NULL)->next[0];
+      serial = sl->serial;
+    }
+    else {
+      node = node->next[0];
+    }
+  }
+  return self;
+}
+
+VALUE
+rb_xthread_sorted_list_each(VALUE self)
+{
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  return xthread_sorted_list_each_between(self, Qundef, Qundef, 0);
+}
+
+/*
+ *  call-seq:
+ *     each_in(range) {|obj| ...}
+ *
+ *  Yields the elements whose key lies in +range+, in order.  Either end
+ *  of the range may be nil.  O(log n) to find the start.
+ */
+static VALUE
+xthread_sorted_list_each_in(VALUE self, VALUE range)
+{
+  VALUE lo, hi;
+  int excl;
+
+  RETURN_ENUMERATOR(self, 1, &range);
+
+  if (!rb_range_values(range, &lo, &hi, &excl)) {
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Range)",
+	     rb_obj_classname(range));
+  }
+  return xthread_sorted_list_each_between(self, NIL_P(lo) ? Qundef : lo,
+					  NIL_P(hi) ? Qundef : hi, excl);
+}
+
+VALUE
+rb_xthread_sorted_list_each_range(VALUE self, VALUE lo, VALUE hi, int excl)
+{
+  return xthread_sorted_list_each_between(self, NIL_P(lo) ? Qundef : lo,
+					  NIL_P(hi) ? Qundef : hi, excl);
+}
+
+VALUE
+rb_xthread_sorted_list_clear(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+  int i;
+
+  GetXThreadSortedListPtr(self, sl);
+  xthread_sorted_list_free_nodes(sl);
+  for (i = 0; i < SORTED_LIST_MAX_LEVEL; i++) {
+    sl->head->next[i] = NULL;
+  }
+  sl->tail = NULL;
+  sl->level = 1;
+  sl->length = 0;
+  sl->links = 0;
+  sl->serial++;
+  return self;
+}
+
+VALUE
+rb_xthread_sorted_list_length(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+
+  GetXThreadSortedListPtr(self, sl);
+  return LONG2NUM(sl->length);
+}
+
+VALUE
+rb_xthread_sorted_list_empty_p(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+
+  GetXThreadSortedListPtr(self, sl);
+  return sl->length == 0 ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_sorted_list_to_a(VALUE self)
+{
+  xthread_sorted_list_t *sl;
+  xthread_sorted_list_node_t *node;
+  VALUE ary;
+
+  GetXThreadSortedListPtr(self, sl);
+  ary = rb_ary_new2(sl->length);
+  for (node = sl->head->next[0]; node != NULL; node = node->next[0]) {
+    rb_ary_push(ary, node->element);
+  }
+  return ary;
+}
+
+VALUE
+rb_xthread_sorted_list_inspect(VALUE self)
+{
+  VALUE str;
+
+  str = rb_sprintf("<%s ", rb_obj_classname(self));
+  rb_str_append(str, rb_inspect(rb_xthread_sorted_list_to_a(self)));
+  rb_str_cat2(str, ">");
+  return str;
+}
+
+void
+Init_XThreadSortedList()
+{
+  id_cmp = rb_intern("<=>");
+  id_call = rb_intern("call");
+
+  rb_cXThreadSortedList = rb_define_class_under(rb_mXThread, "SortedList", rb_cObject);
+  rb_include_module(rb_cXThreadSortedList, rb_mEnumerable);
+
+  rb_define_alloc_func(rb_cXThreadSortedList, xthread_sorted_list_alloc);
+  rb_define_method(rb_cXThreadSortedList, "initialize", xthread_sorted_list_initialize, -1);
+  rb_define_method(rb_cXThreadSortedList, "push", rb_xthread_sorted_list_push, 1);
+  rb_define_alias(rb_cXThreadSortedList,  "<<", "push");
+  rb_define_method(rb_cXThreadSortedList, "delete", rb_xthread_sorted_list_delete, 1);
+  rb_define_method(rb_cXThreadSortedList, "first", rb_xthread_sorted_list_first, 0);
+  rb_define_alias(rb_cXThreadSortedList,  "min", "first");
+  rb_define_method(rb_cXThreadSortedList, "last", rb_xthread_sorted_list_last, 0);
+  rb_define_alias(rb_cXThreadSortedList,  "max", "last");
+  rb_define_method(rb_cXThreadSortedList, "pop_min", rb_xthread_sorted_list_pop_min, 0);
+  rb_define_alias(rb_cXThreadSortedList,  "shift", "pop_min");
+  rb_define_method(rb_cXThreadSortedList, "pop_max", rb_xthread_sorted_list_pop_max, 0);
+  rb_define_method(rb_cXThreadSortedList, "lower_bound", rb_xthread_sorted_list_lower_bound, 1);
+
+  rb_define_method(rb_cXThreadSortedList, "each", rb_xthread_sorted_list_each, 0);
+  rb_define_method(rb_cXThreadSortedList, "each_in", xthread_sorted_list_each_in, 1);
+  rb_define_method(rb_cXThreadSortedList, "clear", rb_xthread_sorted_list_clear, 0);
+  rb_define_method(rb_cXThreadSortedList, "length", rb_xthread_sorted_list_length, 0);
+  rb_define_alias(rb_cXThreadSortedList,  "size", "length");
+  rb_define_method(rb_cXThreadSortedList, "empty?", rb_xthread_sorted_list_empty_p, 0);
+
+  rb_define_method(rb_cXThreadSortedList, "to_a", rb_xthread_sorted_list_to_a, 0);
+  rb_define_method(rb_cXThreadSortedList, "inspect", rb_xthread_sorted_list_inspect, 0);
+}
@@ -0,0 +1,239 @@
+/**********************************************************************
+
+  spill.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+#include "ruby/util.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#define SPILL_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/*
+ * overflow tier for SizedQueue.  Byte strings are appended to memory
+ * mapped segment files as <uint32 length><bytes> records and read back
+ * in FIFO order.  A segment file is removed as soon as its last record
+ * has been read.
+ */
+typedef struct rb_xthread_spill_segment_struct
+{
+  char *path;
+  char *map;
+  size_t size;
+  size_t wpos;
+  size_t rpos;
+
+  struct rb_xthread_spill_segment_struct *next;
+} xthread_spill_segment_t;
+
+struct rb_xthread_spill_struct
+{
+  char *dir;
+  size_t segment_size;
+  long seqno;
+  long length;
+
+  xthread_spill_segment_t *head;
+  xthread_spill_segment_t *tail;
+};
+
+#define SPILL_RECORD_HEADER sizeof(uint32_t)
+
+#ifdef HAVE_SYS_MMAN_H
+
+static xthread_spill_segment_t *
+xthread_spill_segment_new(xthread_spill_t *spill, size_t size)
+{
+  xthread_spill_segment_t *seg;
+  VALUE path;
+  int fd;
+  void *map;
+
+  path = rb_sprintf("%s/xthread-spill.%ld.%p.%ld",
+		    spill->dir, (long)getpid(), (void*)spill, spill->seqno++);
+
+  fd = open(RSTRING_PTR(path), O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if (fd < 0) {
+    rb_sys_fail(RSTRING_PTR(path));
+  }
+  if (ftruncate(fd, size) < 0) {
+    int e = errno;
+    close(fd);
+    unlink(RSTRING_PTR(path));
+    errno = e;
+    rb_sys_fail(RSTRING_PTR(path));
+  }
+  map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    int e = errno;
+    close(fd);
+    unlink(RSTRING_PTR(path));
+    errno = e;
+    rb_sys_fail(RSTRING_PTR(path));
+  }
+  close(fd);
+
+  seg = ALLOC(xthread_spill_segment_t);
+  seg->path = ruby_strdup(RSTRING_PTR(path));
+  seg->map = map;
+  seg->size = size;
+  seg->wpos = 0;
+  seg->rpos = 0;
+  seg->next = NULL;
+  return seg;
+}
+
+static void
+xthread_spill_segment_free(xthread_spill_segment_t *seg)
+{
+  munmap(seg->map, seg->size);
+  unlink(seg->path);
+  ruby_xfree(seg->path);
+  ruby_xfree(seg);
+}
+
+xthread_spill_t *
+xthread_spill_new(const char *dir, size_t segment_size)
+{
+  xthread_spill_t *spill;
+
+  if (segment_size == 0) {
+    segment_size = SPILL_DEFAULT_SEGMENT_SIZE;
+  }
+  spill = ALLOC(xthread_spill_t);
+  spill->dir = ruby_strdup(dir);
+  spill->segment_size = segment_size;
+  spill->seqno = 0;
+  spill->length = 0;
+  spill->head = NULL;
+  spill->tail = NULL;
+  return spill;
+}
+
+void
+xthread_spill_free(xthread_spill_t *spill)
+{
+  xthread_spill_segment_t *seg = spill->head;
+
+  while (seg != NULL) {
+    xthread_spill_segment_t *next = seg->next;
+    xthread_spill_segment_free(seg);
+    seg = next;
+  }
+  ruby_xfree(spill->dir);
+  ruby_xfree(spill);
+}
+
+void
+xthread_spill_push(xthread_spill_t *spill, VALUE str)
+{
+  xthread_spill_segment_t *seg = spill->tail;
+  uint32_t len;
+  size_t need;
+
+  StringValue(str);
+  if ((unsigned long)RSTRING_LEN(str) > 0xffffffffUL) {
+    rb_raise(rb_eArgError, "string too long to spill");
+  }
+  len = (uint32_t)RSTRING_LEN(str);
+  need = SPILL_RECORD_HEADER + len;
+
+  if (seg == NULL || seg->size - seg->wpos < need) {
+    size_t size = spill->segment_size;
+
+    if (size < need) {
+      size = need;
+    }
+    seg = xthread_spill_segment_new(spill, size);
+    if (spill->tail) {
+      spill->tail->next = seg;
+    }
+    else {
+      spill->head = seg;
+    }
+    spill->tail = seg;
+  }
+
+  memcpy(seg->map + seg->wpos, &len, SPILL_RECORD_HEADER);
+  memcpy(seg->map + seg->wpos + SPILL_RECORD_HEADER, RSTRING_PTR(str), len);
+  seg->wpos += need;
+  spill->length++;
+}
+
+VALUE
+xthread_spill_shift(xthread_spill_t *spill)
+{
+  xthread_spill_segment_t *seg = spill->head;
+  uint32_t len;
+  VALUE str;
+
+  if (spill->length == 0) {
+    return Qnil;
+  }
+
+  memcpy(&len, seg->map + seg->rpos, SPILL_RECORD_HEADER);
+  str = rb_str_new(seg->map + seg->rpos + SPILL_RECORD_HEADER, len);
+  seg->rpos += SPILL_RECORD_HEADER + len;
+  spill->length--;
+
+  if (seg->rpos == seg->wpos) {
+    if (seg == spill->tail) {
+      /* the write segment is reused from its start */
+      seg->rpos = seg->wpos = 0;
+    }
+    else {
+      spill->head = seg->next;
+      xthread_spill_segment_free(seg);
+    }
+  }
+  return str;
+}
+
+#else
+
+xthread_spill_t *
+xthread_spill_new(const char *dir, size_t segment_size)
+{
+  rb_notimplement();
+  return NULL;
+}
+
+void
+xthread_spill_free(xthread_spill_t *spill)
+{
+}
+
+void
+xthread_spill_push(xthread_spill_t *spill, VALUE str)
+{
+  rb_notimplement();
+}
+
+VALUE
+xthread_spill_shift(xthread_spill_t *spill)
+{
+  return Qnil;
+}
+
+#endif
+
+long
+xthread_spill_length(xthread_spill_t *spill)
+{
+  return spill->length;
+}
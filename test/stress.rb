@@ -0,0 +1,395 @@
+#
+#   stress.rb - soak test for lost wakeups and throughput decay
+#
+#   ruby -Ilib test/stress.rb [options] [queue|sized|cv|monitor|all]
+#
+#   Producers push numbered items for --duration seconds while
+#   consumers take them, some ops with timeouts, and a chaos thread
+#   raises into random workers.  At the end every item must have been
+#   received exactly once.  A watchdog dumps all threads and exits 1
+#   when nothing moves for --hang seconds.  Throughput is printed every
+#   --report seconds, and the last windows are compared with the first
+#   ones to catch slowdowns from stale waiters or ring growth.
+#
+
+require "optparse"
+require "xthread"
+
+opts = {
+  producers: 4,
+  consumers: 4,
+  duration: 60.0,
+  max: 64,
+  timeout_rate: 0.1,
+  timeout: 0.005,
+  interrupt: 0.05,
+  report: 5.0,
+  hang: 10.0,
+}
+OptionParser.new do |o|
+  o.on("-p", "--producers N", Integer){|v| opts[:producers] = v}
+  o.on("-c", "--consumers N", Integer){|v| opts[:consumers] = v}
+  o.on("-d", "--duration SEC", Float){|v| opts[:duration] = v}
+  o.on("-m", "--max N", Integer, "capacity of the bounded variants"){|v| opts[:max] = v}
+  o.on("--timeout-rate R", Float, "share of ops given a timeout"){|v| opts[:timeout_rate] = v}
+  o.on("--timeout SEC", Float){|v| opts[:timeout] = v}
+  o.on("-i", "--interrupt SEC", Float, "interval between Thread#raise, 0 for none"){|v| opts[:interrupt] = v}
+  o.on("-r", "--report SEC", Float){|v| opts[:report] = v}
+  o.on("--hang SEC", Float){|v| opts[:hang] = v}
+end.parse!(ARGV)
+
+class StressInterrupt < StandardError; end
+
+#
+# the adapters give every primitive the same interface:
+# push(item, timeout) -> true or false on timeout, pop(timeout) ->
+# item, or :timeout, or nil once closed and empty.
+#
+class QueueAdapter
+  def initialize(q)
+    @q = q
+  end
+
+  def push(item, timeout)
+    if timeout
+      !@q.push(item, timeout: timeout).nil?
+    else
+      @q.push(item)
+      true
+    end
+  end
+
+  def pop(timeout)
+    item = timeout ? @q.pop(timeout: timeout) : @q.pop
+    if item.nil? && !(@q.closed? && @q.empty?)
+      return :timeout
+    end
+    item
+  end
+
+  def close
+    @q.close
+  end
+
+  def length
+    @q.length
+  end
+
+  def waiting
+    @q.num_waiting
+  end
+end
+
+class SizedQueueAdapter < QueueAdapter
+end
+
+class PlainQueueAdapter < QueueAdapter
+  def push(item, timeout)
+    @q.push(item)
+    true
+  end
+end
+
+# bounded buffer on Mutex and XThread::ConditionVariable
+class CVAdapter
+  def initialize(max)
+    @max = max
+    @buf = []
+    @closed = false
+    @waiting = 0
+    @mutex = Mutex.new
+    @not_empty = XThread::ConditionVariable.new
+    @not_full = XThread::ConditionVariable.new
+  end
+
+  def wait(cv, deadline)
+    @waiting += 1
+    begin
+      if deadline
+	left = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	return false if left <= 0
+	cv.wait(@mutex, left)
+      else
+	cv.wait(@mutex)
+      end
+    rescue Exception
+      # pass on a signal this thread may have consumed
+      cv.signal
+      raise
+    ensure
+      @waiting -= 1
+    end
+    true
+  end
+
+  def deadline(timeout)
+    timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+  end
+
+  def push(item, timeout)
+    limit = deadline(timeout)
+    @mutex.synchronize do
+      while @buf.size >= @max
+	return false unless wait(@not_full, limit)
+      end
+      @buf.push item
+      @not_empty.signal
+    end
+    true
+  end
+
+  def pop(timeout)
+    limit = deadline(timeout)
+    @mutex.synchronize do
+      while @buf.empty?
+	return nil if @closed
+	return :timeout unless wait(@not_empty, limit)
+      end
+      item = @buf.shift
+      @not_full.signal
+      item
+    end
+  end
+
+  def close
+    @mutex.synchronize do
+      @closed = true
+      @not_empty.broadcast
+    end
+  end
+
+  def length
+    @buf.size
+  end
+
+  def waiting
+    @waiting
+  end
+end
+
+# bounded buffer on XThread::Monitor and its conditions
+class MonitorAdapter
+  def initialize(max)
+    @max = max
+    @buf = []
+    @closed = false
+    @waiting = 0
+    @mon = XThread::Monitor.new
+    @not_empty = @mon.new_cond
+    @not_full = @mon.new_cond
+  end
+
+  def push(item, timeout)
+    @mon.synchronize do
+      @waiting += 1
+      begin
+	ok = @not_full.wait_while(timeout){@buf.size >= @max}
+      rescue Exception
+	@not_full.signal
+	raise
+      ensure
+	@waiting -= 1
+      end
+      return false unless ok
+      @buf.push item
+      @not_empty.signal
+    end
+    true
+  end
+
+  def pop(timeout)
+    @mon.synchronize do
+      @waiting += 1
+      begin
+	ok = @not_empty.wait_while(timeout){@buf.empty? && !@closed}
+      rescue Exception
+	@not_empty.signal
+	raise
+      ensure
+	@waiting -= 1
+      end
+      return :timeout unless ok
+      return nil if @buf.empty?
+      item = @buf.shift
+      @not_full.signal
+      item
+    end
+  end
+
+  def close
+    @mon.synchronize do
+      @closed = true
+      @not_empty.broadcast
+    end
+  end
+
+  def length
+    @buf.size
+  end
+
+  def waiting
+    @waiting
+  end
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def run(kind, opts)
+  que = case kind
+	when "queue"
+	  PlainQueueAdapter.new(XThread::Queue.new)
+	when "sized"
+	  SizedQueueAdapter.new(XThread::SizedQueue.new(opts[:max]))
+	when "cv"
+	  CVAdapter.new(opts[:max])
+	when "monitor"
+	  MonitorAdapter.new(opts[:max])
+	else
+	  raise ArgumentError, "unknown kind: #{kind}"
+	end
+
+  puts "== #{kind}: #{opts[:producers]} producers, #{opts[:consumers]} consumers, #{opts[:duration]}s"
+
+  stop = false
+  consumed = 0
+  produced = Array.new(opts[:producers], 0)
+  received = Array.new(opts[:consumers]){[]}
+  interrupts = 0
+
+  timeout_for = lambda do
+    rand < opts[:timeout_rate] ? opts[:timeout] : nil
+  end
+
+  producers = opts[:producers].times.map do |pid|
+    Thread.start do
+      seq = 0
+      begin
+	# interrupts are only taken while blocked, where they cannot
+	# separate an item from its bookkeeping
+	Thread.handle_interrupt(StressInterrupt => :never) do
+	  until stop
+	    begin
+	      pushed = Thread.handle_interrupt(StressInterrupt => :on_blocking) do
+		que.push([pid, seq], timeout_for.call)
+	      end
+	      seq += 1 if pushed
+	    rescue StressInterrupt
+	    end
+	  end
+	end
+      rescue StressInterrupt
+	# left pending by an op that never blocked
+      end
+      produced[pid] = seq
+    end
+  end
+
+  consumers = opts[:consumers].times.map do |cid|
+    Thread.start do
+      mine = received[cid]
+      begin
+	Thread.handle_interrupt(StressInterrupt => :never) do
+	  loop do
+	    begin
+	      item = Thread.handle_interrupt(StressInterrupt => :on_blocking) do
+		que.pop(timeout_for.call)
+	      end
+	    rescue StressInterrupt
+	      next
+	    end
+	    next if item == :timeout
+	    break if item.nil?
+	    mine << item
+	    consumed += 1
+	  end
+	end
+      rescue StressInterrupt
+      end
+    end
+  end
+  workers = producers + consumers
+
+  chaos = if opts[:interrupt] > 0
+	    Thread.start do
+	      until stop
+		sleep opts[:interrupt]
+		th = workers.sample
+		if th.alive?
+		  th.raise StressInterrupt
+		  interrupts += 1
+		end
+	      end
+	    end
+	  end
+
+  start = now
+  windows = []
+  last_consumed = 0
+  last_progress = now
+  last_report = start
+  watch_consumed = 0
+  done = false
+
+  until done
+    sleep 0.1
+    t = now
+    if consumed != watch_consumed
+      watch_consumed = consumed
+      last_progress = t
+    end
+    if !stop && t - start >= opts[:duration]
+      stop = true
+      chaos.join if chaos
+      producers.each(&:join)
+      que.close
+      last_progress = now
+    end
+    done = stop && consumers.none?(&:alive?)
+
+    if t - last_progress > opts[:hang] && !done
+      puts "HANG: no progress for #{opts[:hang]}s, length=#{que.length} waiting=#{que.waiting}"
+      Thread.list.each do |th|
+	next if th == Thread.current
+	puts "#{th.inspect}\n  #{(th.backtrace || []).first(8).join("\n  ")}"
+      end
+      exit! 1
+    end
+
+    if t - last_report >= opts[:report] || done
+      rate = (consumed - last_consumed) / (t - last_report)
+      windows << rate unless done
+      printf("%8.1fs %12.0f items/s  length %-6d waiting %-3d interrupts %d\n",
+	     t - start, rate, que.length, que.waiting, interrupts)
+      last_consumed = consumed
+      last_report = t
+    end
+  end
+
+  total = produced.sum
+  counts = Hash.new(0)
+  received.each{|r| r.each{|item| counts[item] += 1}}
+  dups = counts.count{|_, n| n > 1}
+  missing = 0
+  produced.each_with_index do |n, pid|
+    n.times{|seq| missing += 1 unless counts.key?([pid, seq])}
+  end
+  extra = counts.size - (total - missing)
+
+  ok = dups == 0 && missing == 0 && extra == 0
+  puts "produced #{total}, received #{counts.values.sum}, duplicated #{dups}, missing #{missing}, unexpected #{extra}"
+
+  if windows.size >= 4
+    k = [windows.size / 4, 1].max
+    head = windows.first(k).sum / k
+    tail = windows.last(k).sum / k
+    printf("throughput last/first: %.2f%s\n", tail / head,
+	   tail < head * 0.5 ? "  (DECAY)" : "")
+  end
+  ok
+end
+
+kinds = ARGV.empty? || ARGV[0] == "all" ? %w[queue sized cv monitor] : ARGV
+ok = kinds.map{|kind| run(kind, opts)}.all?
+exit(ok ? 0 : 1)
@@ -3,8 +3,14 @@ require "test/unit"
 require "xthread"
 require "xthread/monitor"
 
-XMonitor = XThread::Monitor
-XQueue = XThread::Queue
+# ruby -rxthread/replace runs this through the rebound top-level constants
+if defined?(XThread::REPLACED)
+  XMonitor = ::Monitor
+  XQueue = ::Queue
+else
+  XMonitor = XThread::Monitor
+  XQueue = XThread::Queue
+end
 
 def assert_equal(v1, v2)
   puts "#{v1.inspect} == #{v2.inspect}"
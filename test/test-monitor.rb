@@ -3,8 +3,16 @@ require "test/unit"
 require "xthread"
 require "xthread/monitor"
 
-XMonitor = XThread::Monitor
-XQueue = XThread::Queue
+# ruby -rxthread/replace runs this through the rebound top-level constants
+if defined?(XThread::REPLACED)
+  XMonitor = ::Monitor
+  XMonitorMixin = ::MonitorMixin
+  XQueue = ::Queue
+else
+  XMonitor = XThread::Monitor
+  XMonitorMixin = XThread::MonitorMixin
+  XQueue = XThread::Queue
+end
 
 class TestMonitor < Test::Unit::TestCase
   def setup
@@ -190,4 +198,78 @@ class TestMonitor < Test::Unit::TestCase
 #     end
 #     cumber_thread.kill
   end
+
+  def test_fair_policy
+    monitor = XMonitor.new(:fair)
+    assert_equal(:fair, monitor.policy)
+    order = []
+    monitor.enter
+    ths = (1..3).map do |i|
+      th = Thread.start {
+        monitor.synchronize { order.push(i) }
+      }
+      Thread.pass until th.status == "sleep"
+      th
+    end
+    monitor.exit
+    monitor.synchronize { order.push(:main) }
+    ths.each(&:join)
+    assert_equal([1, 2, 3, :main], order)
+  end
+
+  def test_policy_change_with_woken_waiter
+    monitor = XMonitor.new(:throughput)
+    order = []
+    monitor.enter
+    ths = (1..2).map do |i|
+      th = Thread.start {
+        monitor.synchronize { order.push(i) }
+      }
+      Thread.pass until th.status == "sleep"
+      th
+    end
+    # the exit wakes a waiter that runs only after the switch
+    monitor.exit
+    monitor.policy = :fair
+    ths.each(&:join)
+    assert_equal([1, 2], order.sort)
+  end
+
+
+  def test_wait_until_timeout
+    cond = @monitor.new_cond
+    ready = false
+    @monitor.synchronize do
+      assert_equal(false, cond.wait_until(0.05) { ready })
+    end
+    Thread.start do
+      @monitor.synchronize do
+        ready = true
+        cond.signal
+      end
+    end
+    @monitor.synchronize do
+      assert_equal(true, cond.wait_while(1) { !ready })
+    end
+  end
+
+
+  def test_mixin
+    buf = []
+    buf.extend(XMonitorMixin)
+    cond = buf.new_cond
+    th = Thread.start {
+      buf.synchronize do
+        cond.wait_while { buf.empty? }
+        buf.shift
+      end
+    }
+    buf.synchronize do
+      buf.push(:item)
+      cond.signal
+    end
+    assert_equal(:item, th.value)
+    assert_equal([], buf.instance_variables)
+  end
+
 end
@@ -3,8 +3,14 @@
 
 require "xthread"
 
-XConditionVariable = XThread::ConditionVariable
-XQueue = XThread::Queue
+# ruby -rxthread/replace runs this through the rebound top-level constants
+if defined?(XThread::REPLACED)
+  XConditionVariable = ::ConditionVariable
+  XQueue = ::Queue
+else
+  XConditionVariable = XThread::ConditionVariable
+  XQueue = XThread::Queue
+end
 
 #class TestCV < Test::Unit::TestCase
 class TestCV
@@ -263,7 +269,7 @@ p "X5"
     Thread.abort_on_exception = true
 
     mx = Mutex.new
-    cv = XThread::ConditionVariable.new
+    cv = XConditionVariable.new
 
     i = []
 
@@ -0,0 +1,27 @@
+
+require "xthread"
+
+case ARGV[0]
+when "1"
+  f = XThread::Fifo.new
+  40.times{|i| f.push i}
+  30.times{f.pop}
+  25.times{|i| f.push 100+i}
+  p f.to_a
+  p f.each_slice(7).collect{|s| s.size}
+  p f.select{|e| e % 2 == 0}
+
+when "2"
+  f = XThread::Fifo.new
+  20.times{|i| f.push i}
+  p f.shift(5)
+  p f.shift(100)
+  p f.empty?
+
+when "3"
+  l = XThread::ChainList.new((1..150).to_a)
+  l.each_slice(64) do |s|
+    p s.size
+  end
+
+end
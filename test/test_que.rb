@@ -1,16 +1,25 @@
 
 require "xthread"
 
+# ruby -rxthread/replace runs this through the rebound top-level constants
+if defined?(XThread::REPLACED)
+  XQueue = ::Queue
+  XSizedQueue = ::SizedQueue
+else
+  XQueue = XThread::Queue
+  XSizedQueue = XThread::SizedQueue
+end
+
 case ARGV[0]
 when "1"
-  q = XThread::Queue.new
+  q = XQueue.new
   100.times do |i|
     puts i
     q.push i
   end
 
 when "2"
-  q = XThread::Queue.new
+  q = XQueue.new
   100.times do |i|
     puts i
     q.push i
@@ -22,7 +31,7 @@ when "2"
   end
 
 when "2.1"
-  q = XThread::Queue.new
+  q = XQueue.new
   q.push 0
   q.pop
   100.times do |i|
@@ -36,7 +45,7 @@ when "2.1"
   end
 
 when "2.2"
-  q = XThread::Queue.new
+  q = XQueue.new
   10.times do 
     q.push 0
   end
@@ -54,21 +63,21 @@ when "2.2"
   end
 
 when "3"
-  q = XThread::Queue.new
+  q = XQueue.new
   10.times do 
     q.push 0
   end
   puts q.size
 
 when "3.1"
-  q = XThread::Queue.new
+  q = XQueue.new
   18.times do 
     q.push 0
   end
   puts q.size
 
 when "3.2"
-  q = XThread::Queue.new
+  q = XQueue.new
   q.push 0
   q.pop
   100.times do |i|
@@ -78,13 +87,13 @@ when "3.2"
   puts q.size
 
 when "4"
-  q = XThread::Queue.new
+  q = XQueue.new
   q.push 0
   q.clear
   puts q.size
 
 when "4.1"
-  q = XThread::Queue.new
+  q = XQueue.new
   q.push 0
   q.clear
   q.push 0
@@ -93,7 +102,7 @@ when "4.1"
 when "5"
   require "objspace"
 
-  q = XThread::Queue.new
+  q = XQueue.new
   1000_0000.times do |i|
     q.push 1
   end
@@ -138,7 +147,7 @@ when "5.1"
 #  sleep 2
 
 when "6"
-  q = XThread::Queue.new
+  q = XQueue.new
   15.times do
     q.push 0
   end
@@ -162,7 +171,7 @@ when "6.1"
   end
 
 when "S"
-  q = XThread::SizedQueue.new(100)
+  q = XSizedQueue.new(100)
   100.times do |i|
     puts i
     q.push i
@@ -170,7 +179,7 @@ when "S"
 
 
 when "S1"
-  q = XThread::SizedQueue.new(100)
+  q = XSizedQueue.new(100)
 
   Thread.start do
     sleep 2
@@ -184,15 +193,216 @@ when "S1"
   end
 
 when "S2"
-  q = XThread::SizedQueue.new(100)
+  q = XSizedQueue.new(100)
   puts q.max
   puts q.empty?
 
 when "S3"
   1000000.times do
-    XThread::SizedQueue.new(100)
+    XSizedQueue.new(100)
   end
 
-end
+when "S4"
+  q = XSizedQueue.new(2)
+  2.times{|i| q.push i}
+  th = 3.times.collect{|i| Thread.start{q.push i}}
+  sleep 0.1
+  q.max = 4
+  sleep 0.1
+  p th.collect{|t| t.status}
+  q.max = 5
+  th.each{|t| t.join}
+  puts q.size
+
+when "S5"
+  q = XSizedQueue.new(4)
+  q.enable_adaptive(0.01, 2, 1000)
+  prod = Thread.start do
+    100000.times{|i| q.push i}
+  end
+  100000.times do
+    q.pop
+  end
+  prod.join
+  puts q.max
+
+when "S5.1"
+  # no consumer at all: blocked producers still shrink max
+  q = XSizedQueue.new(64)
+  q.enable_adaptive(0.01, 2, 1000)
+  64.times{|i| q.push i}
+  10.times{q.push(:x, timeout: 0.02)}
+  p q.max < 64
+
+when "S6"
+  require "tmpdir"
+
+  Dir.mktmpdir do |dir|
+    q = XSizedQueue.new(10)
+    q.spill_to(dir, 4096)
+    5000.times{|i| q.push "item#{i}"}
+    p [q.size, q.spilled_length, Dir["#{dir}/*"].size]
+    p 5000.times.all?{|i| q.pop == "item#{i}"}
+    p Dir["#{dir}/*"].size
+  end
+
+when "S6.1"
+  # timer pushes queue up behind the spilled items
+  require "tmpdir"
+
+  Dir.mktmpdir do |dir|
+    q = XSizedQueue.new(2)
+    q.spill_to(dir)
+    5.times{|i| q.push "i#{i}"}
+    XThread::TimerWheel.default.schedule(0.01, q, "timer")
+    sleep 0.01 until q.size == 6
+    p 6.times.map{q.pop}
+  end
+
+
+when "J1"
+  require "tmpdir"
+
+  Dir.mktmpdir do |dir|
+    path = "#{dir}/q.log"
+    q = XThread::JournalQueue.new(path)
+    10000.times{|i| q.push "item#{i}"}
+    9000.times{q.pop}
+    q.compact
+    q = XThread::JournalQueue.new(path, 0.01)
+    p q.size
+    p 1000.times.all?{|i| q.pop == "item#{9000+i}"}
+  end
+
+when "J2"
+  # timer deliveries are logged like any other push
+  require "tmpdir"
+
+  Dir.mktmpdir do |dir|
+    path = "#{dir}/q.log"
+    q = XThread::JournalQueue.new(path)
+    q.push "a"
+    XThread::TimerWheel.default.schedule(0.01, q, "timer")
+    sleep 0.01 until q.size == 2
+    q = XThread::JournalQueue.new(path)
+    p q.size
+    p [q.pop, q.pop]
+  end
+
+when "D1"
+  q = XThread::DelayQueue.new
+  c = Thread.new{3.times.map{q.pop}}
+  q.push :late, in: 0.3
+  sleep 0.05
+  q.push :early, in: 0.1
+  q.push :at, at: Time.now + 0.2
+  p c.value
+
+
+when "L1"
+  q = XSizedQueue.new(4)
+  q.push :old
+  q.enable_latency_tracking
+  c = Thread.new{1001.times{q.pop; sleep 0.001 if rand < 0.01}}
+  1000.times{|i| q.push i}
+  c.join
+  p q.latency_count
+  p q.latency_percentiles.keys
+  p q.latency_percentiles(0, 100).values.all?{|v| v >= 0}
+  q.reset_latency
+  p q.latency_percentiles(50)
+
+when "M1"
+  q = XSizedQueue.new(2)
+  q.metrics_name = "jobs"
+  c = Thread.new{5.times{sleep 0.01; q.pop}}
+  5.times{|i| q.push i}
+  c.join
+  p q.stats.values_at(:pushes, :pops, :high_water)
+  puts XThread.metrics.lines.grep(/name="jobs"/)
+
+when "SQ1"
+  q = XThread::ShardedQueue.new(4, ordered: ARGV[1] == "ordered")
+  prods = 4.times.map{|pid| Thread.new{1000.times{|i| q.push [pid, i]}}}
+  prods.each(&:join)
+  q.close
+  items = []
+  while item = q.pop
+    items << item
+  end
+  p items.size
+  p items.group_by(&:first).values.all?{|v| v.map(&:last) == (0...1000).to_a}
+
+when "F1"
+  f = XThread::Fifo.new
+  a = []
+  10000.times do
+    x = rand(100)
+    case rand(4)
+    when 0; f.push x; a.push x
+    when 1; f.unshift x; a.unshift x
+    when 2; raise "shift" unless f.pop == a.shift
+    when 3; raise "pop_back" unless f.pop_back == a.pop
+    end
+    raise "peek" unless f.first == a.first && f.last == a.last
+  end
+  p f.to_a == a
+  p f.first(3) == a.first(3), f.first(a.size + 1) == a, f.first(0)
+  q = XQueue.new
+  q.push 1
+  q.requeue_front 0
+  p q.pop, q.pop
+
+when "SL1"
+  l = XThread::SortedList.new{|job| job[:at]}
+  a = []
+  1000.times do |i|
+    job = {at: rand(100), id: i}
+    l.push job
+    a.push job
+  end
+  a = a.sort_by.with_index{|job, i| [job[:at], i]}
+  p l.to_a == a
+  p l.lower_bound(50) == a.find{|job| job[:at] >= 50}
+  p l.each_in(10...20).to_a == a.select{|job| (10...20) === job[:at]}
+  p l.delete(a[500]) == a.delete_at(500)
+  p l.pop_min == a.shift, l.pop_max == a.pop, l.to_a == a
+
+when "LR1"
+  c = XThread::LRUCache.new(3)
+  c[:a] = 1; c[:b] = 2; c[:c] = 3
+  c[:a]
+  c[:d] = 4
+  p c.to_a
+  p c[:b], c.evict
+  b = XThread::LRUCache.new(max_bytes: 8){|k, v| v.bytesize}
+  b["x"] = "1234"; b["y"] = "5678"; b["z"] = "9"
+  p b.to_a, b.bytesize
+  t = XThread::LRUCache.new(10, ttl: 0.05)
+  t[1] = :gone
+  t.put(2, :kept, ttl: 10)
+  sleep 0.1
+  p t[1], t[2]
+  p c.stats, t.stats
+
+when "MP1"
+  m = XThread::Map.new
+  calls = 0
+  ths = 8.times.map{Thread.new{m.compute_if_absent(:conf){calls += 1; sleep 0.05; :loaded}}}
+  p ths.map(&:value).uniq, calls
+  8.times.map{Thread.new{1000.times{m.compute(:n){|o| (o || 0) + 1}; m.merge(:m, 1){|o, v| o + v}}}}.each(&:join)
+  p m[:n], m[:m]
+  p m.put_if_absent(:n, 0), m.delete(:m), m.size, m.to_h
+
+when "AT1"
+  n = XThread::AtomicInteger.new
+  ref = XThread::AtomicReference.new([])
+  adder = XThread::Adder.new(cells: 4)
+  8.times.map{|i| Thread.new{1000.times{n.increment; adder.increment; Thread.pass}; ref.update{|a| a + [i]}}}.each(&:join)
+  p n.value, adder.sum, ref.get.sort
+  p n.compare_and_set(8000, -1), n.compare_and_set(8000, 0), n.get_and_update{|v| v * 2}, n.value
+  a = ref.get
+  p ref.compare_and_set(a.dup, nil), ref.compare_and_set(a, nil), ref.get
+  p adder.sum_then_reset, adder.sum
 
-    
+end
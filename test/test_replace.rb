@@ -0,0 +1,80 @@
+#
+#   test_replace.rb - xthread/replace bindings
+#
+#   The rest of the suite runs in replace mode as well, through the
+#   rebound top-level constants:
+#
+#     ruby -Ilib -rxthread/replace test/test-monitor.rb
+#     ruby -Ilib -rxthread/replace test/test_que.rb CASE
+#
+#   test_suite_under_replace below runs a part of it that way.
+#
+
+require "test/unit"
+require "rbconfig"
+
+require "xthread/replace"
+
+class TestReplace < Test::Unit::TestCase
+  def test_bindings
+    assert_equal(XThread::Queue, ::Queue)
+    assert_equal(XThread::SizedQueue, ::SizedQueue)
+    assert_equal(XThread::ConditionVariable, ::ConditionVariable)
+    assert_equal(XThread::Monitor, ::Monitor)
+    assert_equal(XThread::MonitorMixin, ::MonitorMixin)
+    require "monitor"
+    assert_equal(XThread::Monitor, Monitor.instance_method(:enter).owner)
+  end
+
+  def test_queue_close
+    q = Queue.new([1])
+    th = Thread.start { [q.pop, q.pop] }
+    Thread.pass until th.status == "sleep"
+    assert_equal(1, q.num_waiting)
+    q.close
+    assert_equal([1, nil], th.value)
+    assert_raise(ClosedQueueError) { q.push(2) }
+  end
+
+  def test_pop_timeout
+    q = Queue.new
+    assert_nil(q.pop(timeout: 0.01))
+    assert_raise(ArgumentError) { q.pop(true, timeout: 1) }
+    assert_raise(ThreadError) { q.pop(true) }
+  end
+
+  def test_sized_queue
+    q = SizedQueue.new(1)
+    q.push(1)
+    assert_nil(q.push(2, timeout: 0.01))
+    assert_raise(ThreadError) { q.push(2, true) }
+    th = Thread.start { q.push(3) }
+    th.report_on_exception = false
+    Thread.pass until th.status == "sleep"
+    assert_equal(1, q.num_waiting)
+    q.close
+    assert_raise(ClosedQueueError) { th.join }
+  end
+
+  def test_monitor_ownership
+    m = Monitor.new
+    assert_equal(false, m.mon_locked?)
+    m.synchronize do
+      assert_equal(true, m.mon_locked?)
+      assert_equal(true, m.mon_owned?)
+      assert_equal(false, Thread.start { m.mon_owned? }.value)
+    end
+    o = Object.new.extend(MonitorMixin)
+    o.mon_synchronize { assert_equal(true, o.mon_owned?) }
+  end
+
+  def test_suite_under_replace
+    dir = File.dirname(__FILE__)
+    incs = $LOAD_PATH.select {|d| Dir["#{d}/xthread{.rb,.so,.bundle}"].any? }
+    ruby = [RbConfig.ruby, *incs.map {|d| "-I#{d}" }, "-rxthread/replace"]
+    assert(system(*ruby, "#{dir}/test-monitor.rb", out: File::NULL))
+    %w[3 6 S1 S4].each do |c|
+      assert(system(*ruby, "#{dir}/test_que.rb", c, out: File::NULL), "test_que.rb #{c}")
+    end
+  end
+end
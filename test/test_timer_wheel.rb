@@ -0,0 +1,30 @@
+require "xthread"
+
+case ARGV[0]
+when "1"
+  w = XThread::TimerWheel.new(0.01)
+  q = XThread::Queue.new
+  w.schedule(0.2){|t| q.push :block}
+  w.schedule(0.1, q, :queue)
+  t = w.schedule(0.05, q, :cancelled)
+  p t.cancel
+  p q.pop
+  p q.pop
+
+when "2"
+  w = XThread::TimerWheel.new(0.01)
+  q = XThread::Queue.new
+  timers = 10000.times.map{|i| w.schedule(rand, q, i)}
+  timers.each_with_index{|t, i| t.cancel if i.odd?}
+  p 5000.times.map{q.pop}.all?(&:even?)
+  p w.size
+
+when "3"
+  # the service thread of the parent does not exist in a forked child
+  XThread::TimerWheel.default.schedule(5){}
+  q = XThread::Queue.new
+  pid = fork{exit!(q.pop(timeout: 0.05).nil? ? 0 : 1)}
+  _, st = Process.wait2(pid)
+  p st.success?
+
+end
@@ -0,0 +1,684 @@
+/**********************************************************************
+
+  timer-wheel.c -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#include "ruby.h"
+
+#include "xthread.h"
+#include "xthread-internal.h"
+
+#ifdef HAVE_PTHREAD_ATFORK
+#include <pthread.h>
+#elif defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif
+
+VALUE rb_cXThreadTimerWheel;
+VALUE rb_cXThreadTimer;
+
+static VALUE xthread_timer_wheel_default = Qnil;
+
+/*
+ * changes in a forked child, whose copy of a wheel names a service
+ * thread that does not run there.
+ */
+#ifdef HAVE_PTHREAD_ATFORK
+static unsigned long xthread_timer_wheel_forks;
+
+static void
+xthread_timer_wheel_atfork_child(void)
+{
+  xthread_timer_wheel_forks++;
+}
+#define TIMER_WHEEL_FORK_GENERATION() xthread_timer_wheel_forks
+#elif defined(HAVE_UNISTD_H)
+#define TIMER_WHEEL_FORK_GENERATION() ((unsigned long)getpid())
+#else
+#define TIMER_WHEEL_FORK_GENERATION() 0UL
+#endif
+
+/*
+ * hashed timing wheel.
+ *
+ * A timer due at tick t hangs on slot t % slots in an intrusive doubly
+ * linked list, so schedule and cancel are O(1).  One service thread
+ * advances the wheel every tick, fires the timers of the current slot
+ * whose tick has come and leaves the others for a later round.  The
+ * thread exits as soon as the wheel is empty and is restarted by the
+ * next schedule.
+ *
+ * All list operations run under the GVL.  Linked timers are marked
+ * (pinned) by the wheel; a timer holds its wheel.
+ */
+
+#define TIMER_PENDING 0
+#define TIMER_EXPIRED 1
+#define TIMER_CANCELLED 2
+
+typedef struct rb_xthread_timer_struct
+{
+  VALUE self;
+  VALUE wheel;
+  int state;
+  int kind;
+  unsigned LONG_LONG due;
+  VALUE target;
+  VALUE value;
+
+  struct rb_xthread_timer_struct *prev;
+  struct rb_xthread_timer_struct *next;
+} xthread_timer_t;
+
+typedef struct rb_xthread_timer_wheel_struct
+{
+  xthread_hrtime_t tick;
+  xthread_hrtime_t start;
+  unsigned LONG_LONG current;
+  long nslots;
+  xthread_timer_t **slots;
+  long count;
+
+  VALUE thread;
+  /* TIMER_WHEEL_FORK_GENERATION() when thread was started */
+  unsigned long generation;
+} xthread_timer_wheel_t;
+
+#define TIMER_WHEEL_DEFAULT_TICK 0.01
+#define TIMER_WHEEL_DEFAULT_SLOTS 512
+
+#define GetXThreadTimerWheelPtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_timer_wheel_t, &xthread_timer_wheel_data_type, (tobj))
+
+#define GetXThreadTimerPtr(obj, tobj) \
+    TypedData_Get_Struct((obj), xthread_timer_t, &xthread_timer_data_type, (tobj))
+
+static void
+xthread_timer_mark(void *ptr)
+{
+  xthread_timer_t *timer = (xthread_timer_t*)ptr;
+
+  rb_gc_mark_movable(timer->wheel);
+  rb_gc_mark_movable(timer->target);
+  rb_gc_mark_movable(timer->value);
+}
+
+static void
+xthread_timer_compact(void *ptr)
+{
+  xthread_timer_t *timer = (xthread_timer_t*)ptr;
+
+  timer->self = rb_gc_location(timer->self);
+  timer->wheel = rb_gc_location(timer->wheel);
+  timer->target = rb_gc_location(timer->target);
+  timer->value = rb_gc_location(timer->value);
+}
+
+static void
+xthread_timer_free(void *ptr)
+{
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_timer_memsize(const void *ptr)
+{
+  return ptr ? sizeof(xthread_timer_t) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_timer_data_type = {
+    "xthread_timer",
+    {xthread_timer_mark, xthread_timer_free, xthread_timer_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_timer_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_timer_data_type = {
+    "xthread_timer",
+    xthread_timer_mark,
+    xthread_timer_free,
+    xthread_timer_memsize,
+};
+#endif
+
+static void
+xthread_timer_wheel_mark(void *ptr)
+{
+  xthread_timer_wheel_t *wheel = (xthread_timer_wheel_t*)ptr;
+  long i;
+
+  for (i = 0; i < wheel->nslots; i++) {
+    xthread_timer_t *timer;
+
+    for (timer = wheel->slots[i]; timer; timer = timer->next) {
+      /* pinned: the lists point at the timer objects */
+      rb_gc_mark(timer->self);
+    }
+  }
+  rb_gc_mark_movable(wheel->thread);
+}
+
+static void
+xthread_timer_wheel_compact(void *ptr)
+{
+  xthread_timer_wheel_t *wheel = (xthread_timer_wheel_t*)ptr;
+
+  wheel->thread = rb_gc_location(wheel->thread);
+}
+
+static void
+xthread_timer_wheel_free(void *ptr)
+{
+  xthread_timer_wheel_t *wheel = (xthread_timer_wheel_t*)ptr;
+
+  /* linked timers die with the wheel; they are not touched here */
+  if (wheel->slots) {
+    ruby_xfree(wheel->slots);
+  }
+  ruby_xfree(ptr);
+}
+
+static size_t
+xthread_timer_wheel_memsize(const void *ptr)
+{
+  xthread_timer_wheel_t *wheel = (xthread_timer_wheel_t*)ptr;
+
+  return ptr ? sizeof(xthread_timer_wheel_t) +
+    wheel->nslots * sizeof(xthread_timer_t *) : 0;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_FUNCTION
+static const rb_data_type_t xthread_timer_wheel_data_type = {
+    "xthread_timer_wheel",
+    {xthread_timer_wheel_mark, xthread_timer_wheel_free, xthread_timer_wheel_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+     xthread_timer_wheel_compact,
+#endif
+    },
+#ifdef HAVE_RB_DATA_TYPE_T_FLAGS
+    0, 0, RUBY_TYPED_WB_PROTECTED,
+#endif
+};
+#else
+static const rb_data_type_t xthread_timer_wheel_data_type = {
+    "xthread_timer_wheel",
+    xthread_timer_wheel_mark,
+    xthread_timer_wheel_free,
+    xthread_timer_wheel_memsize,
+};
+#endif
+
+static VALUE
+xthread_timer_wheel_alloc(VALUE klass)
+{
+  VALUE volatile obj;
+  xthread_timer_wheel_t *wheel;
+
+  obj = TypedData_Make_Struct(klass, xthread_timer_wheel_t,
+			      &xthread_timer_wheel_data_type, wheel);
+  wheel->tick = 0;
+  wheel->start = rb_xthread_hrtime();
+  wheel->current = 0;
+  wheel->nslots = 0;
+  wheel->slots = NULL;
+  wheel->count = 0;
+  wheel->thread = Qnil;
+  wheel->generation = 0;
+  return obj;
+}
+
+/*
+ *  call-seq:
+ *     TimerWheel.new(tick = 0.01, slots = 512)
+ *
+ *  Creates a timing wheel advancing every +tick+ seconds.  Timers fire
+ *  up to one tick late, never early.
+ */
+static VALUE
+xthread_timer_wheel_initialize(int argc, VALUE *argv, VALUE self)
+{
+  xthread_timer_wheel_t *wheel;
+  VALUE tick;
+  VALUE slots;
+  double t = TIMER_WHEEL_DEFAULT_TICK;
+  long n = TIMER_WHEEL_DEFAULT_SLOTS;
+
+  GetXThreadTimerWheelPtr(self, wheel);
+  rb_scan_args(argc, argv, "02", &tick, &slots);
+
+  if (!NIL_P(tick)) {
+    t = NUM2DBL(tick);
+  }
+  if (!NIL_P(slots)) {
+    n = NUM2LONG(slots);
+  }
+  if (t < 1e-6) {
+    rb_raise(rb_eArgError, "tick too small");
+  }
+  if (n <= 0) {
+    rb_raise(rb_eArgError, "slots must be positive");
+  }
+  if (wheel->slots) {
+    rb_raise(rb_eArgError, "timer wheel already initialized");
+  }
+  wheel->tick = (xthread_hrtime_t)(t * XTHREAD_NSEC_PER_SEC);
+  wheel->slots = ALLOC_N(xthread_timer_t *, n);
+  MEMZERO(wheel->slots, xthread_timer_t *, n);
+  wheel->nslots = n;
+  return self;
+}
+
+VALUE
+rb_xthread_timer_wheel_new(double tick, long slots)
+{
+  VALUE argv[2];
+
+  argv[0] = DBL2NUM(tick);
+  argv[1] = LONG2NUM(slots);
+  return rb_class_new_instance(2, argv, rb_cXThreadTimerWheel);
+}
+
+/*
+ * the wheel shared by the blocking primitives of this library.
+ */
+VALUE
+rb_xthread_timer_wheel_default(void)
+{
+  if (NIL_P(xthread_timer_wheel_default)) {
+    xthread_timer_wheel_default = rb_class_new_instance(0, NULL, rb_cXThreadTimerWheel);
+  }
+  return xthread_timer_wheel_default;
+}
+
+static VALUE
+xthread_timer_wheel_s_default(VALUE klass)
+{
+  return rb_xthread_timer_wheel_default();
+}
+
+static unsigned LONG_LONG
+xthread_timer_wheel_now(xthread_timer_wheel_t *wheel)
+{
+  return (rb_xthread_hrtime() - wheel->start) / wheel->tick;
+}
+
+static void
+xthread_timer_wheel_link(VALUE self, xthread_timer_wheel_t *wheel, xthread_timer_t *timer)
+{
+  xthread_timer_t **head = &wheel->slots[timer->due % wheel->nslots];
+
+  /* the wheel marks its linked timers */
+  RB_OBJ_WRITTEN(self, Qundef, timer->self);
+
+  timer->prev = NULL;
+  timer->next = *head;
+  if (*head) {
+    (*head)->prev = timer;
+  }
+  *head = timer;
+  wheel->count++;
+}
+
+static void
+xthread_timer_wheel_unlink(xthread_timer_wheel_t *wheel, xthread_timer_t *timer)
+{
+  if (timer->prev) {
+    timer->prev->next = timer->next;
+  }
+  else {
+    wheel->slots[timer->due % wheel->nslots] = timer->next;
+  }
+  if (timer->next) {
+    timer->next->prev = timer->prev;
+  }
+  timer->prev = timer->next = NULL;
+  wheel->count--;
+}
+
+static VALUE
+xthread_timer_fire(VALUE self)
+{
+  xthread_timer_t *timer;
+
+  GetXThreadTimerPtr(self, timer);
+  switch (timer->kind) {
+  case XTHREAD_TIMER_CALL:
+    rb_funcall(timer->target, rb_intern("call"), 1, self);
+    break;
+  case XTHREAD_TIMER_PUSH:
+    /* subclasses check, journal or spill their items in their own push */
+    if (CLASS_OF(timer->target) == rb_cXThreadQueue) {
+      rb_xthread_queue_push(timer->target, timer->value);
+    }
+    else {
+      rb_funcall(timer->target, rb_intern("push"), 1, timer->value);
+    }
+    break;
+  case XTHREAD_TIMER_WAKEUP:
+    rb_thread_wakeup_alive(timer->target);
+    break;
+  }
+  return Qnil;
+}
+
+/*
+ * takes the expired timers of one slot off the wheel.  They are
+ * collected in an array so that they stay alive while the callbacks,
+ * which may schedule and cancel, run.
+ */
+static VALUE
+xthread_timer_wheel_expire(xthread_timer_wheel_t *wheel, unsigned LONG_LONG t)
+{
+  xthread_timer_t *timer = wheel->slots[t % wheel->nslots];
+  VALUE expired = Qnil;
+
+  while (timer) {
+    xthread_timer_t *next = timer->next;
+
+    if (timer->due <= t) {
+      xthread_timer_wheel_unlink(wheel, timer);
+      timer->state = TIMER_EXPIRED;
+      if (NIL_P(expired)) {
+	expired = rb_ary_new();
+      }
+      rb_ary_push(expired, timer->self);
+    }
+    timer = next;
+  }
+  return expired;
+}
+
+static VALUE
+xthread_timer_wheel_service_body(VALUE self)
+{
+  xthread_timer_wheel_t *wheel;
+
+  GetXThreadTimerWheelPtr(self, wheel);
+
+  while (wheel->count > 0) {
+    unsigned LONG_LONG now = xthread_timer_wheel_now(wheel);
+
+    while (wheel->current < now && wheel->count > 0) {
+      VALUE expired;
+      long i;
+
+      wheel->current++;
+      expired = xthread_timer_wheel_expire(wheel, wheel->current);
+      if (NIL_P(expired)) {
+	continue;
+      }
+      for (i = 0; i < RARRAY_LEN(expired); i++) {
+	int state;
+
+	rb_protect(xthread_timer_fire, RARRAY_AREF(expired, i), &state);
+	if (state) {
+	  VALUE err = rb_errinfo();
+
+	  rb_set_errinfo(Qnil);
+	  rb_warn("exception in timer callback: %"PRIsVALUE, rb_inspect(err));
+	}
+      }
+    }
+
+    if (wheel->count > 0) {
+      xthread_hrtime_t next = wheel->start + (wheel->current + 1) * wheel->tick;
+      xthread_hrtime_t hrnow = rb_xthread_hrtime();
+
+      if (next > hrnow) {
+	struct timeval tv;
+
+	tv.tv_sec = (next - hrnow) / XTHREAD_NSEC_PER_SEC;
+	tv.tv_usec = ((next - hrnow) % XTHREAD_NSEC_PER_SEC) / 1000;
+	rb_thread_wait_for(tv);
+      }
+    }
+  }
+  return Qnil;
+}
+
+static VALUE
+xthread_timer_wheel_service_leave(VALUE self)
+{
+  xthread_timer_wheel_t *wheel;
+
+  GetXThreadTimerWheelPtr(self, wheel);
+  RB_OBJ_WRITE(self, &wheel->thread, Qnil);
+  return Qnil;
+}
+
+static VALUE
+xthread_timer_wheel_service(void *ptr)
+{
+  return rb_ensure(xthread_timer_wheel_service_body, (VALUE)ptr,
+		   xthread_timer_wheel_service_leave, (VALUE)ptr);
+}
+
+/*
+ * true while the service thread runs.  Its liveness is only asked
+ * after a fork, and a dead thread inherited from the parent is
+ * forgotten.
+ */
+static int
+xthread_timer_wheel_serviced_p(VALUE self, xthread_timer_wheel_t *wheel)
+{
+  static ID id_alive_p;
+
+  if (NIL_P(wheel->thread)) {
+    return 0;
+  }
+  if (wheel->generation == TIMER_WHEEL_FORK_GENERATION()) {
+    return 1;
+  }
+  if (!id_alive_p) {
+    id_alive_p = rb_intern("alive?");
+  }
+  if (!RTEST(rb_funcall(wheel->thread, id_alive_p, 0))) {
+    RB_OBJ_WRITE(self, &wheel->thread, Qnil);
+    return 0;
+  }
+  /* the service thread itself forked */
+  wheel->generation = TIMER_WHEEL_FORK_GENERATION();
+  return 1;
+}
+
+VALUE
+rb_xthread_timer_wheel_schedule(VALUE self, double delay, int kind, VALUE target, VALUE value)
+{
+  xthread_timer_wheel_t *wheel;
+  xthread_timer_t *timer;
+  VALUE obj;
+  unsigned LONG_LONG now;
+  unsigned LONG_LONG due;
+  xthread_hrtime_t elapsed;
+  int serviced;
+
+  GetXThreadTimerWheelPtr(self, wheel);
+  if (!wheel->slots) {
+    rb_raise(rb_eArgError, "uninitialized timer wheel");
+  }
+
+  elapsed = rb_xthread_hrtime() - wheel->start;
+  now = elapsed / wheel->tick;
+  serviced = xthread_timer_wheel_serviced_p(self, wheel);
+  if (wheel->count == 0 && !serviced) {
+    /* idle wheel: nothing to catch up on */
+    wheel->current = now;
+  }
+  /* tick t is processed once t ticks have elapsed, so rounding the due
+     time up never fires a timer early */
+  if (delay > 0) {
+    elapsed += (xthread_hrtime_t)(delay * XTHREAD_NSEC_PER_SEC);
+  }
+  due = (elapsed + wheel->tick - 1) / wheel->tick;
+  if (due <= wheel->current) {
+    due = wheel->current + 1;
+  }
+
+  obj = TypedData_Make_Struct(rb_cXThreadTimer, xthread_timer_t,
+			      &xthread_timer_data_type, timer);
+  timer->self = obj;
+  RB_OBJ_WRITE(obj, &timer->wheel, self);
+  timer->state = TIMER_PENDING;
+  timer->kind = kind;
+  timer->due = due;
+  RB_OBJ_WRITE(obj, &timer->target, target);
+  RB_OBJ_WRITE(obj, &timer->value, value);
+
+  xthread_timer_wheel_link(self, wheel, timer);
+  if (!serviced) {
+    RB_OBJ_WRITE(self, &wheel->thread,
+		 rb_thread_create(xthread_timer_wheel_service, (void *)self));
+    wheel->generation = TIMER_WHEEL_FORK_GENERATION();
+  }
+  return obj;
+}
+
+/*
+ *  call-seq:
+ *     schedule(delay) {|timer| ...}         -> timer
+ *     schedule(delay, queue, value = timer) -> timer
+ *
+ *  Arranges for the block to be called, or +value+ to be pushed onto
+ *  +queue+, +delay+ seconds from now.  Callbacks run in the service
+ *  thread and should be short.  The push is the queue's own, so a full
+ *  SizedQueue that does not spill holds up the wheel until it has room.
+ */
+static VALUE
+xthread_timer_wheel_schedule(int argc, VALUE *argv, VALUE self)
+{
+  VALUE delay;
+  VALUE queue;
+  VALUE value;
+  VALUE timer;
+
+  rb_scan_args(argc, argv, "12", &delay, &queue, &value);
+
+  if (!NIL_P(queue)) {
+    timer = rb_xthread_timer_wheel_schedule(self, NUM2DBL(delay), XTHREAD_TIMER_PUSH, queue, value);
+    if (argc < 3) {
+      xthread_timer_t *t;
+
+      GetXThreadTimerPtr(timer, t);
+      RB_OBJ_WRITE(timer, &t->value, timer);
+    }
+    return timer;
+  }
+  if (!rb_block_given_p()) {
+    rb_raise(rb_eArgError, "no block or queue given");
+  }
+  return rb_xthread_timer_wheel_schedule(self, NUM2DBL(delay), XTHREAD_TIMER_CALL, rb_block_proc(), Qnil);
+}
+
+/*
+ * wakes +th+ up after +delay+ seconds; the timeout path of the blocking
+ * primitives.
+ */
+VALUE
+rb_xthread_timer_wheel_wakeup(VALUE self, double delay, VALUE th)
+{
+  return rb_xthread_timer_wheel_schedule(self, delay, XTHREAD_TIMER_WAKEUP, th, Qnil);
+}
+
+VALUE
+rb_xthread_timer_cancel(VALUE self)
+{
+  xthread_timer_t *timer;
+  xthread_timer_wheel_t *wheel;
+
+  GetXThreadTimerPtr(self, timer);
+  if (timer->state != TIMER_PENDING) {
+    return Qfalse;
+  }
+  GetXThreadTimerWheelPtr(timer->wheel, wheel);
+  xthread_timer_wheel_unlink(wheel, timer);
+  timer->state = TIMER_CANCELLED;
+  return Qtrue;
+}
+
+VALUE
+rb_xthread_timer_expired_p(VALUE self)
+{
+  xthread_timer_t *timer;
+
+  GetXThreadTimerPtr(self, timer);
+  return timer->state == TIMER_EXPIRED ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_timer_cancelled_p(VALUE self)
+{
+  xthread_timer_t *timer;
+
+  GetXThreadTimerPtr(self, timer);
+  return timer->state == TIMER_CANCELLED ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_xthread_timer_pending_p(VALUE self)
+{
+  xthread_timer_t *timer;
+
+  GetXThreadTimerPtr(self, timer);
+  return timer->state == TIMER_PENDING ? Qtrue : Qfalse;
+}
+
+static VALUE
+xthread_timer_wheel_cancel(VALUE self, VALUE timer)
+{
+  return rb_xthread_timer_cancel(timer);
+}
+
+VALUE
+rb_xthread_timer_wheel_length(VALUE self)
+{
+  xthread_timer_wheel_t *wheel;
+
+  GetXThreadTimerWheelPtr(self, wheel);
+  return LONG2NUM(wheel->count);
+}
+
+VALUE
+rb_xthread_timer_wheel_tick(VALUE self)
+{
+  xthread_timer_wheel_t *wheel;
+
+  GetXThreadTimerWheelPtr(self, wheel);
+  return DBL2NUM((double)wheel->tick / XTHREAD_NSEC_PER_SEC);
+}
+
+void
+Init_XThreadTimerWheel(void)
+{
+  rb_cXThreadTimerWheel = rb_define_class_under(rb_mXThread, "TimerWheel", rb_cObject);
+  rb_cXThreadTimer = rb_define_class_under(rb_cXThreadTimerWheel, "Timer", rb_cObject);
+  rb_undef_alloc_func(rb_cXThreadTimer);
+#ifdef HAVE_PTHREAD_ATFORK
+  pthread_atfork(NULL, NULL, xthread_timer_wheel_atfork_child);
+#endif
+
+  rb_global_variable(&xthread_timer_wheel_default);
+
+  rb_define_alloc_func(rb_cXThreadTimerWheel, xthread_timer_wheel_alloc);
+  rb_define_singleton_method(rb_cXThreadTimerWheel, "default", xthread_timer_wheel_s_default, 0);
+  rb_define_method(rb_cXThreadTimerWheel, "initialize", xthread_timer_wheel_initialize, -1);
+  rb_define_method(rb_cXThreadTimerWheel, "schedule", xthread_timer_wheel_schedule, -1);
+  rb_define_method(rb_cXThreadTimerWheel, "cancel", xthread_timer_wheel_cancel, 1);
+  rb_define_method(rb_cXThreadTimerWheel, "tick", rb_xthread_timer_wheel_tick, 0);
+  rb_define_method(rb_cXThreadTimerWheel, "length", rb_xthread_timer_wheel_length, 0);
+  rb_define_alias(rb_cXThreadTimerWheel,  "size", "length");
+
+  rb_define_method(rb_cXThreadTimer, "cancel", rb_xthread_timer_cancel, 0);
+  rb_define_method(rb_cXThreadTimer, "expired?", rb_xthread_timer_expired_p, 0);
+  rb_define_method(rb_cXThreadTimer, "cancelled?", rb_xthread_timer_cancelled_p, 0);
+  rb_define_method(rb_cXThreadTimer, "pending?", rb_xthread_timer_pending_p, 0);
+}
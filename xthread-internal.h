@@ -0,0 +1,241 @@
+/**********************************************************************
+
+  xthread-internal.h -
+
+  Copyright (C) 2011 Keiju Ishitsuka
+  Copyright (C) 2011 Penta Advanced Laboratories, Inc.
+
+**********************************************************************/
+
+#ifndef XTHREAD_INTERNAL_H
+#define XTHREAD_INTERNAL_H
+
+/*
+ * declarations shared by the xthread sources only.  Nothing here is
+ * part of the API in xthread.h and it may change in any release.
+ */
+
+#include "xthread.h"
+
+#ifndef RUBY_TYPED_WB_PROTECTED
+#define RUBY_TYPED_WB_PROTECTED 0
+#endif
+#ifndef RB_OBJ_WRITE
+#define RB_OBJ_WRITE(a, slot, b) (*(slot) = (b))
+#endif
+#ifndef HAVE_RB_GC_MARK_MOVABLE
+#define rb_gc_mark_movable(obj) rb_gc_mark(obj)
+#define rb_gc_location(obj) (obj)
+#endif
+
+typedef struct rb_xthread_fifo_struct
+{
+  long push;
+  long pop;
+  long capa;
+  
+  VALUE *elements;
+  /* push times, parallel to elements; NULL unless enabled */
+  xthread_hrtime_t *stamps;
+} xthread_fifo_t;
+
+#define XTHREAD_FIFO_RING_LENGTH(fifo) ((fifo)->push - (fifo)->pop)
+#define XTHREAD_FIFO_RING_EMPTY_P(fifo) ((fifo)->push == (fifo)->pop)
+/* physical slot of the i-th element from the head */
+#define XTHREAD_FIFO_RING_INDEX(fifo, i) \
+  ((fifo)->pop + (i) < (fifo)->capa ? \
+   (fifo)->pop + (i) : (fifo)->pop + (i) - (fifo)->capa)
+
+RUBY_EXTERN void xthread_fifo_ring_init(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_mark(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_compact(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_free(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_push(xthread_fifo_t *, VALUE, VALUE);
+RUBY_EXTERN VALUE xthread_fifo_ring_pop(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_unshift(xthread_fifo_t *, VALUE, VALUE);
+RUBY_EXTERN VALUE xthread_fifo_ring_pop_back(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_clear(xthread_fifo_t *);
+RUBY_EXTERN int xthread_fifo_ring_delete(xthread_fifo_t *, VALUE);
+RUBY_EXTERN void xthread_fifo_ring_cat(xthread_fifo_t *, VALUE, long, long);
+RUBY_EXTERN void xthread_fifo_ring_enable_stamps(xthread_fifo_t *);
+RUBY_EXTERN void xthread_fifo_ring_disable_stamps(xthread_fifo_t *);
+
+/* log-linear latency histogram (histogram.c) */
+typedef struct rb_xthread_histogram_struct xthread_histogram_t;
+
+RUBY_EXTERN xthread_histogram_t *xthread_histogram_new(void);
+RUBY_EXTERN void xthread_histogram_free(xthread_histogram_t *);
+RUBY_EXTERN size_t xthread_histogram_memsize(const xthread_histogram_t *);
+RUBY_EXTERN void xthread_histogram_record(xthread_histogram_t *, xthread_hrtime_t);
+RUBY_EXTERN void xthread_histogram_reset(xthread_histogram_t *);
+RUBY_EXTERN unsigned LONG_LONG xthread_histogram_count(const xthread_histogram_t *);
+RUBY_EXTERN xthread_hrtime_t xthread_histogram_percentile(const xthread_histogram_t *, double);
+
+RUBY_EXTERN void xthread_waiters_wait(VALUE, xthread_fifo_t *);
+RUBY_EXTERN int xthread_waiters_wait_for(VALUE, xthread_fifo_t *, double);
+RUBY_EXTERN void xthread_waiters_signal(xthread_fifo_t *);
+RUBY_EXTERN long xthread_waiters_signal_n(xthread_fifo_t *, long);
+RUBY_EXTERN void xthread_waiters_broadcast(xthread_fifo_t *);
+
+typedef struct rb_xthread_spill_struct xthread_spill_t;
+
+RUBY_EXTERN xthread_spill_t *xthread_spill_new(const char *, size_t);
+RUBY_EXTERN void xthread_spill_free(xthread_spill_t *);
+RUBY_EXTERN void xthread_spill_push(xthread_spill_t *, VALUE);
+RUBY_EXTERN VALUE xthread_spill_shift(xthread_spill_t *);
+RUBY_EXTERN long xthread_spill_length(xthread_spill_t *);
+
+typedef struct rb_xthread_journal_struct xthread_journal_t;
+
+#define XTHREAD_JOURNAL_SYNC_NONE 0
+#define XTHREAD_JOURNAL_SYNC_ALWAYS 1
+#define XTHREAD_JOURNAL_SYNC_INTERVAL 2
+
+RUBY_EXTERN xthread_journal_t *xthread_journal_open(const char *, int, double, VALUE, xthread_fifo_t *);
+RUBY_EXTERN void xthread_journal_mark(xthread_journal_t *);
+RUBY_EXTERN void xthread_journal_compact_refs(xthread_journal_t *);
+RUBY_EXTERN void xthread_journal_free(xthread_journal_t *);
+RUBY_EXTERN size_t xthread_journal_memsize(const xthread_journal_t *);
+RUBY_EXTERN void xthread_journal_push(VALUE, xthread_journal_t *, VALUE);
+RUBY_EXTERN void xthread_journal_ack(VALUE, xthread_journal_t *);
+RUBY_EXTERN void xthread_journal_clear(VALUE, xthread_journal_t *);
+RUBY_EXTERN void xthread_journal_sync(VALUE, xthread_journal_t *);
+RUBY_EXTERN void xthread_journal_compact(VALUE, xthread_journal_t *, xthread_fifo_t *);
+
+/* ChainList entries, walked by the entry callback */
+#define rb_cXTCL rb_cXThreadChainList
+#define rb_xtcl(name) rb_xthread_chain_list##name
+#define xtcl(name) xthread_chain_list##name
+
+typedef struct rb_xtcl(_entry_strct)
+{
+  VALUE element;
+  struct rb_xtcl(_entry_strct) *next;
+} xtcl(_entry_t);
+
+typedef struct rb_xtcl(_strct)
+{
+  long length;
+  xtcl(_entry_t) *head;
+  xtcl(_entry_t) *tail;
+} xtcl(_t);
+
+RUBY_EXTERN VALUE rb_xtcl(_each_entry_callback)(VALUE, VALUE(*)(xtcl(_entry_t)*, VALUE), VALUE);
+
+/*
+ * word-sized atomics on a VALUE slot, sequentially consistent.  They
+ * use the compiler's builtins, else ruby/atomic.h, else plain access,
+ * which the GVL then serializes.
+ */
+#if defined(__GNUC__) && defined(__ATOMIC_SEQ_CST)
+static inline VALUE
+xthread_atomic_load(VALUE *p)
+{
+  return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+xthread_atomic_store(VALUE *p, VALUE v)
+{
+  __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline VALUE
+xthread_atomic_exchange(VALUE *p, VALUE v)
+{
+  return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+/* true when *p was expected and is now desired */
+static inline int
+xthread_atomic_cas(VALUE *p, VALUE expected, VALUE desired)
+{
+  return __atomic_compare_exchange_n(p, &expected, desired, 0,
+				     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline VALUE
+xthread_atomic_fetch_add(VALUE *p, VALUE d)
+{
+  return __atomic_fetch_add(p, d, __ATOMIC_SEQ_CST);
+}
+#elif defined(HAVE_RUBY_ATOMIC_H)
+#include "ruby/atomic.h"
+
+static inline VALUE
+xthread_atomic_load(VALUE *p)
+{
+  return *(volatile VALUE *)p;
+}
+
+static inline VALUE
+xthread_atomic_exchange(VALUE *p, VALUE v)
+{
+  return RUBY_ATOMIC_VALUE_EXCHANGE(*p, v);
+}
+
+static inline void
+xthread_atomic_store(VALUE *p, VALUE v)
+{
+  xthread_atomic_exchange(p, v);
+}
+
+static inline int
+xthread_atomic_cas(VALUE *p, VALUE expected, VALUE desired)
+{
+  return RUBY_ATOMIC_VALUE_CAS(*p, expected, desired) == expected;
+}
+
+static inline VALUE
+xthread_atomic_fetch_add(VALUE *p, VALUE d)
+{
+  VALUE old;
+
+  do {
+    old = xthread_atomic_load(p);
+  } while (!xthread_atomic_cas(p, old, old + d));
+  return old;
+}
+#else
+static inline VALUE
+xthread_atomic_load(VALUE *p)
+{
+  return *p;
+}
+
+static inline void
+xthread_atomic_store(VALUE *p, VALUE v)
+{
+  *p = v;
+}
+
+static inline VALUE
+xthread_atomic_exchange(VALUE *p, VALUE v)
+{
+  VALUE old = *p;
+
+  *p = v;
+  return old;
+}
+
+static inline int
+xthread_atomic_cas(VALUE *p, VALUE expected, VALUE desired)
+{
+  if (*p != expected) {
+    return 0;
+  }
+  *p = desired;
+  return 1;
+}
+
+static inline VALUE
+xthread_atomic_fetch_add(VALUE *p, VALUE d)
+{
+  VALUE old = *p;
+
+  *p = old + d;
+  return old;
+}
+#endif
+
+#endif /* XTHREAD_INTERNAL_H */
@@ -9,22 +9,72 @@
 
 #include "ruby.h"
 
+#include "xthread.h"
+#include "xthread-internal.h"
+
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+
 extern void Init_XThreadFifo();
 extern void Init_XThreadChainList();
 extern void Init_XThreadCond();
 extern void Init_XThreadQueue();
 extern void Init_XThreadMonitor();
+extern void Init_XThreadDelayQueue();
+extern void Init_XThreadTimerWheel();
+extern void Init_XThreadShardedQueue();
+extern void Init_XThreadSortedList();
+extern void Init_XThreadLRUCache();
+extern void Init_XThreadMap();
+extern void Init_XThreadAtomic();
 
 VALUE rb_mXThread;
 
+xthread_hrtime_t
+rb_xthread_hrtime(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (xthread_hrtime_t)ts.tv_sec * XTHREAD_NSEC_PER_SEC + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (xthread_hrtime_t)tv.tv_sec * XTHREAD_NSEC_PER_SEC + tv.tv_usec * 1000;
+#endif
+}
+
+void
+rb_xthread_check_api_version(int major, int minor)
+{
+  if (major != XTHREAD_API_VERSION_MAJOR || minor > XTHREAD_API_VERSION_MINOR) {
+    rb_raise(rb_eLoadError, "xthread C API %d.%d required, but %d.%d is loaded",
+	     major, minor, XTHREAD_API_VERSION_MAJOR, XTHREAD_API_VERSION_MINOR);
+  }
+}
+
 Init_xthread()
 {
   rb_mXThread = rb_define_module("XThread");
+  rb_define_const(rb_mXThread, "API_VERSION",
+		  rb_sprintf("%d.%d", XTHREAD_API_VERSION_MAJOR, XTHREAD_API_VERSION_MINOR));
 
   Init_XThreadFifo();
   Init_XThreadChainList();
   Init_XThreadCond();
   Init_XThreadQueue();
   Init_XThreadMonitor();
+  Init_XThreadDelayQueue();
+  Init_XThreadTimerWheel();
+  Init_XThreadShardedQueue();
+  Init_XThreadSortedList();
+  Init_XThreadLRUCache();
+  Init_XThreadMap();
+  Init_XThreadAtomic();
 }
 
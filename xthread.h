@@ -7,42 +7,80 @@
 
 **********************************************************************/
 
+#ifndef XTHREAD_H
+#define XTHREAD_H
+
+/*
+ * C API of xthread for other extensions.
+ *
+ * The symbols are resolved from xthread.so, so require "xthread" before
+ * loading an extension that uses them, and call XTHREAD_API_CHECK() in
+ * its Init function.  Within one major version functions are only ever
+ * added (each addition bumps the minor version) and never change their
+ * signature.
+ */
+
+#include "ruby.h"
 
 #define XTHREAD_VERSION "0.1.5"
 
+#define XTHREAD_API_VERSION_MAJOR 1
+#define XTHREAD_API_VERSION_MINOR 6
+
+/* raises LoadError unless the loaded xthread.so provides this API */
+RUBY_EXTERN void rb_xthread_check_api_version(int, int);
+#define XTHREAD_API_CHECK() \
+  rb_xthread_check_api_version(XTHREAD_API_VERSION_MAJOR, XTHREAD_API_VERSION_MINOR)
+
+/* results of the non-raising queue calls */
+typedef enum {
+  XTHREAD_OK = 0,
+  XTHREAD_EMPTY,		/* nothing to take */
+  XTHREAD_FULL,			/* no room */
+  XTHREAD_CLOSED,		/* closed (and, for a pop, empty) */
+  XTHREAD_TIMEOUT,		/* the timeout passed first */
+  XTHREAD_INVALID		/* an item the queue cannot hold (1.6) */
+} xthread_status_t;
+
 RUBY_EXTERN VALUE rb_mXThread;
 RUBY_EXTERN VALUE rb_cXThreadFifo;
+RUBY_EXTERN VALUE rb_cXThreadChainList;
 RUBY_EXTERN VALUE rb_cXThreadConditionVariable;
 RUBY_EXTERN VALUE rb_cXThreadQueue;
 RUBY_EXTERN VALUE rb_cXThreadSizedQueue;
+RUBY_EXTERN VALUE rb_cXThreadJournalQueue;
+RUBY_EXTERN VALUE rb_cXThreadDelayQueue;
+RUBY_EXTERN VALUE rb_cXThreadShardedQueue;
+RUBY_EXTERN VALUE rb_cXThreadSortedList;
+RUBY_EXTERN VALUE rb_cXThreadLRUCache;
+RUBY_EXTERN VALUE rb_cXThreadMap;
+RUBY_EXTERN VALUE rb_cXThreadAtomicInteger;
+RUBY_EXTERN VALUE rb_cXThreadAtomicReference;
+RUBY_EXTERN VALUE rb_cXThreadAdder;
+RUBY_EXTERN VALUE rb_cXThreadTimerWheel;
+RUBY_EXTERN VALUE rb_cXThreadTimer;
 RUBY_EXTERN VALUE rb_cXThreadMonitor;
 RUBY_EXTERN VALUE rb_cXThreadMonitorCond;
+RUBY_EXTERN VALUE rb_mXThreadMonitorMixin;
 
+/* monotonic clock in nanoseconds */
+typedef unsigned LONG_LONG xthread_hrtime_t;
+#define XTHREAD_NSEC_PER_SEC 1000000000
+RUBY_EXTERN xthread_hrtime_t rb_xthread_hrtime(void);
 
 RUBY_EXTERN VALUE rb_xthread_fifo_new(void);
 RUBY_EXTERN VALUE rb_xthread_fifo_empty_p(VALUE);
 RUBY_EXTERN VALUE rb_xthread_fifo_push(VALUE, VALUE);
 RUBY_EXTERN VALUE rb_xthread_fifo_pop(VALUE);
+RUBY_EXTERN VALUE rb_xthread_fifo_unshift(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_fifo_pop_back(VALUE);
+RUBY_EXTERN VALUE rb_xthread_fifo_first(VALUE);
+RUBY_EXTERN VALUE rb_xthread_fifo_last(VALUE);
 RUBY_EXTERN VALUE rb_xthread_fifo_clear(VALUE);
 RUBY_EXTERN VALUE rb_xthread_fifo_length(VALUE);
-
-#define rb_cXTCL rb_cXThreadChainList
-#define rb_xtcl(name) rb_xthread_chain_list##name
-#define xtcl(name) xthread_chain_list##name
-
-typedef struct rb_xtcl(_entry_strct)
-{
-  VALUE element;
-  struct rb_xtcl(_entry_strct) *next;
-} xtcl(_entry_t);
-
-typedef struct rb_xtcl(_strct)
-{
-  long length;
-  xtcl(_entry_t) *head;
-  xtcl(_entry_t) *tail;
-} xtcl(_t);
-
+RUBY_EXTERN VALUE rb_xthread_fifo_shift_n(VALUE, long);
+RUBY_EXTERN VALUE rb_xthread_fifo_each(VALUE);
+RUBY_EXTERN VALUE rb_xthread_fifo_to_a(VALUE);
 
 RUBY_EXTERN VALUE rb_xthread_chain_list_new(void);
 RUBY_EXTERN VALUE rb_xthread_chain_list_new2(VALUE);
@@ -56,35 +94,190 @@ RUBY_EXTERN VALUE rb_xthread_chain_list_unshift(VALUE, VALUE);
 RUBY_EXTERN VALUE rb_xthread_chain_list_pop(VALUE);
 RUBY_EXTERN VALUE rb_xthread_chain_list_shift(VALUE);
 RUBY_EXTERN VALUE rb_xthread_chain_list_each_callback(VALUE, VALUE(*)(VALUE, VALUE), VALUE);
-RUBY_EXTERN VALUE rb_xtcl(_each_entry_callback)(VALUE, VALUE(*)(xtcl(_entry_t)*, VALUE), VALUE);
-
-RUBY_EXTERN VALUE rb_xtcl(_insert_before)(VALUE self, VALUE item);
-RUBY_EXTERN VALUE rb_xtcl(_insert_before_callback)(VALUE, VALUE, VALUE(*)(VALUE, VALUE), VALUE);
+RUBY_EXTERN VALUE rb_xthread_chain_list_insert_before(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_chain_list_insert_before_callback(VALUE, VALUE, VALUE(*)(VALUE, VALUE), VALUE);
 
 RUBY_EXTERN VALUE rb_xthread_chain_list_to_a(VALUE);
+RUBY_EXTERN VALUE rb_xthread_chain_list_each_slice(VALUE, long);
 RUBY_EXTERN VALUE rb_xthread_chain_list_inspect(VALUE);
 
+RUBY_EXTERN VALUE rb_xthread_sorted_list_new(void);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_new_with_cmp(int (*)(VALUE, VALUE));
+RUBY_EXTERN VALUE rb_xthread_sorted_list_push(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_delete(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_first(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_last(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_pop_min(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_pop_max(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_lower_bound(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_each(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_each_range(VALUE, VALUE, VALUE, int);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_empty_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_to_a(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sorted_list_inspect(VALUE);
+
+RUBY_EXTERN VALUE rb_xthread_lru_cache_new(long);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_get(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_put(VALUE, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_delete(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_key_p(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_evict(VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_to_a(VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_lru_cache_stats(VALUE);
+
+RUBY_EXTERN VALUE rb_xthread_map_new(long);
+RUBY_EXTERN VALUE rb_xthread_map_get(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_key_p(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_put(VALUE, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_put_if_absent(VALUE, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_delete(VALUE, VALUE);
+/* func(key, old value or nil, arg) */
+RUBY_EXTERN VALUE rb_xthread_map_compute_if_absent(VALUE, VALUE, VALUE (*)(VALUE, VALUE, VALUE), VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_compute(VALUE, VALUE, VALUE (*)(VALUE, VALUE, VALUE), VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_merge(VALUE, VALUE, VALUE, VALUE (*)(VALUE, VALUE, VALUE), VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_size(VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_each(VALUE);
+RUBY_EXTERN VALUE rb_xthread_map_to_h(VALUE);
+
+/* atomic even when the caller runs without the GVL */
+RUBY_EXTERN VALUE rb_xthread_atomic_integer_new(ssize_t);
+RUBY_EXTERN VALUE rb_xthread_atomic_integer_get(VALUE);
+RUBY_EXTERN VALUE rb_xthread_atomic_integer_set(VALUE, VALUE);
+/* returns the new value */
+RUBY_EXTERN ssize_t rb_xthread_atomic_integer_add(VALUE, ssize_t);
+RUBY_EXTERN VALUE rb_xthread_atomic_integer_compare_and_set(VALUE, VALUE, VALUE);
+
+RUBY_EXTERN VALUE rb_xthread_atomic_reference_new(VALUE);
+RUBY_EXTERN VALUE rb_xthread_atomic_reference_get(VALUE);
+RUBY_EXTERN VALUE rb_xthread_atomic_reference_set(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_atomic_reference_compare_and_set(VALUE, VALUE, VALUE);
+
+RUBY_EXTERN VALUE rb_xthread_adder_new(long);
+RUBY_EXTERN void rb_xthread_adder_add(VALUE, ssize_t);
+RUBY_EXTERN ssize_t rb_xthread_adder_sum(VALUE);
+
+
 RUBY_EXTERN VALUE rb_xthread_cond_new(void);
 RUBY_EXTERN VALUE rb_xthread_cond_signal(VALUE);
+RUBY_EXTERN VALUE rb_xthread_cond_signal_n(VALUE, long);
 RUBY_EXTERN VALUE rb_xthread_cond_broadcast(VALUE);
+RUBY_EXTERN VALUE rb_xthread_cond_staged_broadcast(VALUE);
 RUBY_EXTERN VALUE rb_xthread_cond_wait(VALUE, VALUE, VALUE);
 
 RUBY_EXTERN VALUE rb_xthread_queue_new(void);
+/* push and pop take any kind of queue and act like its own methods */
 RUBY_EXTERN VALUE rb_xthread_queue_push(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_requeue_front(VALUE, VALUE);
 RUBY_EXTERN VALUE rb_xthread_queue_pop(VALUE);
 RUBY_EXTERN VALUE rb_xthread_queue_pop_non_block(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_pop_timeout(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_close(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_closed_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_num_waiting(VALUE);
 RUBY_EXTERN VALUE rb_xthread_queue_empty_p(VALUE);
 RUBY_EXTERN VALUE rb_xthread_queue_clear(VALUE);
 RUBY_EXTERN VALUE rb_xthread_queue_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_enable_latency_tracking(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_disable_latency_tracking(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_latency_tracking_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_latency_count(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_reset_latency(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_stats(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_metrics_name(VALUE);
+RUBY_EXTERN VALUE rb_xthread_queue_set_metrics_name(VALUE, VALUE);
+
+/*
+ * status code calls for Queue, SizedQueue and JournalQueue.  They
+ * report empty, full, closed and timeout instead of raising or
+ * blocking; a timeout below 0 waits without limit.  The batch calls
+ * move items until the first one that cannot go without waiting and
+ * return how many were moved.  A JournalQueue only holds Strings and
+ * reports other items as XTHREAD_INVALID; failing to write its journal
+ * still raises.
+ */
+RUBY_EXTERN xthread_status_t rb_xthread_queue_try_push(VALUE, VALUE);
+RUBY_EXTERN xthread_status_t rb_xthread_queue_try_pop(VALUE, VALUE *);
+RUBY_EXTERN xthread_status_t rb_xthread_queue_timed_push(VALUE, VALUE, double);
+RUBY_EXTERN xthread_status_t rb_xthread_queue_timed_pop(VALUE, VALUE *, double);
+RUBY_EXTERN long rb_xthread_queue_push_batch(VALUE, const VALUE *, long);
+RUBY_EXTERN long rb_xthread_queue_pop_batch(VALUE, VALUE *, long);
 
 RUBY_EXTERN VALUE rb_xthread_sized_queue_new(long);
 RUBY_EXTERN VALUE rb_xthread_sized_queue_max(VALUE);
 RUBY_EXTERN VALUE rb_xthread_sized_queue_set_max(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_enable_adaptive(VALUE, VALUE, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_disable_adaptive(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_adaptive_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_spill_to(VALUE, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_spilled_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_length(VALUE);
 RUBY_EXTERN VALUE rb_xthread_sized_queue_push(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_push_timeout(VALUE, VALUE, VALUE);
 RUBY_EXTERN VALUE rb_xthread_sized_queue_pop(VALUE);
 RUBY_EXTERN VALUE rb_xthread_sized_queue_pop_non_block(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_pop_timeout(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_close(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sized_queue_num_waiting(VALUE);
+
+
+RUBY_EXTERN VALUE rb_xthread_journal_queue_push(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_journal_queue_pop(VALUE);
+RUBY_EXTERN VALUE rb_xthread_journal_queue_pop_non_block(VALUE);
+RUBY_EXTERN VALUE rb_xthread_journal_queue_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_journal_queue_sync(VALUE);
+RUBY_EXTERN VALUE rb_xthread_journal_queue_compact(VALUE);
+
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_new(long, int);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_push(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_pop(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_pop_non_block(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_close(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_closed_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_empty_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_num_waiting(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_lanes(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_ordered_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_sharded_queue_lane_lengths(VALUE);
+
+RUBY_EXTERN VALUE rb_xthread_delay_queue_new(void);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_push(VALUE, VALUE, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_pop(VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_pop_non_block(VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_delay(VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_clear(VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_empty_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_delay_queue_num_waiting(VALUE);
+
+/* what an expiring timer does */
+#define XTHREAD_TIMER_CALL 0
+#define XTHREAD_TIMER_PUSH 1
+#define XTHREAD_TIMER_WAKEUP 2
+
+RUBY_EXTERN VALUE rb_xthread_timer_wheel_new(double, long);
+RUBY_EXTERN VALUE rb_xthread_timer_wheel_default(void);
+RUBY_EXTERN VALUE rb_xthread_timer_wheel_schedule(VALUE, double, int, VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_wheel_wakeup(VALUE, double, VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_wheel_length(VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_wheel_tick(VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_cancel(VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_expired_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_cancelled_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_timer_pending_p(VALUE);
 
 RUBY_EXTERN VALUE rb_xthread_monitor_new(void);
+RUBY_EXTERN VALUE rb_xthread_monitor_policy(VALUE);
+RUBY_EXTERN VALUE rb_xthread_monitor_set_policy(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_monitor_locked_p(VALUE);
+RUBY_EXTERN VALUE rb_xthread_monitor_valid_owner_p(VALUE);
 RUBY_EXTERN VALUE rb_xthread_monitor_try_enter(VALUE);
 RUBY_EXTERN VALUE rb_xthread_monitor_enter(VALUE);
 RUBY_EXTERN VALUE rb_xthread_monitor_exit(VALUE);
@@ -93,11 +286,10 @@ RUBY_EXTERN VALUE rb_xthread_monitor_new_cond(VALUE);
 
 RUBY_EXTERN VALUE rb_xthread_monitor_cond_new(VALUE);
 RUBY_EXTERN VALUE rb_xthread_monitor_cond_wait(VALUE, VALUE);
-RUBY_EXTERN VALUE rb_xthread_monitor_cond_wait_while(VALUE);
-RUBY_EXTERN VALUE rb_xthread_monitor_cond_wait_until(VALUE);
+RUBY_EXTERN VALUE rb_xthread_monitor_cond_wait_for(VALUE, VALUE (*)(VALUE), VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_monitor_cond_wait_while(VALUE, VALUE);
+RUBY_EXTERN VALUE rb_xthread_monitor_cond_wait_until(VALUE, VALUE);
 RUBY_EXTERN VALUE rb_xthread_monitor_cond_signal(VALUE);
 RUBY_EXTERN VALUE rb_xthread_monitor_cond_broadcast(VALUE self);
 
-
-
-
+#endif /* XTHREAD_H */